@@ -0,0 +1,799 @@
+/*
+Mod Organizer BSA handling
+
+Copyright (C) 2012 Sebastian Herbord. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+// Benchmarks bsatk on synthetic archives of every supported type. Each variant is
+// written from generated loose files, then opened, searched and extracted. Results
+// are printed as one json object per line (or csv) so they can be tracked over time.
+//
+// With --corpus the archives in a directory are opened and extracted instead, with a
+// total per archive type. --mutate additionally runs damaged copies of each of them to
+// check that broken or hostile archives are rejected rather than crashing the parser.
+//
+// usage: bsatk_bench [--files N] [--size BYTES] [--folders N] [--threads N] [--mapped]
+//                    [--variants NAME,NAME,...] [--format jsonl|csv] [--dir PATH]
+//                    [--corpus PATH] [--mutate N] [--keep] [--list]
+
+#include "bsatk.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+using namespace BSA;
+
+struct Variant
+{
+  const char* name;
+  ArchiveType type;
+  bool compressed;
+  bool textures;
+};
+
+static const Variant VARIANTS[] = {
+    {"morrowind", TYPE_MORROWIND, false, false},
+    {"oblivion", TYPE_OBLIVION, false, false},
+    {"oblivion_zlib", TYPE_OBLIVION, true, false},
+    {"fallout3", TYPE_FALLOUT3, false, false},
+    {"fallout3_zlib", TYPE_FALLOUT3, true, false},
+    {"skyrimse", TYPE_SKYRIMSE, false, false},
+    {"skyrimse_lz4", TYPE_SKYRIMSE, true, false},
+    {"fallout4", TYPE_FALLOUT4, false, false},
+    {"fallout4_zlib", TYPE_FALLOUT4, true, false},
+    {"fallout4_dx10", TYPE_FALLOUT4, true, true},
+    {"fallout4ng7_zlib", TYPE_FALLOUT4NG_7, true, false},
+    {"fallout4ng8_zlib", TYPE_FALLOUT4NG_8, true, false},
+    {"starfield_zlib", TYPE_STARFIELD, true, false},
+    {"starfield_dx10", TYPE_STARFIELD, true, true},
+    {"starfield_lz4_dx10", TYPE_STARFIELD_LZ4_TEXTURE, true, true},
+};
+
+struct Settings
+{
+  unsigned int files   = 2000;
+  unsigned int size    = 64 * 1024;
+  unsigned int folders = 20;
+  unsigned int threads = 0;
+  bool mapped          = false;
+  bool keep            = false;
+  std::string format   = "jsonl";
+  fs::path directory   = fs::temp_directory_path() / "bsatk_bench";
+  std::vector<std::string> variants;
+  // archives to run instead of the synthetic variants
+  fs::path corpus;
+  unsigned int mutations = 0;
+};
+
+struct SourceFile
+{
+  // path inside the archive, with backslashes
+  std::string archivePath;
+  std::string folder;
+  std::string name;
+  fs::path sourcePath;
+  uint64_t size;
+};
+
+struct Result
+{
+  std::string variant;
+  uint64_t files        = 0;
+  uint64_t bytes        = 0;
+  uint64_t archiveBytes = 0;
+  double writeMs        = NAN;
+  double openMs         = NAN;
+  double lookupNs       = NAN;
+  double extractUs      = NAN;
+  double extractAllMs   = NAN;
+  // busy time of the extractAll stages, summed over their threads
+  double stageReadMs       = NAN;
+  double stageDecompressMs = NAN;
+  double stageWriteMs      = NAN;
+  // damaged copies of a corpus archive that were refused
+  uint64_t rejected = 0;
+  std::string error;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+static double millisecondsSince(Clock::time_point start)
+{
+  return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+static const char* typeName(ArchiveType type)
+{
+  switch (type) {
+  case TYPE_MORROWIND:
+    return "morrowind";
+  case TYPE_OBLIVION:
+    return "oblivion";
+  case TYPE_FALLOUT3:
+    return "fallout3";
+  case TYPE_SKYRIMSE:
+    return "skyrimse";
+  case TYPE_FALLOUT4:
+    return "fallout4";
+  case TYPE_STARFIELD:
+    return "starfield";
+  case TYPE_STARFIELD_LZ4_TEXTURE:
+    return "starfield_lz4_texture";
+  case TYPE_FALLOUT4NG_7:
+    return "fallout4ng_7";
+  case TYPE_FALLOUT4NG_8:
+    return "fallout4ng_8";
+  }
+  return "unknown";
+}
+
+/**
+ * fill a buffer with data that compresses about as well as typical game assets: runs
+ * of repeated bytes mixed with noise
+ */
+static void fillSynthetic(std::vector<char>& buffer, std::mt19937& random)
+{
+  size_t pos = 0;
+  while (pos < buffer.size()) {
+    size_t run = (std::min)(buffer.size() - pos, size_t(random() % 64 + 1));
+    if (random() % 2 == 0) {
+      memset(buffer.data() + pos, static_cast<int>(random() % 256), run);
+    } else {
+      for (size_t i = 0; i < run; ++i) {
+        buffer[pos + i] = static_cast<char>(random());
+      }
+    }
+    pos += run;
+  }
+}
+
+/**
+ * generate a BC1 texture with a full mip chain of roughly the requested size
+ */
+static std::vector<char> makeTexture(unsigned int size, std::mt19937& random)
+{
+  // BC1 stores half a byte per pixel, the mips add about a third
+  unsigned int width = 64;
+  while (static_cast<uint64_t>(width) * 2 * width * 2 / 2 <= size) {
+    width *= 2;
+  }
+  unsigned int mipCount = 1;
+  uint64_t dataSize     = 0;
+  for (unsigned int mip = width;; mip /= 2, ++mipCount) {
+    uint64_t blocks = (std::max)(1U, mip / 4);
+    dataSize += blocks * blocks * 8;
+    if (mip == 1) {
+      break;
+    }
+  }
+
+  const uint32_t flags =
+      DDS_HEADER_FLAGS_TEXTURE | DDS_HEADER_FLAGS_LINEARSIZE | DDS_HEADER_FLAGS_MIPMAP;
+
+  DirectX::DDS_HEADER header = {};
+  header.size                = sizeof(DirectX::DDS_HEADER);
+  header.flags               = flags;
+  header.height              = width;
+  header.width               = width;
+  header.pitchOrLinearSize   = width * width / 2;
+  header.mipMapCount         = mipCount;
+  header.ddspf               = DirectX::DDSPF_DXT1;
+  header.caps                = DDS_SURFACE_FLAGS_TEXTURE | DDS_SURFACE_FLAGS_MIPMAP;
+
+  std::vector<char> result(sizeof(uint32_t) + sizeof(header) + dataSize);
+  uint32_t magic = DirectX::DDS_MAGIC;
+  memcpy(result.data(), &magic, sizeof(magic));
+  memcpy(result.data() + sizeof(magic), &header, sizeof(header));
+  std::vector<char> data(dataSize);
+  fillSynthetic(data, random);
+  memcpy(result.data() + sizeof(magic) + sizeof(header), data.data(), data.size());
+  return result;
+}
+
+static std::vector<SourceFile> generateSources(const Settings& settings, bool textures)
+{
+  static const char* EXTENSIONS[] = {".nif", ".kf", ".wav", ".pex", ".txt", ".hkx"};
+
+  fs::path root = settings.directory / (textures ? "source_dds" : "source");
+  fs::remove_all(root);
+  fs::create_directories(root);
+
+  std::mt19937 random(textures ? 2 : 1);
+  std::vector<SourceFile> result;
+  std::vector<char> buffer;
+  for (unsigned int i = 0; i < settings.files; ++i) {
+    SourceFile file;
+    const char* extension =
+        textures ? ".dds" : EXTENSIONS[i % (sizeof(EXTENSIONS) / sizeof(char*))];
+    file.folder      = (textures ? "textures\\set" : "meshes\\set") +
+                  std::to_string(i % (std::max)(settings.folders, 1U));
+    file.name        = "file" + std::to_string(i) + extension;
+    file.archivePath = file.folder + "\\" + file.name;
+    file.sourcePath  = root / std::to_string(i);
+
+    if (textures) {
+      buffer = makeTexture(settings.size, random);
+    } else {
+      // vary the size around the requested one
+      buffer.resize(settings.size / 2 + random() % (settings.size + 1));
+      fillSynthetic(buffer, random);
+    }
+    file.size = buffer.size();
+    std::ofstream output(file.sourcePath, std::ios::binary);
+    output.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    result.push_back(file);
+  }
+  return result;
+}
+
+template <typename T>
+static void writeValue(std::ofstream& output, T value)
+{
+  output.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+/**
+ * bsatk can't write morrowind archives, this puts together the simple format directly
+ */
+static bool writeMorrowind(const fs::path& path, const std::vector<SourceFile>& sources)
+{
+  uint32_t count       = static_cast<uint32_t>(sources.size());
+  uint32_t namesLength = 0;
+  for (const SourceFile& source : sources) {
+    namesLength += static_cast<uint32_t>(source.archivePath.length() + 1);
+  }
+
+  std::ofstream output(path, std::ios::binary);
+  writeValue<uint32_t>(output, 0x100);
+  // offset of the hash table, relative to the end of this header
+  writeValue<uint32_t>(output, count * 12 + namesLength);
+  writeValue<uint32_t>(output, count);
+
+  uint32_t offset = 0;
+  for (const SourceFile& source : sources) {
+    writeValue<uint32_t>(output, static_cast<uint32_t>(source.size));
+    writeValue<uint32_t>(output, offset);
+    offset += static_cast<uint32_t>(source.size);
+  }
+  uint32_t nameOffset = 0;
+  for (const SourceFile& source : sources) {
+    writeValue<uint32_t>(output, nameOffset);
+    nameOffset += static_cast<uint32_t>(source.archivePath.length() + 1);
+  }
+  for (const SourceFile& source : sources) {
+    output.write(source.archivePath.c_str(), source.archivePath.length() + 1);
+  }
+  // the reader ignores the hashes
+  for (uint32_t i = 0; i < count; ++i) {
+    writeValue<uint64_t>(output, 0);
+  }
+  std::vector<char> buffer;
+  for (const SourceFile& source : sources) {
+    buffer.resize(static_cast<size_t>(source.size));
+    std::ifstream input(source.sourcePath, std::ios::binary);
+    input.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    output.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+  }
+  return output.good();
+}
+
+static Result runVariant(const Settings& settings, const Variant& variant,
+                         const std::vector<SourceFile>& sources)
+{
+  Result result;
+  result.variant = variant.name;
+  result.files   = sources.size();
+  for (const SourceFile& source : sources) {
+    result.bytes += source.size;
+  }
+
+  const char* extension = (variant.type >= TYPE_FALLOUT4) ? ".ba2" : ".bsa";
+  fs::path archivePath  = settings.directory / (std::string(variant.name) + extension);
+  fs::path outputPath = settings.directory / (std::string(variant.name) + "_out");
+
+  // write
+  if (variant.type == TYPE_MORROWIND) {
+    if (!writeMorrowind(archivePath, sources)) {
+      result.error = "writing the archive failed";
+      return result;
+    }
+  } else {
+    Archive archive;
+    archive.setType(variant.type);
+    std::map<std::string, Folder::Ptr> folders;
+    for (const SourceFile& source : sources) {
+      Folder::Ptr& folder = folders[source.folder];
+      if (folder.get() == nullptr) {
+        folder = archive.getRoot()->addFolder(source.folder);
+      }
+      folder->addFile(archive.createFile(source.name, source.sourcePath.string(),
+                                         variant.compressed));
+    }
+    WriteOptions options;
+    options.compressThreads = settings.threads;
+    Clock::time_point start = Clock::now();
+    EErrorCode error        = archive.write(archivePath.string().c_str(), options);
+    result.writeMs          = millisecondsSince(start);
+    if (error != ERROR_NONE) {
+      result.error = "write failed with error " + std::to_string(error);
+      return result;
+    }
+  }
+  result.archiveBytes = fs::file_size(archivePath);
+
+  // open
+  Archive archive;
+  unsigned int openFlags  = settings.mapped ? OPEN_MEMORYMAPPED : OPEN_DEFAULT;
+  Clock::time_point start = Clock::now();
+
+  EErrorCode error = archive.read(archivePath.string().c_str(), true, openFlags);
+  result.openMs    = millisecondsSince(start);
+  if (error != ERROR_NONE) {
+    result.error = "read failed with error " + std::to_string(error);
+    return result;
+  }
+
+  // lookup, in random order
+  std::vector<const SourceFile*> order;
+  for (const SourceFile& source : sources) {
+    order.push_back(&source);
+  }
+  std::shuffle(order.begin(), order.end(), std::mt19937(3));
+  std::vector<File::Ptr> found;
+  start = Clock::now();
+  for (const SourceFile* source : order) {
+    found.push_back(archive.findFile(source->archivePath));
+  }
+  result.lookupNs = order.empty() ? 0.0 : millisecondsSince(start) * 1e6 / order.size();
+  if (std::find(found.begin(), found.end(), File::Ptr()) != found.end()) {
+    result.error = "lookup failed";
+    return result;
+  }
+
+  // single files, a sample spread over the archive
+  fs::remove_all(outputPath);
+  fs::create_directories(outputPath);
+  size_t samples = (std::min)(found.size(), size_t(100));
+  start          = Clock::now();
+  for (size_t i = 0; i < samples; ++i) {
+    const File::Ptr& file = found[i * found.size() / samples];
+    error                 = archive.extract(file, outputPath.string().c_str());
+    if (error != ERROR_NONE) {
+      result.error = "extract failed with error " + std::to_string(error);
+      return result;
+    }
+  }
+  result.extractUs = (samples == 0) ? 0.0 : millisecondsSince(start) * 1e3 / samples;
+
+  // everything
+  fs::remove_all(outputPath);
+  fs::create_directories(outputPath);
+  ExtractStats stats;
+  ExtractOptions options;
+  options.decompressThreads = settings.threads;
+  options.stats             = &stats;
+  start                     = Clock::now();
+  error                     = archive.extractAll(
+      outputPath.string().c_str(), [](int, std::string) { return true; }, options);
+  result.extractAllMs      = millisecondsSince(start);
+  result.stageReadMs       = stats.readMicroseconds / 1000.0;
+  result.stageDecompressMs = stats.decompressMicroseconds / 1000.0;
+  result.stageWriteMs      = stats.writeMicroseconds / 1000.0;
+  if (error != ERROR_NONE) {
+    result.error = "extractAll failed with error " + std::to_string(error);
+  }
+
+  archive.close();
+  fs::remove_all(outputPath);
+  if (!settings.keep) {
+    fs::remove(archivePath);
+  }
+  return result;
+}
+
+static std::string number(double value)
+{
+  if (std::isnan(value)) {
+    return "null";
+  }
+  char buffer[64];
+  snprintf(buffer, sizeof(buffer), "%.3f", value);
+  return buffer;
+}
+
+static double megabytesPerSecond(uint64_t bytes, double milliseconds)
+{
+  return (milliseconds > 0.0) ? (bytes / 1048576.0) / (milliseconds / 1000.0) : NAN;
+}
+
+static void printResult(const Settings& settings, const Variant& variant,
+                        const Result& result)
+{
+  std::string writeMBs = number(megabytesPerSecond(result.bytes, result.writeMs));
+  std::string extractAllMBs =
+      number(megabytesPerSecond(result.bytes, result.extractAllMs));
+  if (settings.format == "csv") {
+    printf("%s,%s,%d,%d,%llu,%llu,%llu,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%llu,%s\n",
+           result.variant.c_str(),
+           typeName(variant.type), variant.compressed ? 1 : 0, variant.textures ? 1 : 0,
+           static_cast<unsigned long long>(result.files),
+           static_cast<unsigned long long>(result.bytes),
+           static_cast<unsigned long long>(result.archiveBytes),
+           number(result.writeMs).c_str(), writeMBs.c_str(),
+           number(result.openMs).c_str(), number(result.lookupNs).c_str(),
+           number(result.extractUs).c_str(), number(result.extractAllMs).c_str(),
+           extractAllMBs.c_str(), number(result.stageReadMs).c_str(),
+           number(result.stageDecompressMs).c_str(),
+           number(result.stageWriteMs).c_str(),
+           static_cast<unsigned long long>(result.rejected), result.error.c_str());
+  } else {
+    printf("{\"variant\":\"%s\",\"type\":\"%s\",\"compressed\":%s,\"textures\":%s,"
+           "\"files\":%llu,\"bytes\":%llu,\"archive_bytes\":%llu,\"write_ms\":%s,"
+           "\"write_mbps\":%s,\"open_ms\":%s,\"lookup_ns\":%s,\"extract_us\":%s,"
+           "\"extract_all_ms\":%s,\"extract_all_mbps\":%s,\"stage_read_ms\":%s,"
+           "\"stage_decompress_ms\":%s,\"stage_write_ms\":%s,\"rejected\":%llu,"
+           "\"error\":%s}\n",
+           result.variant.c_str(), typeName(variant.type),
+           variant.compressed ? "true" : "false", variant.textures ? "true" : "false",
+           static_cast<unsigned long long>(result.files),
+           static_cast<unsigned long long>(result.bytes),
+           static_cast<unsigned long long>(result.archiveBytes),
+           number(result.writeMs).c_str(), writeMBs.c_str(),
+           number(result.openMs).c_str(), number(result.lookupNs).c_str(),
+           number(result.extractUs).c_str(), number(result.extractAllMs).c_str(),
+           extractAllMBs.c_str(), number(result.stageReadMs).c_str(),
+           number(result.stageDecompressMs).c_str(),
+           number(result.stageWriteMs).c_str(),
+           static_cast<unsigned long long>(result.rejected),
+           result.error.empty() ? "null" : ("\"" + result.error + "\"").c_str());
+  }
+  fflush(stdout);
+}
+
+/**
+ * @brief counts the extracted data without keeping it
+ */
+struct DiscardSink : public ExtractSink
+{
+  std::atomic<uint64_t> bytes{0};
+  std::atomic<uint64_t> failures{0};
+
+  void write(const File::Ptr&, BSAHash, const std::byte*, size_t size, bool) override
+  {
+    bytes += size;
+  }
+  void failed(const File::Ptr&, EErrorCode) override { ++failures; }
+};
+
+static void collectFiles(const Folder::Ptr& folder, std::vector<File::Ptr>& files)
+{
+  for (unsigned int i = 0; i < folder->getNumFiles(); ++i) {
+    files.push_back(folder->getFile(i));
+  }
+  for (unsigned int i = 0; i < folder->getNumSubFolders(); ++i) {
+    collectFiles(folder->getSubFolder(i), files);
+  }
+}
+
+/**
+ * open an existing archive, then read every file on its own and extract them all
+ * again. Exceptions thrown by the parser end up in the error of the result
+ */
+static Result runArchive(const Settings& settings, const fs::path& path,
+                         ArchiveType& type)
+{
+  Result result;
+  result.variant      = path.filename().string();
+  result.archiveBytes = fs::file_size(path);
+  type                = TYPE_MORROWIND;
+
+  try {
+    Archive archive;
+    unsigned int openFlags  = settings.mapped ? OPEN_MEMORYMAPPED : OPEN_DEFAULT;
+    Clock::time_point start = Clock::now();
+    EErrorCode error        = archive.read(path.string().c_str(), true, openFlags);
+    result.openMs           = millisecondsSince(start);
+    type                    = archive.getType();
+    if ((error != ERROR_NONE) && (error != ERROR_INVALIDHASHES)) {
+      result.error = "read failed with error " + std::to_string(error);
+      return result;
+    } else if (error == ERROR_INVALIDHASHES) {
+      // the files can still be extracted
+      result.error = "invalid hashes";
+    }
+
+    std::vector<File::Ptr> files;
+    collectFiles(archive.getRoot(), files);
+    result.files = files.size();
+
+    std::vector<std::byte> data;
+    start = Clock::now();
+    for (const File::Ptr& file : files) {
+      error = archive.readFile(file, data);
+      if ((error != ERROR_NONE) && result.error.empty()) {
+        result.error = "readFile failed with error " + std::to_string(error);
+      }
+      result.bytes += data.size();
+    }
+    result.extractUs =
+        files.empty() ? 0.0 : millisecondsSince(start) * 1e3 / files.size();
+
+    DiscardSink sink;
+    ExtractStats stats;
+    ExtractOptions options;
+    options.decompressThreads = settings.threads;
+    options.stats             = &stats;
+    start                     = Clock::now();
+    error                     = archive.extractAll(
+        sink, [](int, std::string) { return true; }, options);
+    result.extractAllMs      = millisecondsSince(start);
+    result.stageReadMs       = stats.readMicroseconds / 1000.0;
+    result.stageDecompressMs = stats.decompressMicroseconds / 1000.0;
+    result.stageWriteMs      = stats.writeMicroseconds / 1000.0;
+    if (((error != ERROR_NONE) || (sink.failures > 0)) && result.error.empty()) {
+      result.error = "extractAll failed with error " + std::to_string(error);
+    }
+  } catch (const std::exception& e) {
+    result.error = e.what();
+  }
+  return result;
+}
+
+/**
+ * damage a copy of an archive the way a broken download or a hostile file would.
+ * Bytes are overwritten, mostly in the header and directory, and sometimes the end is
+ * cut off
+ */
+static void mutate(std::vector<char>& data, std::mt19937& random)
+{
+  if (data.empty()) {
+    return;
+  }
+  unsigned int count = random() % 8 + 1;
+  for (unsigned int i = 0; i < count; ++i) {
+    size_t range = (random() % 4 != 0) ? (std::min)(data.size(), size_t(4096))
+                                       : data.size();
+    size_t pos   = random() % range;
+    switch (random() % 3) {
+    case 0:
+      data[pos] = static_cast<char>(random());
+      break;
+    case 1:
+      data[pos] = 0;
+      break;
+    default:
+      data[pos] = static_cast<char>(0xFF);
+    }
+  }
+  if (random() % 8 == 0) {
+    data.resize(random() % data.size());
+  }
+}
+
+/**
+ * add a timing to a total, leaving out the ones that weren't measured
+ */
+static void addTime(double& total, double value)
+{
+  if (!std::isnan(value)) {
+    total = std::isnan(total) ? value : total + value;
+  }
+}
+
+/**
+ * run every archive of the corpus and its damaged copies, then print the totals of
+ * each archive type
+ * @return false if one of the archives themselves couldn't be read
+ */
+static bool runCorpus(const Settings& settings)
+{
+  std::vector<fs::path> paths;
+  for (const fs::directory_entry& entry :
+       fs::recursive_directory_iterator(settings.corpus)) {
+    std::string extension = entry.path().extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    if (entry.is_regular_file() && ((extension == ".bsa") || (extension == ".ba2"))) {
+      paths.push_back(entry.path());
+    }
+  }
+  std::sort(paths.begin(), paths.end());
+  fs::create_directories(settings.directory);
+
+  bool failed = false;
+  std::map<ArchiveType, Result> totals;
+  for (const fs::path& path : paths) {
+    ArchiveType type;
+    Result result = runArchive(settings, path, type);
+    printResult(settings, Variant{result.variant.c_str(), type, false, false}, result);
+    failed |= !result.error.empty();
+
+    Result& total = totals[type];
+    total.variant = std::string("corpus_") + typeName(type);
+    total.files += result.files;
+    total.bytes += result.bytes;
+    total.archiveBytes += result.archiveBytes;
+    addTime(total.openMs, result.openMs);
+    addTime(total.extractAllMs, result.extractAllMs);
+    addTime(total.stageReadMs, result.stageReadMs);
+    addTime(total.stageDecompressMs, result.stageDecompressMs);
+    addTime(total.stageWriteMs, result.stageWriteMs);
+
+    if (settings.mutations == 0) {
+      continue;
+    }
+    std::vector<char> original(static_cast<size_t>(fs::file_size(path)));
+    std::ifstream(path, std::ios::binary)
+        .read(original.data(), static_cast<std::streamsize>(original.size()));
+    fs::path mutantPath = settings.directory / ("mutant" + path.extension().string());
+    std::mt19937 random(4);
+    Result mutants;
+    mutants.variant = result.variant + "_mutants";
+    mutants.files   = settings.mutations;
+    for (unsigned int i = 0; i < settings.mutations; ++i) {
+      std::vector<char> data = original;
+      mutate(data, random);
+      std::ofstream(mutantPath, std::ios::binary | std::ios::trunc)
+          .write(data.data(), static_cast<std::streamsize>(data.size()));
+      ArchiveType mutantType;
+      Result mutant = runArchive(settings, mutantPath, mutantType);
+      mutants.bytes += mutant.bytes;
+      mutants.archiveBytes += mutant.archiveBytes;
+      if (!mutant.error.empty()) {
+        ++mutants.rejected;
+      }
+    }
+    fs::remove(mutantPath);
+    printResult(settings, Variant{mutants.variant.c_str(), type, false, false},
+                mutants);
+  }
+
+  for (const std::pair<const ArchiveType, Result>& total : totals) {
+    const Result& result = total.second;
+    printResult(settings, Variant{result.variant.c_str(), total.first, false, false},
+                result);
+  }
+  return !failed;
+}
+
+static void usage()
+{
+  fprintf(stderr,
+          "usage: bsatk_bench [options]\n"
+          "  --files N          number of files per archive (default 2000)\n"
+          "  --size BYTES       typical file size (default 65536)\n"
+          "  --folders N        folders to spread the files over (default 20)\n"
+          "  --threads N        worker threads, 0 (default) for one per core\n"
+          "  --mapped           open the archives memory mapped\n"
+          "  --variants A,B     only run these variants, see --list\n"
+          "  --format F         jsonl (default) or csv\n"
+          "  --dir PATH         working directory for the generated files\n"
+          "  --corpus PATH      run the archives in this directory instead\n"
+          "  --mutate N         also run N damaged copies of each corpus archive\n"
+          "  --keep             don't delete the generated archives\n"
+          "  --list             list the variants\n");
+}
+
+static bool parseArguments(int argc, char** argv, Settings& settings)
+{
+  for (int i = 1; i < argc; ++i) {
+    std::string argument = argv[i];
+    bool hasValue        = i + 1 < argc;
+    if ((argument == "--files") && hasValue) {
+      settings.files = static_cast<unsigned int>(std::stoul(argv[++i]));
+    } else if ((argument == "--size") && hasValue) {
+      settings.size = static_cast<unsigned int>(std::stoul(argv[++i]));
+    } else if ((argument == "--folders") && hasValue) {
+      settings.folders = static_cast<unsigned int>(std::stoul(argv[++i]));
+    } else if ((argument == "--threads") && hasValue) {
+      settings.threads = static_cast<unsigned int>(std::stoul(argv[++i]));
+    } else if ((argument == "--variants") && hasValue) {
+      std::string list = argv[++i];
+      for (size_t start = 0; start <= list.size();) {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos) {
+          end = list.size();
+        }
+        settings.variants.push_back(list.substr(start, end - start));
+        start = end + 1;
+      }
+    } else if ((argument == "--format") && hasValue) {
+      settings.format = argv[++i];
+    } else if ((argument == "--dir") && hasValue) {
+      settings.directory = argv[++i];
+    } else if ((argument == "--corpus") && hasValue) {
+      settings.corpus = argv[++i];
+    } else if ((argument == "--mutate") && hasValue) {
+      settings.mutations = static_cast<unsigned int>(std::stoul(argv[++i]));
+    } else if (argument == "--mapped") {
+      settings.mapped = true;
+    } else if (argument == "--keep") {
+      settings.keep = true;
+    } else if (argument == "--list") {
+      for (const Variant& variant : VARIANTS) {
+        printf("%s\n", variant.name);
+      }
+      exit(0);
+    } else {
+      return false;
+    }
+  }
+  return (settings.format == "jsonl") || (settings.format == "csv");
+}
+
+int main(int argc, char** argv)
+{
+  Settings settings;
+  try {
+    if (!parseArguments(argc, argv, settings)) {
+      usage();
+      return 2;
+    }
+  } catch (const std::exception&) {
+    usage();
+    return 2;
+  }
+
+  if (settings.format == "csv") {
+    printf("variant,type,compressed,textures,files,bytes,archive_bytes,write_ms,"
+           "write_mbps,open_ms,lookup_ns,extract_us,extract_all_ms,extract_all_mbps,"
+           "stage_read_ms,stage_decompress_ms,stage_write_ms,rejected,error\n");
+  }
+
+  if (!settings.corpus.empty()) {
+    bool failed = !runCorpus(settings);
+    if (!settings.keep) {
+      fs::remove_all(settings.directory);
+    }
+    return failed ? 1 : 0;
+  }
+
+  std::vector<SourceFile> sources;
+  std::vector<SourceFile> textures;
+  bool failed = false;
+  for (const Variant& variant : VARIANTS) {
+    if (!settings.variants.empty() &&
+        (std::find(settings.variants.begin(), settings.variants.end(), variant.name) ==
+         settings.variants.end())) {
+      continue;
+    }
+    std::vector<SourceFile>& input = variant.textures ? textures : sources;
+    if (input.empty()) {
+      input = generateSources(settings, variant.textures);
+    }
+    Result result = runVariant(settings, variant, input);
+    printResult(settings, variant, result);
+    failed |= !result.error.empty();
+  }
+
+  if (!settings.keep) {
+    fs::remove_all(settings.directory);
+  }
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,204 @@
+/*
+Mod Organizer BSA handling
+
+Copyright (C) 2012 Sebastian Herbord. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+// libFuzzer target for the archive parser. Every input is written to a file and opened
+// as an archive with each combination of open flags, then all files are extracted
+// through every extraction path. The index file written by the first open is damaged
+// with bytes of the input and opened again.
+// Archive::read and extraction report damage through error codes or
+// data_invalid_exception, anything else (crashes, sanitizer reports, uncaught
+// exceptions) is a bug.
+//
+// usage: bsatk_fuzz [libFuzzer options] [CORPUS_DIR...]
+
+#include "bsatk.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#ifdef WIN32
+#include <process.h>
+#define getpid _getpid
+#else  // WIN32
+#include <unistd.h>
+#endif  // WIN32
+
+using namespace BSA;
+namespace fs = std::filesystem;
+
+// files claiming to be larger than this are only extracted by the pipeline, which
+// doesn't buffer them. It keeps the fuzzer within its memory limit
+static const BSAULong MAX_BUFFERED_SIZE = 16 * 1024 * 1024;
+
+/**
+ * @brief drops the extracted data
+ */
+struct DiscardSink : public ExtractSink
+{
+  void write(const File::Ptr&, BSAHash, const std::byte*, size_t, bool) override {}
+};
+
+static void collectFiles(const Folder::Ptr& folder, std::vector<File::Ptr>& files)
+{
+  for (unsigned int i = 0; i < folder->getNumFiles(); ++i) {
+    files.push_back(folder->getFile(i));
+  }
+  for (unsigned int i = 0; i < folder->getNumSubFolders(); ++i) {
+    collectFiles(folder->getSubFolder(i), files);
+  }
+}
+
+/**
+ * @return true if a path read from the archive can't leave the output directory
+ */
+static bool safePath(const std::string& path)
+{
+  return !path.empty() && (path.front() != '/') && (path.front() != '\\') &&
+         (path.find(':') == std::string::npos) && (path.find("..") == std::string::npos);
+}
+
+/**
+ * run every extraction path over the files of an opened archive
+ */
+static void extractFiles(Archive& archive, const fs::path& outputDirectory)
+{
+  std::vector<File::Ptr> files;
+  collectFiles(archive.getRoot(), files);
+
+  archive.setCache(std::make_shared<FileCache>(MAX_BUFFERED_SIZE));
+  bool safePaths = true;
+  std::vector<std::byte> data;
+  for (const File::Ptr& file : files) {
+    safePaths     = safePaths && safePath(file->getFilePath());
+    BSAULong size = 0;
+    if ((archive.getExtractedSize(file, size) != ERROR_NONE) ||
+        (size > MAX_BUFFERED_SIZE)) {
+      continue;
+    }
+    data.resize(size);
+    archive.extractToMemory(file, data);
+    archive.readFile(file, data);
+    FileCache::Data shared;
+    archive.readShared(file, shared);
+    // a second time from the cache
+    archive.readShared(file, shared);
+    if (safePath(file->getName()) &&
+        (file->getName().find_first_of("/\\") == std::string::npos)) {
+      archive.extract(file, outputDirectory.string().c_str());
+    }
+  }
+
+  // once buffered and once streamed, which isn't used for small files otherwise
+  auto progress = [](int, std::string) {
+    return true;
+  };
+  for (uint64_t streamThreshold : {uint64_t(MAX_BUFFERED_SIZE), uint64_t(0)}) {
+    ExtractOptions options;
+    options.decompressThreads = 1;
+    options.readThreads       = 1;
+    options.writeThreads      = 1;
+    options.memoryBudget      = MAX_BUFFERED_SIZE;
+    options.streamThreshold   = streamThreshold;
+    DiscardSink sink;
+    archive.extractAll(sink, progress, options);
+  }
+  if (safePaths) {
+    ExtractOptions options;
+    options.decompressThreads = 1;
+    options.streamThreshold   = 0;
+    archive.extractAll(outputDirectory.string().c_str(), progress, options);
+  }
+}
+
+/**
+ * open an archive and extract it if that worked
+ */
+static void runArchive(const fs::path& archivePath, unsigned int openFlags,
+                       const char* indexFile, const fs::path& outputDirectory)
+{
+  try {
+    Archive archive;
+    EErrorCode result =
+        archive.read(archivePath.string().c_str(), true, openFlags, indexFile);
+    if ((result == ERROR_NONE) || (result == ERROR_INVALIDHASHES)) {
+      extractFiles(archive, outputDirectory);
+    }
+  } catch (const data_invalid_exception&) {
+    // the way read reports some kinds of damage
+  }
+}
+
+/**
+ * overwrite bytes of an index file after its header, so the index still matches the
+ * archive and its tables are parsed
+ */
+static void damageIndex(const fs::path& indexPath, const uint8_t* data, size_t size)
+{
+  std::fstream index(indexPath, std::ios::in | std::ios::out | std::ios::binary);
+  if (!index.is_open()) {
+    return;
+  }
+  index.seekg(0, std::ios::end);
+  std::streamoff indexSize  = index.tellg();
+  std::streamoff headerSize = sizeof(ArchiveIndex::Header);
+  if ((indexSize <= headerSize) || (size < 2)) {
+    return;
+  }
+  // the first bytes of the input choose the positions, the last ones the values
+  for (size_t i = 0; (i < 8) && (i < size / 2); ++i) {
+    std::streamoff position =
+        headerSize + (data[i] * 257 + i * 4099) % (indexSize - headerSize);
+    index.seekp(position);
+    index.put(static_cast<char>(data[size - 1 - i]));
+  }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+  static const fs::path directory =
+      fs::temp_directory_path() / ("bsatk_fuzz_" + std::to_string(getpid()));
+  const fs::path archivePath     = directory / "input.bsa";
+  const fs::path indexPath       = directory / "input.idx";
+  const fs::path outputDirectory = directory / "output";
+
+  fs::remove_all(directory);
+  fs::create_directories(outputDirectory);
+  std::ofstream(archivePath, std::ios::binary | std::ios::trunc)
+      .write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(size));
+
+  static const unsigned int OPEN_FLAGS[] = {OPEN_DEFAULT, OPEN_MEMORYMAPPED, OPEN_LAZY,
+                                            OPEN_MEMORYMAPPED | OPEN_LAZY};
+  for (unsigned int openFlags : OPEN_FLAGS) {
+    runArchive(archivePath, openFlags, nullptr, outputDirectory);
+  }
+
+  // the first open writes the index, the second one reads the damaged copy
+  runArchive(archivePath, OPEN_LAZY, indexPath.string().c_str(), outputDirectory);
+  damageIndex(indexPath, data, size);
+  runArchive(archivePath, OPEN_MEMORYMAPPED, indexPath.string().c_str(),
+             outputDirectory);
+
+  fs::remove_all(directory);
+  return 0;
+}
@@ -19,23 +19,27 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 */
 
 #include "bsaarchive.h"
+#include "bsacodec.h"
 #include "bsaexception.h"
 #include "bsafile.h"
 #include "bsafolder.h"
+#include "bsaoutput.h"
+#include "filehash.h"
+#include "workqueue.h"
 #include <algorithm>
-#include <boost/interprocess/sync/interprocess_semaphore.hpp>
-#include <boost/interprocess/sync/scoped_lock.hpp>
+#include <array>
+#include <atomic>
 #include <boost/shared_array.hpp>
 #include <boost/thread.hpp>
+#include <chrono>
+#include <climits>
 #include <cstring>
+#include <deque>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
-#include <lz4.h>
-#include <lz4frame.h>
 #include <memory>
-#include <queue>
 #include <sys/stat.h>
-#include <zlib.h>
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
 
@@ -47,15 +51,15 @@ namespace BSA
 {
 
 Archive::Archive()
-    : m_RootFolder(new Folder), m_ArchiveFlags(FLAG_HASDIRNAMES | FLAG_HASFILENAMES),
-      m_Type(TYPE_SKYRIM)
+    : m_RootFolder(new Folder), m_FileTable(std::make_shared<FileTable>()),
+      m_ArchiveFlags(FLAG_HASDIRNAMES | FLAG_HASFILENAMES), m_Type(TYPE_SKYRIM),
+      m_SourceType(TYPE_SKYRIM), m_CacheKey(FileCache::newArchiveKey())
 {}
 
 Archive::~Archive()
 {
-  if (m_File.is_open()) {
-    m_File.close();
-  }
+  releaseCache();
+  m_Source.close();
   std::vector<Folder::Ptr> folders;
   m_RootFolder->collectFolders(folders);
   cleanFolder(m_RootFolder);
@@ -114,82 +118,135 @@ BSAULong Archive::typeToID(ArchiveType type)
   }
 }
 
-Archive::Header Archive::readHeader(std::fstream& infile)
+Archive::Header Archive::readHeader(const unsigned char* pos, const unsigned char* end)
 {
   Header result;
 
-  result.fileIdentifier = readType<uint32_t>(infile);
+  result.fileIdentifier = readType<uint32_t>(pos, end);
   if (result.fileIdentifier != 0x00415342 && result.fileIdentifier != 0x58445442 &&
       result.fileIdentifier != 0x00000100) {
     throw data_invalid_exception(makeString("not a bsa or ba2 file"));
   }
 
   if (result.fileIdentifier != 0x00000100) {
-    ArchiveType type = typeFromID(readType<BSAUInt>(infile));
+    ArchiveType type = typeFromID(readType<BSAUInt>(pos, end));
     if (type == TYPE_FALLOUT4 || type == TYPE_STARFIELD ||
         type == TYPE_STARFIELD_LZ4_TEXTURE || type == TYPE_FALLOUT4NG_7 ||
         type == TYPE_FALLOUT4NG_8) {
       result.type = type;
-      infile.read(result.archType, 4);
+      if (end - pos < 4) {
+        throw data_invalid_exception("can't read from bsa");
+      }
+      memcpy(result.archType, pos, 4);
+      pos += 4;
       result.archType[4]     = '\0';
-      result.fileCount       = readType<BSAUInt>(infile);
-      result.nameTableOffset = readType<BSAHash>(infile);
+      result.fileCount       = readType<BSAUInt>(pos, end);
+      result.nameTableOffset = readType<BSAHash>(pos, end);
       result.archiveFlags    = FLAG_HASDIRNAMES | FLAG_HASFILENAMES;
     } else {
       result.type             = type;
-      result.offset           = readType<BSAUInt>(infile);
-      result.archiveFlags     = readType<BSAUInt>(infile);
-      result.folderCount      = readType<BSAUInt>(infile);
-      result.fileCount        = readType<BSAUInt>(infile);
-      result.folderNameLength = readType<BSAUInt>(infile);
-      result.fileNameLength   = readType<BSAUInt>(infile);
-      result.fileFlags        = readType<BSAUInt>(infile);
+      result.offset           = readType<BSAUInt>(pos, end);
+      result.archiveFlags     = readType<BSAUInt>(pos, end);
+      result.folderCount      = readType<BSAUInt>(pos, end);
+      result.fileCount        = readType<BSAUInt>(pos, end);
+      result.folderNameLength = readType<BSAUInt>(pos, end);
+      result.fileNameLength   = readType<BSAUInt>(pos, end);
+      result.fileFlags        = readType<BSAUInt>(pos, end);
     }
   } else {
     result.type         = TYPE_MORROWIND;
-    result.offset       = readType<BSAUInt>(infile);
-    result.fileCount    = readType<BSAUInt>(infile);
+    result.offset       = readType<BSAUInt>(pos, end);
+    result.fileCount    = readType<BSAUInt>(pos, end);
     result.archiveFlags = FLAG_HASDIRNAMES | FLAG_HASFILENAMES;
   }
 
   return result;
 }
 
-EErrorCode Archive::read(const char* fileName, bool testHashes)
+static FO4TextureHeader textureHeader(const BA2TextureRecord& record)
+{
+  FO4TextureHeader result;
+  result.nameHash = record.nameHash;
+  memcpy(result.extension, record.extension, 4);
+  result.dirHash         = record.dirHash;
+  result.unknown1        = record.unknown1;
+  result.chunkNumber     = record.chunkNumber;
+  result.chunkHeaderSize = record.chunkHeaderSize;
+  result.height          = record.height;
+  result.width           = record.width;
+  result.mipCount        = record.mipCount;
+  result.format          = static_cast<DXGI_FORMAT>(record.format);
+  result.isCubemap       = record.isCubemap != 0;
+  result.unknown2        = record.unknown2;
+  return result;
+}
+
+EErrorCode Archive::read(const char* fileName, bool testHashes, unsigned int openFlags)
+{
+  return read(fileName, testHashes, openFlags, nullptr);
+}
+
+EErrorCode Archive::read(const char* fileName, bool testHashes, unsigned int openFlags,
+                         const char* indexFile)
 {
-  m_File.open(fileName, fstream::in | fstream::binary);
-  if (!m_File.is_open()) {
+  releaseCache();
+  // if the archive can't be mapped (i.e. not enough address space) fall back to
+  // positional reads
+  if (!m_Source.open(fileName, (openFlags & OPEN_MEMORYMAPPED) != 0) &&
+      !m_Source.open(fileName, false)) {
     return ERROR_FILENOTFOUND;
   }
-  m_File.exceptions(std::ios_base::badbit);
+
+  ArchiveIndex::Key indexKey;
+  bool useIndex = (indexFile != nullptr) && ArchiveIndex::key(fileName, indexKey);
+  if (useIndex) {
+    EErrorCode result = ERROR_NONE;
+    if (loadIndex(indexFile, indexKey, testHashes, result)) {
+      buildFileIndex();
+      return result;
+    }
+  }
+
   try {
+    EErrorCode result = ERROR_NONE;
     Header header;
     try {
-      header = readHeader(m_File);
+      // the largest header is the one of bsa archives, smaller files are checked
+      // field by field
+      std::unique_ptr<unsigned char[]> headerBuffer;
+      BSAHash headerSize              = (std::min)(BSAHash(36), m_Source.size());
+      const unsigned char* headerData = fetch(0, headerSize, headerBuffer);
+      header = readHeader(headerData, headerData + headerSize);
     } catch (const data_invalid_exception& e) {
       throw data_invalid_exception(makeString("%s (filename: %s)", e.what(), fileName));
     }
     m_ArchiveFlags = header.archiveFlags;
     m_Type         = header.type;
-    if (m_Type == TYPE_FALLOUT4 || m_Type == TYPE_STARFIELD ||
-        m_Type == TYPE_STARFIELD_LZ4_TEXTURE || m_Type == TYPE_FALLOUT4NG_7 ||
-        m_Type == TYPE_FALLOUT4NG_8) {
-      std::vector<Folder::Ptr> folders;
-
-      m_File.seekg(header.nameTableOffset);
-
+    m_SourceType   = header.type;
+    bool lazy      = (openFlags & OPEN_LAZY) != 0;
+    if (isBA2()) {
+      // the names of all files are stored in one table at the end of the archive
+      BSAHash nameTableSize = (m_Source.size() > header.nameTableOffset)
+                                  ? m_Source.size() - header.nameTableOffset
+                                  : 0ULL;
+      std::unique_ptr<unsigned char[]> nameBuffer;
+      const unsigned char* names =
+          fetch(header.nameTableOffset, nameTableSize, nameBuffer);
+      const unsigned char* namesEnd = names + nameTableSize;
+
+      // each name takes at least its two byte length, a larger count can't be right
       std::vector<std::string> fileNames;
+      fileNames.reserve((std::min)(static_cast<BSAHash>(header.fileCount),
+                                   nameTableSize / sizeof(BSAUShort)));
       for (unsigned int i = 0; i < header.fileCount; ++i) {
-        BSAUShort length = readType<BSAUShort>(m_File);
-
-        char* file = new char[length + 1];
-        m_File.read(file, length);
-        file[length] = '\0';
-
-        fileNames.push_back(file);
-        delete[] file;
+        BSAUShort length = readType<BSAUShort>(names, namesEnd);
+        if (static_cast<size_t>(namesEnd - names) < length) {
+          throw data_invalid_exception("file name table truncated");
+        }
+        fileNames.push_back(std::string(reinterpret_cast<const char*>(names), length));
+        names += length;
       }
-      std::streamoff offset;
+      BSAHash offset;
       switch (m_Type) {
       case TYPE_STARFIELD:
         offset = 32;
@@ -200,119 +257,419 @@ EErrorCode Archive::read(const char* fileName, bool testHashes)
       default:
         offset = 24;
       }
+      if (offset > m_Source.size()) {
+        throw data_invalid_exception("header truncated");
+      }
       if (strcmp(header.archType, "GNRL") == 0) {
-        m_File.seekg(offset, std::ios::beg);
+        BSAHash recordsSize =
+            static_cast<BSAHash>(header.fileCount) * sizeof(BA2FileRecord);
+        std::unique_ptr<unsigned char[]> recordBuffer;
+        const unsigned char* records    = fetch(offset, recordsSize, recordBuffer);
+        const unsigned char* recordsEnd = records + recordsSize;
         for (unsigned int i = 0; i < header.fileCount; ++i) {
-          BSAUInt nameHash = readType<BSAUInt>(m_File);
-          char* extension  = new char[4];
-          m_File.read(extension, 4);
-          BSAUInt dirHash = readType<BSAUInt>(m_File);
-          m_File.seekg(4, std::ios::cur);
-          BSAHash offset       = readType<BSAHash>(m_File);
-          BSAUInt packedSize   = readType<BSAUInt>(m_File);
-          BSAUInt unpackedSize = readType<BSAUInt>(m_File);
-          m_File.seekg(4, std::ios::cur);
-          std::vector<FO4TextureChunk> dummy;
-          Folder::Ptr newDir = m_RootFolder->addFolderFromFile(
-              fileNames[i], packedSize, offset, unpackedSize, {}, dummy);
-          if (std::find(folders.begin(), folders.end(), newDir) == folders.end())
-            folders.push_back(newDir);
-          delete[] extension;
+          BA2FileRecord record = readType<BA2FileRecord>(records, recordsEnd);
+          m_RootFolder->addFileFromPath(*m_FileTable, fileNames[i], record.packedSize,
+                                        record.offset, record.unpackedSize, {}, 0, 0);
         }
       } else if (strcmp(header.archType, "DX10") == 0) {
-        m_File.seekg(offset, std::ios::beg);
+        // texture records have a variable number of chunks. Only as much is read as
+        // the records can take up, they don't extend past the data or the name table
+        BSAHash recordsSize    = (header.nameTableOffset > offset)
+                                     ? header.nameTableOffset - offset
+                                     : m_Source.size() - offset;
+        BSAHash maxRecordsSize = static_cast<BSAHash>(header.fileCount) *
+                                 (sizeof(BA2TextureRecord) +
+                                  UCHAR_MAX * sizeof(FO4TextureChunk));
+        recordsSize            = (std::min)(recordsSize, maxRecordsSize);
+        std::unique_ptr<unsigned char[]> recordBuffer;
+        const unsigned char* records = fetch(offset, recordsSize, recordBuffer);
+        const unsigned char* recordsEnd   = records + recordsSize;
+        const unsigned char* recordsBegin = records;
         for (unsigned int i = 0; i < header.fileCount; ++i) {
-          FO4TextureHeader texHeader;
-          texHeader.nameHash = readType<BSAUInt>(m_File);
-          m_File.read(texHeader.extension, 4);
-          texHeader.dirHash         = readType<BSAUInt>(m_File);
-          texHeader.unknown1        = readType<BSAUChar>(m_File);
-          texHeader.chunkNumber     = readType<BSAUChar>(m_File);
-          texHeader.chunkHeaderSize = readType<BSAUShort>(m_File);
-          texHeader.height          = readType<BSAUShort>(m_File);
-          texHeader.width           = readType<BSAUShort>(m_File);
-          texHeader.mipCount        = readType<BSAUChar>(m_File);
-          texHeader.format          = static_cast<DXGI_FORMAT>(readType<BSAUChar>(m_File));
-          texHeader.isCubemap       = readType<bool>(m_File);
-          texHeader.unknown2        = readType<BSAUChar>(m_File);
-          std::vector<FO4TextureChunk> chunks;
-          for (unsigned int j = 0; j < texHeader.chunkNumber; ++j) {
-            FO4TextureChunk chunk;
-            chunk.offset       = readType<BSAHash>(m_File);
-            chunk.packedSize   = readType<BSAUInt>(m_File);
-            chunk.unpackedSize = readType<BSAUInt>(m_File);
-            chunk.startMip     = readType<BSAUShort>(m_File);
-            chunk.endMip       = readType<BSAUShort>(m_File);
-            chunk.unknown      = readType<BSAUInt>(m_File);
-            chunks.push_back(chunk);
+          BSAHash recordOffset    = offset + (records - recordsBegin);
+          BA2TextureRecord record = readType<BA2TextureRecord>(records, recordsEnd);
+          if (record.chunkNumber == 0) {
+            throw data_invalid_exception("texture without chunks");
+          }
+          // the chunks of all textures are stored in one table, the slots are reserved
+          // even if the chunks are only read on first use
+          BSAUInt firstChunk = static_cast<BSAUInt>(m_TextureChunks.size());
+          m_TextureChunks.resize(firstChunk + record.chunkNumber);
+          FO4TextureChunk* chunks = &m_TextureChunks[firstChunk];
+          if (lazy) {
+            // the first chunk is enough to sort files by offset, the rest of the record
+            // is decoded on first use
+            FO4TextureChunk first = readType<FO4TextureChunk>(records, recordsEnd);
+            BSAHash skip = (record.chunkNumber - 1) * sizeof(FO4TextureChunk);
+            if (static_cast<BSAHash>(recordsEnd - records) < skip) {
+              throw data_invalid_exception("can't read from bsa");
+            }
+            records += skip;
+            File::Ptr file = m_RootFolder->addFileFromPath(
+                *m_FileTable, fileNames[i], first.packedSize, first.offset,
+                first.unpackedSize, {}, firstChunk, record.chunkNumber);
+            file->setTextureRecordOffset(recordOffset, std::memory_order_relaxed);
+          } else {
+            for (BSAUInt j = 0; j < record.chunkNumber; ++j) {
+              chunks[j] = readType<FO4TextureChunk>(records, recordsEnd);
+            }
+            m_RootFolder->addFileFromPath(*m_FileTable, fileNames[i],
+                                          chunks[0].packedSize, chunks[0].offset,
+                                          chunks[0].unpackedSize, textureHeader(record),
+                                          firstChunk, record.chunkNumber);
           }
-          Folder::Ptr newDir = m_RootFolder->addFolderFromFile(
-              fileNames[i], chunks[0].packedSize, chunks[0].offset,
-              chunks[0].unpackedSize, texHeader, chunks);
-          if (std::find(folders.begin(), folders.end(), newDir) == folders.end())
-            folders.push_back(newDir);
         }
       }
-
-      return ERROR_NONE;
     } else if (m_Type == TYPE_MORROWIND) {
-      std::vector<Folder::Ptr> folders;
-      BSAUInt dataOffset = 12 + header.offset + header.fileCount * 8;
-
-      std::vector<MorrowindFileOffset> fileSizeOffset(header.fileCount);
-      m_File.read((char*)fileSizeOffset.data(),
-                  header.fileCount * sizeof(MorrowindFileOffset));
-      std::vector<BSAUInt> fileNameOffset(header.fileCount);
-      m_File.read((char*)fileNameOffset.data(), header.fileCount * sizeof(BSAUInt));
-      BSAUInt last = header.offset - 12 * header.fileCount;
+      // file records, name offsets and names follow the 12 byte header
+      BSAHash directorySize = (std::min)(BSAHash(12) + header.offset, m_Source.size());
+      std::unique_ptr<unsigned char[]> buffer;
+      const unsigned char* directory    = fetch(0, directorySize, buffer);
+      const unsigned char* directoryEnd = directory + directorySize;
+      if (BSAHash(12) + header.fileCount * 12ULL > directorySize) {
+        throw data_invalid_exception("directory truncated");
+      }
+
+      BSAUInt dataOffset               = 12 + header.offset + header.fileCount * 8;
+      const unsigned char* records     = directory + 12;
+      const unsigned char* nameOffsets = records + header.fileCount * 8ULL;
+      const unsigned char* names       = nameOffsets + header.fileCount * 4ULL;
       for (uint32_t i = 0; i < header.fileCount; ++i) {
-        uint32_t index = 0;
-        if (i + 1 == header.fileCount)
-          index = last;
-        else
-          index = fileNameOffset[i + 1] - fileNameOffset[i];
-        char* filePath = new char[index + 1];
-        m_File.read(filePath, index);
-        filePath[index] = '\0';
-
-        std::vector<FO4TextureChunk> dummy;
-        Folder::Ptr newDir = m_RootFolder->addFolderFromFile(
-            filePath, fileSizeOffset[i].size, dataOffset + fileSizeOffset[i].offset, 0,
-            {}, dummy);
-        if (std::find(folders.begin(), folders.end(), newDir) == folders.end())
-          folders.push_back(newDir);
-
-        delete[] filePath;
+        MorrowindFileOffset record = readType<MorrowindFileOffset>(records, names);
+        BSAUInt nameOffset         = readType<BSAUInt>(nameOffsets, names);
+        if (nameOffset > static_cast<BSAUInt>(directoryEnd - names)) {
+          throw data_invalid_exception("invalid name offset");
+        }
+        const unsigned char* name = names + nameOffset;
+        std::string filePath      = readZString(name, directoryEnd);
+
+        m_RootFolder->addFileFromPath(*m_FileTable, filePath, record.size,
+                                      dataOffset + record.offset, 0, {}, 0, 0);
       }
-      return ERROR_NONE;
     } else {
+      // folder records, file records and file names follow the header, read them all at
+      // once
+      BSAHash recordSize    = (m_Type == TYPE_SKYRIMSE) ? sizeof(BSAFolderRecordSE)
+                                                        : sizeof(BSAFolderRecord);
+      BSAHash directorySize = static_cast<BSAHash>(header.offset) +
+                              (recordSize + 1) * header.folderCount +
+                              header.folderNameLength +
+                              sizeof(BSAFileRecord) * header.fileCount +
+                              header.fileNameLength;
+      directorySize = (std::min)(directorySize, m_Source.size());
+      if (header.offset > directorySize) {
+        throw data_invalid_exception("directory truncated");
+      }
+      std::unique_ptr<unsigned char[]> buffer;
+      const unsigned char* directory    = fetch(0, directorySize, buffer);
+      const unsigned char* directoryEnd = directory + directorySize;
+
       // flat list of folders as they were stored in the archive
       std::vector<Folder::Ptr> folders;
+      folders.reserve((std::min)(static_cast<BSAHash>(header.folderCount),
+                                 (directorySize - header.offset) / recordSize));
 
+      const unsigned char* record = directory + header.offset;
+      BSAHash namesOffset         = header.offset;
       for (unsigned long i = 0; i < header.folderCount; ++i) {
-        folders.push_back(m_RootFolder->addFolder(m_File, header.fileNameLength,
-                                                  header.offset, header.type));
+        folders.push_back(m_RootFolder->addFolder(record, directory, directoryEnd,
+                                                  header.fileNameLength, namesOffset,
+                                                  header.type, *m_FileTable));
       }
 
-      m_File.seekg(header.offset);
-
-      bool hashesValid = true;
+      // split the name table at the terminators, then verify all names at once
+      const unsigned char* names = directory + namesOffset;
+      bool hashesValid           = true;
       for (std::vector<Folder::Ptr>::iterator iter = folders.begin();
            iter != folders.end(); ++iter) {
-        if (!(*iter)->resolveFileNames(m_File, testHashes)) {
+        if (!(*iter)->resolveFileNames(names, directoryEnd)) {
           hashesValid = false;
         }
       }
-      return hashesValid ? ERROR_NONE : ERROR_INVALIDHASHES;
+      if (hashesValid && testHashes) {
+        hashesValid = testNameHashes(folders);
+      }
+      if (!hashesValid) {
+        result = ERROR_INVALIDHASHES;
+      }
+    }
+
+    buildFileIndex();
+    if (useIndex) {
+      saveIndex(indexFile, indexKey, testHashes, result);
     }
+    return result;
   } catch (std::ios_base::failure&) {
     return ERROR_INVALIDDATA;
   }
 }
 
+bool Archive::loadIndex(const char* indexFile, const ArchiveIndex::Key& key,
+                        bool testHashes, EErrorCode& result)
+{
+  ArchiveIndex index;
+  if (!index.open(indexFile, key)) {
+    return false;
+  }
+  const ArchiveIndex::Header& header = index.header();
+  if (testHashes && !header.hashesTested) {
+    return false;
+  }
+  m_ArchiveFlags = header.archiveFlags;
+  m_Type         = static_cast<ArchiveType>(header.type);
+  m_SourceType   = m_Type;
+
+  // parents are stored ahead of their children, so the tree is built in one pass
+  // without looking up any paths
+  std::span<const ArchiveIndex::FolderRecord> folderRecords = index.folders();
+  std::vector<Folder*> folders(folderRecords.size());
+  for (size_t i = 0; i < folderRecords.size(); ++i) {
+    const ArchiveIndex::FolderRecord& record = folderRecords[i];
+
+    Folder::Ptr folder  = (i == 0) ? m_RootFolder : Folder::Ptr(new Folder);
+    folder->m_NameHash  = record.nameHash;
+    folder->m_Name      = index.name(record.nameOffset, record.nameLength);
+    folder->m_FileCount = record.fileCount;
+    folder->m_Offset    = record.offset;
+    if (i > 0) {
+      folder->m_Parent = folders[record.parent];
+      folders[record.parent]->insertSubFolder(folder);
+    }
+    folders[i] = folder.get();
+  }
+
+  // chunks are appended, like read does for an archive that isn't empty
+  BSAUInt chunkBase = static_cast<BSAUInt>(m_TextureChunks.size());
+  m_TextureChunks.insert(m_TextureChunks.end(), index.chunks().begin(),
+                         index.chunks().end());
+  for (const ArchiveIndex::FileRecord& record : index.files()) {
+    Folder* folder           = folders[record.folder];
+    BSAFileRecord fileRecord = {record.nameHash, record.fileSize, 0};
+    File::Ptr file           = m_FileTable->create(fileRecord, folder);
+    file->setName(index.name(record.nameOffset, record.nameLength));
+    file->setUncompressedFileSize(record.uncompressedFileSize);
+    file->setDataOffset(record.dataOffset);
+    file->setCompressToggled(record.toggleCompressed != 0);
+    if (record.chunkCount != 0) {
+      m_FileTable->setTexture(file->m_Index, record.textureHeader,
+                              chunkBase + record.firstChunk, record.chunkCount,
+                              record.textureRecordOffset);
+    }
+    folder->m_Files.push_back(file);
+  }
+
+  result = static_cast<EErrorCode>(header.result);
+  return true;
+}
+
+void Archive::saveIndex(const char* indexFile, const ArchiveIndex::Key& key,
+                        bool testHashes, EErrorCode result) const
+{
+  std::vector<ArchiveIndex::FolderRecord> folders;
+  std::vector<ArchiveIndex::FileRecord> files;
+  std::string names;
+
+  // breadth first so each parent is stored ahead of its children
+  std::vector<std::pair<const Folder*, BSAUInt>> order;
+  order.push_back(std::make_pair(m_RootFolder.get(), ArchiveIndex::NO_PARENT));
+  for (size_t i = 0; i < order.size(); ++i) {
+    const Folder* folder = order[i].first;
+    for (const Folder::Ptr& subFolder : folder->m_SubFolders) {
+      order.push_back(std::make_pair(subFolder.get(), static_cast<BSAUInt>(i)));
+    }
+
+    ArchiveIndex::FolderRecord record = {};
+
+    record.nameHash   = folder->m_NameHash;
+    record.offset     = folder->m_Offset;
+    record.parent     = order[i].second;
+    record.fileCount  = static_cast<BSAUInt>(folder->m_FileCount);
+    record.nameOffset = static_cast<BSAUInt>(names.size());
+    record.nameLength = static_cast<BSAUInt>(folder->m_Name.size());
+    names += folder->m_Name;
+    folders.push_back(record);
+
+    for (const File::Ptr& file : folder->m_Files) {
+      ArchiveIndex::FileRecord fileRecord = {};
+
+      fileRecord.nameHash             = file->getNameHash();
+      fileRecord.dataOffset           = file->getDataOffset();
+      fileRecord.folder               = static_cast<BSAUInt>(i);
+      fileRecord.nameOffset           = static_cast<BSAUInt>(names.size());
+      fileRecord.nameLength           = BSAUInt(file->getNameView().size());
+      fileRecord.fileSize             = static_cast<BSAUInt>(file->getFileSize());
+      fileRecord.uncompressedFileSize = BSAUInt(file->getUncompressedFileSize());
+      fileRecord.firstChunk           = file->getFirstChunk();
+      fileRecord.chunkCount           = file->getChunkCount();
+      fileRecord.toggleCompressed     = file->compressToggled() ? 1 : 0;
+      fileRecord.textureHeader        = file->getTextureHeader();
+      fileRecord.textureRecordOffset =
+          file->getTextureRecordOffset(std::memory_order_acquire);
+      names += file->getNameView();
+      files.push_back(fileRecord);
+    }
+  }
+
+  ArchiveIndex::Header header = {};
+
+  header.key          = key;
+  header.type         = static_cast<BSAUInt>(m_Type);
+  header.archiveFlags = static_cast<BSAUInt>(m_ArchiveFlags);
+  header.result       = static_cast<BSAUInt>(result);
+  header.hashesTested = testHashes ? 1 : 0;
+  ArchiveIndex::write(indexFile, header, folders, files, m_TextureChunks, names);
+}
+
+// below this many names the threads aren't worth starting
+static const size_t MIN_HASHES_PER_THREAD = 16384;
+static const size_t HASH_BATCH_SIZE       = 256;
+
+bool Archive::testNameHashes(const std::vector<Folder::Ptr>& folders)
+{
+  std::vector<const File*> files;
+  for (const Folder::Ptr& folder : folders) {
+    for (const File::Ptr& file : folder->m_Files) {
+      files.push_back(file.get());
+    }
+  }
+
+  std::atomic<bool> valid(true);
+  auto testRange = [&files, &valid](size_t begin, size_t end) {
+    std::string_view names[HASH_BATCH_SIZE];
+    BSAHash hashes[HASH_BATCH_SIZE];
+    for (size_t batch = begin; (batch < end) && valid; batch += HASH_BATCH_SIZE) {
+      size_t count = (std::min)(end - batch, HASH_BATCH_SIZE);
+      for (size_t i = 0; i < count; ++i) {
+        names[i] = files[batch + i]->getNameView();
+      }
+      calculateBSAHashes(std::span<const std::string_view>(names, count),
+                         std::span<BSAHash>(hashes, count));
+      for (size_t i = 0; i < count; ++i) {
+        if (hashes[i] != files[batch + i]->getNameHash()) {
+          valid = false;
+        }
+      }
+    }
+  };
+
+  size_t numThreads = (std::min)(files.size() / MIN_HASHES_PER_THREAD,
+                                 size_t(boost::thread::hardware_concurrency()));
+  numThreads           = (std::max)(numThreads, size_t(1));
+  size_t filesPerThread = (files.size() + numThreads - 1) / numThreads;
+
+  // the calling thread takes the first range
+  boost::thread_group threads;
+  for (size_t i = 1; i < numThreads; ++i) {
+    size_t begin = i * filesPerThread;
+    size_t end   = (std::min)(begin + filesPerThread, files.size());
+    threads.create_thread([&testRange, begin, end]() {
+      testRange(begin, end);
+    });
+  }
+  testRange(0, (std::min)(filesPerThread, files.size()));
+  threads.join_all();
+  return valid;
+}
+
 void Archive::close()
 {
-  m_File.close();
+  releaseCache();
+  m_FileIndex.clear();
+  m_Source.close();
+}
+
+// combine the hashes of folder and file name into the key of the file index
+static BSAHash fileIndexKey(BSAHash folderHash, BSAHash fileHash)
+{
+  return folderHash ^ (fileHash * 0x9E3779B97F4A7C15ULL);
+}
+
+void Archive::buildFileIndex()
+{
+  m_FileIndex.clear();
+  m_FileIndex.reserve(countFiles());
+  indexFolder(*m_RootFolder, std::string());
+}
+
+void Archive::indexFolder(const Folder& folder, const std::string& path)
+{
+  BSAHash folderHash = calculateBSAHash(path);
+  for (const File::Ptr& file : folder.m_Files) {
+    std::string_view name = file->getNameView();
+    size_t pos            = name.find_last_of("\\/");
+    if (pos == std::string::npos) {
+      m_FileIndex.insert(
+          std::make_pair(fileIndexKey(folderHash, calculateBSAHash(name)), file));
+    } else {
+      // the name contains part of the path, hash it the same way findFile splits it
+      std::string filePath = path.empty() ? std::string() : path + "\\";
+      filePath.append(name);
+      std::string_view view(filePath);
+      pos = view.find_last_of("\\/");
+      m_FileIndex.insert(
+          std::make_pair(fileIndexKey(calculateBSAHash(view.substr(0, pos)),
+                                      calculateBSAHash(view.substr(pos + 1))),
+                         file));
+    }
+  }
+  for (const Folder::Ptr& subFolder : folder.m_SubFolders) {
+    if (path.empty() || subFolder->m_Name.empty()) {
+      indexFolder(*subFolder, path + subFolder->m_Name);
+    } else {
+      indexFolder(*subFolder, path + "\\" + subFolder->m_Name);
+    }
+  }
+}
+
+bool Archive::matchesPath(const File& file, std::string_view path)
+{
+  // compare from the back so the full path of the file doesn't have to be assembled
+  std::string_view fileName = file.getNameView();
+  if ((path.size() < fileName.size()) ||
+      !pathEquals(path.substr(path.size() - fileName.size()), fileName)) {
+    return false;
+  }
+  path.remove_suffix(fileName.size());
+  for (const Folder* folder = file.getFolder();
+       (folder != nullptr) && (folder->m_Parent != nullptr);
+       folder = folder->m_Parent) {
+    const std::string& name = folder->m_Name;
+    if (name.empty()) {
+      continue;
+    }
+    if ((path.size() < name.size() + 1) || !isPathSeparator(path.back()) ||
+        !pathEquals(path.substr(path.size() - name.size() - 1, name.size()), name)) {
+      return false;
+    }
+    path.remove_suffix(name.size() + 1);
+  }
+  return path.empty();
+}
+
+BSAHash Archive::pathKey(std::string_view& path)
+{
+  while (!path.empty() && isPathSeparator(path.front())) {
+    path.remove_prefix(1);
+  }
+  size_t pos = path.find_last_of("\\/");
+  std::string_view folderPath;
+  std::string_view fileName = path;
+  if (pos != std::string_view::npos) {
+    folderPath = path.substr(0, pos);
+    fileName   = path.substr(pos + 1);
+  }
+  return fileIndexKey(calculateBSAHash(folderPath), calculateBSAHash(fileName));
+}
+
+File::Ptr Archive::findFile(std::string_view path) const
+{
+  auto range = m_FileIndex.equal_range(pathKey(path));
+  for (auto iter = range.first; iter != range.second; ++iter) {
+    if (matchesPath(*iter->second, path)) {
+      return iter->second;
+    }
+  }
+  return File::Ptr();
 }
 
 BSAULong Archive::countFiles() const
@@ -420,459 +777,1570 @@ void Archive::writeHeader(std::fstream& outfile, BSAULong fileFlags,
   writeType<BSAULong>(outfile, fileFlags);
 }
 
-EErrorCode Archive::write(const char* fileName)
+/**
+ * @brief identifies the data of a file for deduplication
+ */
+struct ContentKey
 {
-  std::fstream outfile;
-  outfile.open(fileName, fstream::out | fstream::binary);
-  if (!outfile.is_open()) {
-    return ERROR_ACCESSFAILED;
+  // content hash of the data or, for data copied from the source archive, its offset
+  // in there
+  uint64_t hash;
+  BSAHash size;
+  bool compressed;
+  bool copied;
+
+  bool operator==(const ContentKey& other) const
+  {
+    return (hash == other.hash) && (size == other.size) &&
+           (compressed == other.compressed) && (copied == other.copied);
   }
-  outfile.exceptions(std::ios_base::badbit);
-
-  std::vector<Folder::Ptr> folders;
-  m_RootFolder->collectFolders(folders);
+};
 
-  std::vector<std::string> folderNames;
-  std::vector<std::string> fileNames;
-  BSAULong folderNamesLength = 0;
-  BSAULong fileNamesLength   = 0;
-  for (std::vector<Folder::Ptr>::const_iterator folderIter = folders.begin();
-       folderIter != folders.end(); ++folderIter) {
-    std::string fullPath = (*folderIter)->getFullPath();
-    folderNames.push_back(fullPath);
-    folderNamesLength += static_cast<BSAULong>(fullPath.length());
-    for (std::vector<File::Ptr>::const_iterator fileIter =
-             (*folderIter)->m_Files.begin();
-         fileIter != (*folderIter)->m_Files.end(); ++fileIter) {
-      fileNames.push_back((*fileIter)->m_Name);
-      fileNamesLength += static_cast<BSAULong>((*fileIter)->m_Name.length());
-    }
+struct ContentKeyHash
+{
+  size_t operator()(const ContentKey& key) const
+  {
+    return static_cast<size_t>(key.hash ^ (key.size * 0x9E3779B97F4A7C15ULL) ^
+                               (key.compressed ? 1 : 0) ^ (key.copied ? 2 : 0));
   }
+};
 
-  try {
-    writeHeader(outfile, determineFileFlags(fileNames),
-                static_cast<BSAULong>(folderNames.size()), folderNamesLength,
-                fileNamesLength);
-#pragma message("folders (and files?) need to be sorted by hash!")
-    // dummy-pass: before we can store the actual folder data
-
-    // prepare folder and file headers
-#pragma message("it's unnecessary to write actual data, placeholders are sufficient")
-    for (std::vector<Folder::Ptr>::const_iterator folderIter = folders.begin();
-         folderIter != folders.end(); ++folderIter) {
-      (*folderIter)->writeHeader(outfile);
-    }
-
-    for (std::vector<Folder::Ptr>::const_iterator folderIter = folders.begin();
-         folderIter != folders.end(); ++folderIter) {
-      (*folderIter)->writeData(outfile, fileNamesLength);
-    }
-
-    // write file names
-    for (std::vector<std::string>::const_iterator folderIter = fileNames.begin();
-         folderIter != fileNames.end(); ++folderIter) {
-      writeZString(outfile, *folderIter);
+struct Archive::PackState
+{
+  // number of files the packers may get ahead of the writer. This limits the memory
+  // held by packed files waiting for their turn
+  static const size_t MAX_AHEAD = 64;
+
+  // chunk of a work item that stands for the whole file
+  static const size_t NO_CHUNK = static_cast<size_t>(-1);
+
+  std::vector<PackedFile> files;
+  // texture chunks waiting to be compressed as pairs of file index and chunk index
+  std::deque<std::pair<size_t, size_t>> chunkTasks;
+  boost::mutex mutex;
+  boost::condition_variable changed;
+  size_t nextFile     = 0;
+  size_t filesWritten = 0;
+  bool canceled       = false;
+  // files with data of their own by their contents, if files are deduplicated
+  bool deduplicate = false;
+  std::unordered_map<ContentKey, size_t, ContentKeyHash> contents;
+
+  /**
+   * look for an earlier file that has the same data as a file being packed, which then
+   * shares the earlier file's data. The packers work on files out of order, so if a
+   * later file with the same data got here first that one keeps its own data
+   * @param data content of a file read from disc. A matching key is only a hash, so
+   *             this is compared to the content of the earlier file before sharing.
+   *             Not needed for data copied from the source archive
+   * @return true if the file shares the data of another one
+   */
+  bool shareData(size_t index, const ContentKey& key, const DataBuffer* data = nullptr)
+  {
+    size_t original;
+    {
+      boost::lock_guard<boost::mutex> lock(mutex);
+      std::pair<std::unordered_map<ContentKey, size_t, ContentKeyHash>::iterator, bool>
+          inserted = contents.emplace(key, index);
+      if (inserted.second) {
+        return false;
+      }
+      if (inserted.first->second > index) {
+        inserted.first->second = index;
+        return false;
+      }
+      original = inserted.first->second;
     }
-
-    // write file data
-    for (std::vector<Folder::Ptr>::iterator folderIter = folders.begin();
-         folderIter != folders.end(); ++folderIter) {
-      (*folderIter)->writeFileData(m_File, outfile);
+    // the earlier file is read again, this only happens for files that are most
+    // likely duplicates
+    if ((data != nullptr) && !sameData(original, *data)) {
+      return false;
     }
+    boost::lock_guard<boost::mutex> lock(mutex);
+    files[index].sharedWith = original;
+    return true;
+  }
 
-    outfile.seekp(0x24, fstream::beg);
-
-    // re-write folder and file structure, this time with the correct
-    // offsets
-    for (std::vector<Folder::Ptr>::const_iterator folderIter = folders.begin();
-         folderIter != folders.end(); ++folderIter) {
-      (*folderIter)->writeHeader(outfile);
-    }
+  /**
+   * @return true if the source file of files[index] has exactly the content data
+   */
+  bool sameData(size_t index, const DataBuffer& data) const;
+};
 
-    for (std::vector<Folder::Ptr>::const_iterator folderIter = folders.begin();
-         folderIter != folders.end(); ++folderIter) {
-      (*folderIter)->writeData(outfile, fileNamesLength);
-    }
+// textures in a ba2 are split at mip boundaries. Mips are added to a chunk until it
+// reaches MIN_CHUNK_SIZE, the last chunk takes all remaining mips
+static const BSAULong MIN_CHUNK_SIZE = 512 * 1024;
+static const size_t MAX_CHUNKS       = 4;
 
-    outfile.close();
-    return ERROR_NONE;
-  } catch (std::ios_base::failure&) {
-    outfile.close();
-    return ERROR_INVALIDDATA;
+static EErrorCode readSourceFile(const std::string& fileName,
+                                 Archive::DataBuffer& data)
+{
+  std::ifstream sourceFile(fileName.c_str(),
+                           std::ios::in | std::ios::binary | std::ios::ate);
+  if (!sourceFile.is_open()) {
+    return ERROR_SOURCEFILEMISSING;
   }
+  BSAULong size = static_cast<BSAULong>(sourceFile.tellg());
+  sourceFile.seekg(0, std::ios::beg);
+  data = std::make_pair(BufferPool::instance().allocate(size), size);
+  if (!sourceFile.read(reinterpret_cast<char*>(data.first.get()), size)) {
+    return ERROR_SOURCEFILEMISSING;
+  }
+  return ERROR_NONE;
 }
 
-DirectX::DDS_HEADER Archive::getDDSHeader(File::Ptr file,
-                                          DirectX::DDS_HEADER_DXT10& DX10Header,
-                                          bool& isDX10) const
+bool Archive::PackState::sameData(size_t index, const DataBuffer& data) const
 {
-  DirectX::DDS_HEADER DDSHeaderData = {};
-  DDSHeaderData.size                = sizeof(DDSHeaderData);
-  DDSHeaderData.flags =
-      DDS_HEADER_FLAGS_TEXTURE | DDS_HEADER_FLAGS_LINEARSIZE | DDS_HEADER_FLAGS_MIPMAP;
-  DDSHeaderData.height      = file->m_TextureHeader.height;
-  DDSHeaderData.width       = file->m_TextureHeader.width;
-  DDSHeaderData.mipMapCount = file->m_TextureHeader.mipCount;
-  DDSHeaderData.ddspf.size  = sizeof(DirectX::DDS_PIXELFORMAT);
-  DDSHeaderData.caps        = DDS_SURFACE_FLAGS_TEXTURE | DDS_SURFACE_FLAGS_MIPMAP;
-
-  if (file->m_TextureHeader.isCubemap)
-    DDSHeaderData.caps2 = DDS_CUBEMAP_ALLFACES;
-
-  bool supported = true;
-
-  switch (file->m_TextureHeader.format) {
-  case DXGI_FORMAT_BC1_UNORM:
-  case DXGI_FORMAT_BC1_UNORM_SRGB:
-    DDSHeaderData.ddspf = DirectX::DDSPF_DXT1;
-    DDSHeaderData.pitchOrLinearSize =
-        file->m_TextureHeader.width * file->m_TextureHeader.height / 2;
-    break;
-
-  case DXGI_FORMAT_BC2_UNORM:
-  case DXGI_FORMAT_BC2_UNORM_SRGB:
-    DDSHeaderData.ddspf = DirectX::DDSPF_DXT3;
-    DDSHeaderData.pitchOrLinearSize =
-        file->m_TextureHeader.width * file->m_TextureHeader.height;
-    break;
-
-  case DXGI_FORMAT_BC3_UNORM:
-  case DXGI_FORMAT_BC3_UNORM_SRGB:
-    DDSHeaderData.ddspf = DirectX::DDSPF_DXT5;
-    DDSHeaderData.pitchOrLinearSize =
-        file->m_TextureHeader.width * file->m_TextureHeader.height;
-    break;
-
-  case DXGI_FORMAT_BC4_UNORM:
-    DDSHeaderData.ddspf = DirectX::DDSPF_BC4_UNORM;
-    DDSHeaderData.pitchOrLinearSize =
-        file->m_TextureHeader.width * file->m_TextureHeader.height;
-    break;
-
-  case DXGI_FORMAT_BC4_SNORM:
-    DDSHeaderData.ddspf = DirectX::DDSPF_BC4_SNORM;
-    DDSHeaderData.pitchOrLinearSize =
-        file->m_TextureHeader.width * file->m_TextureHeader.height;
-    break;
-
-  case DXGI_FORMAT_BC5_UNORM:
-    DDSHeaderData.ddspf = DirectX::DDSPF_BC5_UNORM;
-    DDSHeaderData.pitchOrLinearSize =
-        file->m_TextureHeader.width * file->m_TextureHeader.height;
-    break;
-
-  case DXGI_FORMAT_BC5_SNORM:
-    DDSHeaderData.ddspf = DirectX::DDSPF_BC5_SNORM;
-    DDSHeaderData.pitchOrLinearSize =
-        file->m_TextureHeader.width * file->m_TextureHeader.height;
-    break;
-
-  case DXGI_FORMAT_BC7_UNORM:
-  case DXGI_FORMAT_BC7_UNORM_SRGB:
-    DDSHeaderData.ddspf = DirectX::DDSPF_DX10;
-    DDSHeaderData.pitchOrLinearSize =
-        file->m_TextureHeader.width * file->m_TextureHeader.height;
-
-    isDX10                = true;
-    DX10Header.dxgiFormat = file->m_TextureHeader.format;
-    break;
-
-  case DXGI_FORMAT_R8G8B8A8_UNORM:
-    DDSHeaderData.ddspf = DirectX::DDSPF_A8B8G8R8;
-    DDSHeaderData.pitchOrLinearSize =
-        file->m_TextureHeader.width * file->m_TextureHeader.height * 4;  // 32bpp
-    break;
-
-  case DXGI_FORMAT_B8G8R8A8_UNORM:
-    DDSHeaderData.ddspf = DirectX::DDSPF_A8R8G8B8;
-    DDSHeaderData.pitchOrLinearSize =
-        file->m_TextureHeader.width * file->m_TextureHeader.height * 4;  // 32bpp
-    break;
-
-  case DXGI_FORMAT_B8G8R8X8_UNORM:
-    DDSHeaderData.ddspf = DirectX::DDSPF_X8R8G8B8;
-    break;
-
-  case DXGI_FORMAT_R8_UNORM:
-    DDSHeaderData.ddspf = DirectX::DDSPF_L8;
-    DDSHeaderData.pitchOrLinearSize =
-        file->m_TextureHeader.width * file->m_TextureHeader.height;  // 8bpp
-    break;
+  DataBuffer original;
+  return (readSourceFile(files[index].file->getSourceFile(), original) == ERROR_NONE) &&
+         (original.second == data.second) &&
+         (memcmp(original.first.get(), data.first.get(), data.second) == 0);
+}
 
-  case DXGI_FORMAT_R16_UNORM:
-    DDSHeaderData.ddspf = DirectX::DDSPF_L16;
-    DDSHeaderData.pitchOrLinearSize =
-        file->m_TextureHeader.width * file->m_TextureHeader.height * 2;  // 16bpp
-    break;
+static bool samePixelFormat(const DirectX::DDS_PIXELFORMAT& lhs,
+                            const DirectX::DDS_PIXELFORMAT& rhs)
+{
+  return memcmp(&lhs, &rhs, sizeof(DirectX::DDS_PIXELFORMAT)) == 0;
+}
 
-  case DXGI_FORMAT_R8G8_UNORM:
-    DDSHeaderData.ddspf = DirectX::DDSPF_A8L8;
-    DDSHeaderData.pitchOrLinearSize =
-        file->m_TextureHeader.width * file->m_TextureHeader.height * 2;  // 16bpp
-    break;
+/**
+ * @brief how a texture format is stored in a dds file
+ */
+struct DDSFormat
+{
+  DXGI_FORMAT format;
+  // pixel format of the plain header, nullptr if the format needs a DX10 header
+  const DirectX::DDS_PIXELFORMAT* pixelFormat;
+  // bits per pixel the pitchOrLinearSize of the header is calculated with
+  unsigned int linearBits;
+  // size of a 4x4 block of a block compressed format, 0 for other formats
+  unsigned int blockBytes;
+  // size of a pixel of an uncompressed format
+  unsigned int pixelBytes;
+};
+
+// the formats that can be written to and read from ba2 textures. Where several formats
+// share a pixel format the first one is picked when a dds file is read
+static const DDSFormat DDS_FORMATS[] = {
+    {DXGI_FORMAT_BC1_UNORM, &DirectX::DDSPF_DXT1, 4, 8, 0},
+    {DXGI_FORMAT_BC1_UNORM_SRGB, &DirectX::DDSPF_DXT1, 4, 8, 0},
+    {DXGI_FORMAT_BC2_UNORM, &DirectX::DDSPF_DXT3, 8, 16, 0},
+    {DXGI_FORMAT_BC2_UNORM_SRGB, &DirectX::DDSPF_DXT3, 8, 16, 0},
+    {DXGI_FORMAT_BC3_UNORM, &DirectX::DDSPF_DXT5, 8, 16, 0},
+    {DXGI_FORMAT_BC3_UNORM_SRGB, &DirectX::DDSPF_DXT5, 8, 16, 0},
+    {DXGI_FORMAT_BC4_UNORM, &DirectX::DDSPF_BC4_UNORM, 8, 8, 0},
+    {DXGI_FORMAT_BC4_SNORM, &DirectX::DDSPF_BC4_SNORM, 8, 8, 0},
+    {DXGI_FORMAT_BC5_UNORM, &DirectX::DDSPF_BC5_UNORM, 8, 16, 0},
+    {DXGI_FORMAT_BC5_SNORM, &DirectX::DDSPF_BC5_SNORM, 8, 16, 0},
+    {DXGI_FORMAT_BC6H_UF16, nullptr, 8, 16, 0},
+    {DXGI_FORMAT_BC6H_SF16, nullptr, 8, 16, 0},
+    {DXGI_FORMAT_BC7_UNORM, nullptr, 8, 16, 0},
+    {DXGI_FORMAT_BC7_UNORM_SRGB, nullptr, 8, 16, 0},
+    {DXGI_FORMAT_R8G8B8A8_UNORM, &DirectX::DDSPF_A8B8G8R8, 32, 0, 4},
+    {DXGI_FORMAT_R8G8B8A8_UNORM_SRGB, nullptr, 32, 0, 4},
+    {DXGI_FORMAT_B8G8R8A8_UNORM, &DirectX::DDSPF_A8R8G8B8, 32, 0, 4},
+    {DXGI_FORMAT_B8G8R8A8_UNORM_SRGB, nullptr, 32, 0, 4},
+    {DXGI_FORMAT_B8G8R8X8_UNORM, &DirectX::DDSPF_X8R8G8B8, 32, 0, 4},
+    {DXGI_FORMAT_B8G8R8X8_UNORM_SRGB, nullptr, 32, 0, 4},
+    {DXGI_FORMAT_R8G8_UNORM, &DirectX::DDSPF_A8L8, 16, 0, 2},
+    {DXGI_FORMAT_R16_UNORM, &DirectX::DDSPF_L16, 16, 0, 2},
+    {DXGI_FORMAT_R8_UNORM, &DirectX::DDSPF_L8, 8, 0, 1},
+};
+
+/**
+ * @return the description of a texture format or nullptr if it isn't supported
+ */
+static const DDSFormat* findDDSFormat(DXGI_FORMAT format)
+{
+  // indexed by format so each texture costs a single lookup
+  static const std::array<const DDSFormat*, 256> formats = []() {
+    std::array<const DDSFormat*, 256> result = {};
+    for (const DDSFormat& entry : DDS_FORMATS) {
+      result[static_cast<size_t>(entry.format)] = &entry;
+    }
+    return result;
+  }();
+  size_t index = static_cast<size_t>(format);
+  return (index < formats.size()) ? formats[index] : nullptr;
+}
 
-  default:
-    return {};
-    break;
+/**
+ * @return size of the magic and headers in front of a texture when extracted
+ */
+static BSAULong ddsHeaderSize(const FO4TextureHeader& header)
+{
+  const DDSFormat* format = findDDSFormat(header.format);
+  BSAULong size           = 4 + sizeof(DirectX::DDS_HEADER);
+  if ((format != nullptr) && (format->pixelFormat == nullptr)) {
+    size += sizeof(DirectX::DDS_HEADER_DXT10);
   }
-
-  return DDSHeaderData;
+  return size;
 }
 
-void Archive::getDX10Header(DirectX::DDS_HEADER_DXT10& DX10Header, File::Ptr file,
-                            DirectX::DDS_HEADER DDSHeader) const
+/**
+ * add up the size of a texture once extracted, with the headers in front of it
+ * @return false if the texture is too large to be extracted
+ */
+static bool textureExtractedSize(const FO4TextureHeader& header,
+                                 std::span<const FO4TextureChunk> chunks,
+                                 BSAULong& size)
 {
-  DX10Header.resourceDimension = DirectX::DDS_DIMENSION_TEXTURE2D;
-  DX10Header.miscFlag          = 0;
-  DX10Header.arraySize         = 1;
-  DX10Header.miscFlags2        = 0;
+  BSAHash total = ddsHeaderSize(header);
+  for (const FO4TextureChunk& chunk : chunks) {
+    total += chunk.unpackedSize;
+  }
+  // extracted sizes are 32 bit
+  if (total > 0xFFFFFFFFULL) {
+    return false;
+  }
+  size = static_cast<BSAULong>(total);
+  return true;
 }
 
-static const unsigned long CHUNK_SIZE = 128 * 1024;
-
-EErrorCode Archive::extractDirect(File::Ptr file, std::ofstream& outFile) const
+/**
+ * @return size of a mip of one face of a texture, 0 if the format is unknown
+ */
+static BSAULong mipSize(const FO4TextureHeader& header, unsigned int mip)
 {
-  EErrorCode result = ERROR_NONE;
-  if (file->m_FileSize == 0) {
-    // don't try to read empty file
-    return result;
+  const DDSFormat* format = findDDSFormat(header.format);
+  if (format == nullptr) {
+    return 0;
   }
+  BSAULong width  = (std::max)(BSAULong(header.width) >> mip, BSAULong(1));
+  BSAULong height = (std::max)(BSAULong(header.height) >> mip, BSAULong(1));
+  if (format->blockBytes > 0) {
+    return ((width + 3) / 4) * ((height + 3) / 4) * format->blockBytes;
+  }
+  return width * height * format->pixelBytes;
+}
 
-  m_File.clear();
-  m_File.seekg(static_cast<std::ifstream::pos_type>(file->m_DataOffset), std::ios::beg);
-
-  if (m_Type == TYPE_FALLOUT4 || m_Type == TYPE_STARFIELD ||
-      m_Type == TYPE_STARFIELD_LZ4_TEXTURE || m_Type == TYPE_FALLOUT4NG_7 ||
-      m_Type == TYPE_FALLOUT4NG_8) {
-    if (!file->m_TextureChunks.size()) {
-      BSAULong size = file->m_UncompressedFileSize;
-      std::unique_ptr<char[]> buffer(new char[size]);
-      m_File.read(buffer.get(), size);
-      outFile.write(buffer.get(), size);
-    } else {
-      bool isDX10                              = false;
-      DirectX::DDS_HEADER_DXT10 DX10HeaderData = {};
-      DirectX::DDS_HEADER DDSHeaderData = getDDSHeader(file, DX10HeaderData, isDX10);
-
-      outFile.write("DDS ", 4);
-      char* DDSHeader = new char[sizeof(DDSHeaderData)];
-      memcpy(DDSHeader, &DDSHeaderData, sizeof(DDSHeaderData));
-      outFile.write(DDSHeader, sizeof(DDSHeaderData));
-      delete[] DDSHeader;
+/**
+ * @return path of a file as stored in a ba2. Unlike getFilePath there is no leading
+ *         separator for files in the root folder
+ */
+static std::string ba2Path(const File::Ptr& file)
+{
+  std::string path = file->getFilePath();
+  size_t start     = path.find_first_not_of("\\/");
+  return (start == std::string::npos) ? std::string() : path.substr(start);
+}
 
-      if (isDX10) {
-        getDX10Header(DX10HeaderData, file, DDSHeaderData);
-        char* DX10Header = new char[sizeof(DX10HeaderData)];
-        memcpy(DX10Header, &DX10HeaderData, sizeof(DX10HeaderData));
-        outFile.write(DX10Header, sizeof(DX10HeaderData));
-        delete[] DX10Header;
-      }
+/**
+ * @brief copies ranges of the source archive to the archive being written. Adjacent
+ * ranges are merged so a run of unchanged files is transferred in one go
+ */
+class RunCopier
+{
 
-      for (BSAUInt i = 0; i < file->m_TextureChunks.size(); ++i) {
-        BSAULong length = file->m_TextureChunks[i].unpackedSize;
-        std::unique_ptr<char[]> chunk(new char[length]);
-        m_File.read(chunk.get(), length);
-        outFile.write(chunk.get(), length);
-      }
+public:
+  RunCopier(const ArchiveSource& source, std::ostream& target)
+      : m_Source(source), m_Target(target), m_Offset(0), m_Length(0)
+  {}
+
+  /**
+   * queue a range for copying. The pending run is copied first if the range doesn't
+   * continue it
+   * @return false if the pending run couldn't be copied
+   */
+  bool add(BSAHash offset, BSAHash length)
+  {
+    if ((m_Length > 0) && (offset != m_Offset + m_Length) && !flush()) {
+      return false;
     }
-  } else {
-    BSAULong size = file->m_FileSize;
-    if (namePrefixed()) {
-      std::string fullName = readBString(m_File);
-      if (size <= fullName.length()) {
-#pragma message("report error!")
-        return result;
-      }
-      size -= fullName.length() + 1;
+    if (m_Length == 0) {
+      m_Offset = offset;
     }
-    std::unique_ptr<unsigned char[]> buffer(new unsigned char[size]);
-    m_File.read(reinterpret_cast<char*>(buffer.get()), size);
-    if (result == ERROR_NONE)
-      outFile.write(reinterpret_cast<char*>(buffer.get()), size);
+    m_Length += length;
+    return true;
   }
-  std::unique_ptr<char[]> inBuffer(new char[CHUNK_SIZE]);
 
-  try {
-    unsigned long sizeLeft = file->m_FileSize;
+  /**
+   * copy the pending run. Needs to be called before anything else is written to the
+   * target
+   * @return false if the run couldn't be copied
+   */
+  bool flush()
+  {
+    bool result = (m_Length == 0) || m_Source.copyTo(m_Offset, m_Length, m_Target);
+    m_Length    = 0;
+    return result;
+  }
 
-    while (sizeLeft > 0) {
-      int chunkSize = (std::min)(sizeLeft, CHUNK_SIZE);
-      m_File.read(inBuffer.get(), chunkSize);
-      outFile.write(inBuffer.get(), chunkSize);
-      sizeLeft -= chunkSize;
+private:
+  const ArchiveSource& m_Source;
+  std::ostream& m_Target;
+  BSAHash m_Offset;
+  BSAHash m_Length;
+};
+
+/**
+ * set up the fields a ba2 record identifies its file by
+ */
+template <typename Record>
+static void setBA2Hashes(const std::string& filePath, Record& record)
+{
+  std::string_view path(filePath);
+  size_t separator = path.find_last_of("\\/");
+  std::string_view fileName =
+      (separator == std::string_view::npos) ? path : path.substr(separator + 1);
+  record.dirHash = (separator == std::string_view::npos)
+                       ? 0U
+                       : calculateBA2Hash(path.substr(0, separator));
+
+  size_t dot = fileName.find_last_of('.');
+  memset(record.extension, 0, sizeof(record.extension));
+  if (dot != std::string_view::npos) {
+    std::string_view extension = fileName.substr(dot + 1, sizeof(record.extension));
+    for (size_t i = 0; i < extension.size(); ++i) {
+      record.extension[i] =
+          static_cast<char>(tolower(static_cast<unsigned char>(extension[i])));
     }
-  } catch (const std::exception&) {
-    result = ERROR_INVALIDDATA;
+    fileName = fileName.substr(0, dot);
   }
-  return result;
+  record.nameHash = calculateBA2Hash(fileName);
 }
 
-boost::shared_array<unsigned char> Archive::decompress(unsigned char* inBuffer,
-                                                       BSAULong inSize,
-                                                       EErrorCode& result,
-                                                       BSAULong& outSize)
+bool Archive::readDDSHeader(const unsigned char* data, BSAULong size,
+                            FO4TextureHeader& header, BSAULong& headerSize)
 {
-  if (outSize == 0) {
-    memcpy(&outSize, inBuffer, sizeof(BSAULong));
-    inBuffer += sizeof(BSAULong);
-    inSize -= sizeof(BSAULong);
-  }
+  const unsigned char* pos = data;
+  const unsigned char* end = data + size;
+  try {
+    if (readType<uint32_t>(pos, end) != DirectX::DDS_MAGIC) {
+      return false;
+    }
+    DirectX::DDS_HEADER DDSHeader = readType<DirectX::DDS_HEADER>(pos, end);
+    if ((DDSHeader.width > 0xFFFF) || (DDSHeader.height > 0xFFFF) ||
+        (DDSHeader.mipMapCount > 0xFF)) {
+      return false;
+    }
 
-  if ((inSize == 0) || (outSize == 0)) {
-    return boost::shared_array<unsigned char>();
+    header             = {};
+    header.width       = static_cast<BSAUShort>(DDSHeader.width);
+    header.height      = static_cast<BSAUShort>(DDSHeader.height);
+    header.mipCount    = static_cast<BSAUChar>((std::max)(DDSHeader.mipMapCount, 1U));
+    header.isCubemap   = (DDSHeader.caps2 & DDS_CUBEMAP_ALLFACES) != 0;
+    header.format      = DXGI_FORMAT_UNKNOWN;
+    const auto& format = DDSHeader.ddspf;
+
+    // reverse of the mapping in getDDSHeader
+    if (samePixelFormat(format, DirectX::DDSPF_DX10)) {
+      DirectX::DDS_HEADER_DXT10 DX10Header =
+          readType<DirectX::DDS_HEADER_DXT10>(pos, end);
+      if (DX10Header.arraySize > 1) {
+        // texture records have no room for arrays
+        return false;
+      }
+      header.format = DX10Header.dxgiFormat;
+      if ((DX10Header.miscFlag & DirectX::DDS_RESOURCE_MISC_TEXTURECUBE) != 0) {
+        header.isCubemap = true;
+      }
+    } else {
+      for (const DDSFormat& entry : DDS_FORMATS) {
+        if ((entry.pixelFormat != nullptr) &&
+            samePixelFormat(format, *entry.pixelFormat)) {
+          header.format = entry.format;
+          break;
+        }
+      }
+      if (header.format == DXGI_FORMAT_UNKNOWN) {
+        return false;
+      }
+    }
+    headerSize = static_cast<BSAULong>(pos - data);
+    return true;
+  } catch (const data_invalid_exception&) {
+    return false;
   }
+}
 
-  boost::shared_array<unsigned char> outBuffer(new unsigned char[outSize]);
+EErrorCode Archive::planTexture(PackedFile& packed) const
+{
+  const File::Ptr& file = packed.file;
 
-  z_stream stream;
   try {
-    stream.zalloc   = Z_NULL;
-    stream.zfree    = Z_NULL;
-    stream.opaque   = Z_NULL;
-    stream.avail_in = inSize;
-    stream.next_in  = static_cast<Bytef*>(inBuffer);
-    int zlibRet     = inflateInit2(&stream, 15 + 32);
-    if (zlibRet != Z_OK) {
-      result = ERROR_ZLIBINITFAILED;
-      return boost::shared_array<unsigned char>();
-    }
-
-    do {
-      stream.avail_out = outSize;
-      stream.next_out  = reinterpret_cast<Bytef*>(outBuffer.get());
-      zlibRet          = inflate(&stream, Z_NO_FLUSH);
-      if ((zlibRet != Z_OK) && (zlibRet != Z_STREAM_END) && (zlibRet != Z_BUF_ERROR)) {
-#pragma message("pass result code to caller")
-        throw std::runtime_error("invalid data");
-      }
-    } while (stream.avail_out == 0);
-    inflateEnd(&stream);
-    return outBuffer;
+    if (file->getSourceFile().empty()) {
+      // textures from an archive keep their chunks
+      loadTextureInfo(*file);
+      std::span<const FO4TextureChunk> chunks = textureChunks(*file);
+      packed.textureHeader                    = file->getTextureHeader();
+      packed.chunkRecords.assign(chunks.begin(), chunks.end());
+      return ERROR_NONE;
+    }
+
+    std::ifstream sourceFile(file->getSourceFile().c_str(),
+                             std::ios::in | std::ios::binary);
+    if (!sourceFile.is_open()) {
+      return ERROR_SOURCEFILEMISSING;
+    }
+    unsigned char buffer[DDS_HEADER_MAXSIZE];
+    sourceFile.read(reinterpret_cast<char*>(buffer), sizeof(buffer));
+    BSAULong headerSize = 0;
+    if (!readDDSHeader(buffer, static_cast<BSAULong>(sourceFile.gcount()),
+                       packed.textureHeader, headerSize)) {
+      return ERROR_INVALIDDATA;
+    }
+    sourceFile.clear();
+    sourceFile.seekg(0, std::ios::end);
+    BSAULong dataSize = static_cast<BSAULong>(sourceFile.tellg()) - headerSize;
+
+    const FO4TextureHeader& header = packed.textureHeader;
+    BSAULong expectedSize          = 0;
+    for (unsigned int mip = 0; mip < header.mipCount; ++mip) {
+      expectedSize += mipSize(header, mip);
+    }
+
+    // while packing the chunk offsets refer to the source file
+    FO4TextureChunk chunk = {};
+    chunk.offset          = headerSize;
+    chunk.unknown         = 0xBAADF00D;
+    if (header.isCubemap || (expectedSize != dataSize)) {
+      // the faces of cube maps each have a complete set of mips and for unknown formats
+      // there is no telling where mips end, so these are stored in one piece
+      chunk.unpackedSize = dataSize;
+      chunk.endMip       = header.mipCount - 1;
+      packed.chunkRecords.push_back(chunk);
+    } else {
+      for (unsigned int mip = 0; mip < header.mipCount; ++mip) {
+        chunk.unpackedSize += mipSize(header, mip);
+        chunk.endMip = static_cast<BSAUShort>(mip);
+        if ((mip + 1 == header.mipCount) ||
+            ((chunk.unpackedSize >= MIN_CHUNK_SIZE) &&
+             (packed.chunkRecords.size() + 1 < MAX_CHUNKS))) {
+          packed.chunkRecords.push_back(chunk);
+          chunk.offset += chunk.unpackedSize;
+          chunk.unpackedSize = 0;
+          chunk.startMip     = static_cast<BSAUShort>(mip + 1);
+        }
+      }
+    }
+    packed.textureHeader.chunkNumber =
+        static_cast<BSAUChar>(packed.chunkRecords.size());
+    packed.textureHeader.chunkHeaderSize = sizeof(FO4TextureChunk);
+    return ERROR_NONE;
   } catch (const std::exception&) {
-    result = ERROR_INVALIDDATA;
-    inflateEnd(&stream);
-    return boost::shared_array<unsigned char>();
+    return ERROR_INVALIDDATA;
   }
 }
 
-EErrorCode Archive::extractCompressed(File::Ptr file, std::ofstream& outFile) const
+EErrorCode Archive::packFile(PackState& state, size_t index) const
 {
-  EErrorCode result = ERROR_NONE;
-  if (file->m_FileSize == 0) {
-    // don't try to read empty file
-    return result;
-  }
+  PackedFile& packed    = state.files[index];
+  const File::Ptr& file = packed.file;
 
-  m_File.clear();
-  m_File.seekg(static_cast<std::ifstream::pos_type>(file->m_DataOffset), std::ios::beg);
+  try {
+    if (file->getSourceFile().empty() && (m_Type == m_SourceType)) {
+      // unchanged files are copied verbatim by the writer, in runs of adjacent files
+      packed.copied = true;
+      if (packed.chunkRecords.empty()) {
+        packed.compressed   = isBA2() && compressed(file);
+        packed.unpackedSize = file->getUncompressedFileSize();
+        packed.data.second  = (isBA2() && !packed.compressed) ? packed.unpackedSize
+                                                              : file->getFileSize();
+      }
+      if (state.deduplicate) {
+        // records that already share data in the source archive keep sharing it
+        ContentKey key = {};
+        key.copied     = true;
+        if (packed.chunkRecords.empty()) {
+          key.hash       = file->getDataOffset();
+          key.size       = packed.data.second;
+          key.compressed = compressed(file);
+        } else {
+          key.hash = packed.chunkRecords.front().offset;
+          key.size = packed.chunkRecords.size();
+        }
+        state.shareData(index, key);
+      }
+      return ERROR_NONE;
+    }
+
+    if (file->getSourceFile().empty()) {
+      if (packed.chunkRecords.size()) {
+        // texture chunks are copied as stored
+        for (const FO4TextureChunk& chunk : packed.chunkRecords) {
+          BSAULong size = chunk.packedSize > 0 ? chunk.packedSize : chunk.unpackedSize;
+          packed.chunks.push_back(
+              std::make_pair(fetchShared(chunk.offset, size), size));
+        }
+        return ERROR_NONE;
+      }
+      if (isBA2()) {
+        packed.compressed   = compressed(file);
+        packed.unpackedSize = file->getUncompressedFileSize();
+        BSAULong size = packed.compressed ? file->getFileSize() : packed.unpackedSize;
+        packed.data   = std::make_pair(fetchShared(file->getDataOffset(), size), size);
+        return ERROR_NONE;
+      }
+
+      // copy from the source archive. The compression of the file doesn't change, only
+      // the name prefix is written anew
+      BSAULong size = file->getFileSize();
+      if (size == 0) {
+        packed.data = DataBuffer(BufferPool::instance().allocate(1), 0UL);
+        return ERROR_NONE;
+      }
+      boost::shared_array<unsigned char> blob =
+          fetchShared(file->getDataOffset(), size);
+      const unsigned char* data = blob.get();
+      if (!skipNamePrefix(data, size)) {
+        return ERROR_INVALIDDATA;
+      }
+      packed.data = std::make_pair(
+          boost::shared_array<unsigned char>(blob, const_cast<unsigned char*>(data)),
+          size);
+      return ERROR_NONE;
+    }
+
+    DataBuffer source;
+    EErrorCode result = readSourceFile(file->getSourceFile(), source);
+    if (result != ERROR_NONE) {
+      return result;
+    }
+    packed.compressed   = file->compressToggledWrite() != defaultCompressed();
+    packed.unpackedSize = source.second;
+
+    if (state.deduplicate) {
+      // hashed here so the packers share the work. Data that is already being written
+      // isn't compressed again
+      ContentKey key = {};
+      key.hash       = calculateContentHash(source.first.get(), source.second);
+      key.size       = source.second;
+      key.compressed = packed.compressed;
+      if (state.shareData(index, key, &source)) {
+        return ERROR_NONE;
+      }
+    }
 
-  if (m_Type == TYPE_FALLOUT4 || m_Type == TYPE_STARFIELD ||
-      m_Type == TYPE_STARFIELD_LZ4_TEXTURE || m_Type == TYPE_FALLOUT4NG_7 ||
-      m_Type == TYPE_FALLOUT4NG_8) {
-    if (!file->m_TextureChunks.size()) {
-      BSAULong inSize = file->m_FileSize;
-      std::unique_ptr<unsigned char[]> inBuffer(new unsigned char[inSize]);
-      m_File.read(reinterpret_cast<char*>(inBuffer.get()), inSize);
-      BSAULong length = file->m_UncompressedFileSize;
-      boost::shared_array<unsigned char> buffer =
-          decompress(inBuffer.get(), inSize, result, length);
-      if (result == ERROR_NONE) {
-        outFile.write(reinterpret_cast<char*>(buffer.get()), length);
+    if (packed.chunkRecords.size()) {
+      // the chunks are compressed by packChunk
+      const FO4TextureChunk& last = packed.chunkRecords.back();
+      if (last.offset + last.unpackedSize != source.second) {
+        // the file changed since the archive layout was planned
+        return ERROR_INVALIDDATA;
       }
+      packed.data          = source;
+      packed.pendingChunks = packed.chunkRecords.size();
+      packed.chunks.resize(packed.chunkRecords.size());
+      return ERROR_NONE;
+    }
+
+    if (!packed.compressed) {
+      packed.data = source;
+      return ERROR_NONE;
+    }
+
+    if (isBA2()) {
+      result = deflateBuffer(source.first.get(), source.second, 0, packed.data.first,
+                             packed.data.second);
+      if ((result == ERROR_NONE) && (packed.data.second >= source.second)) {
+        // not worth it, ba2 files can be stored uncompressed individually
+        packed.compressed = false;
+        packed.data       = source;
+      }
+      return result;
+    }
+
+    // the size of compressed files is stored in front of the data
+    if (m_Type == TYPE_SKYRIMSE) {
+      result = lz4FrameBuffer(source.first.get(), source.second, sizeof(BSAUInt),
+                              packed.data.first, packed.data.second);
     } else {
-      bool isDX10                              = false;
-      DirectX::DDS_HEADER_DXT10 DX10HeaderData = {};
-      DirectX::DDS_HEADER DDSHeaderData = getDDSHeader(file, DX10HeaderData, isDX10);
-
-      outFile.write("DDS ", 4);
-      char* DDSHeader = new char[sizeof(DDSHeaderData)];
-      memcpy(DDSHeader, &DDSHeaderData, sizeof(DDSHeaderData));
-      outFile.write(DDSHeader, sizeof(DDSHeaderData));
-      delete[] DDSHeader;
-
-      if (isDX10) {
-        getDX10Header(DX10HeaderData, file, DDSHeaderData);
-        char* DX10Header = new char[sizeof(DX10HeaderData)];
-        memcpy(DX10Header, &DX10HeaderData, sizeof(DX10HeaderData));
-        outFile.write(DX10Header, sizeof(DX10HeaderData));
-        delete[] DX10Header;
-      }
-
-      for (BSAUInt i = 0; i < file->m_TextureChunks.size(); ++i) {
-        BSAULong length = file->m_TextureChunks[i].unpackedSize;
-        if (file->m_TextureChunks[i].packedSize > 0) {
-          unsigned char* chunk = new unsigned char[file->m_TextureChunks[i].packedSize];
-          m_File.read(reinterpret_cast<char*>(chunk),
-                      file->m_TextureChunks[i].packedSize);
-          if (m_Type == TYPE_STARFIELD_LZ4_TEXTURE) {
-            char* unpackedChunk = new char[length];
-            LZ4_decompress_safe(reinterpret_cast<char*>(chunk), unpackedChunk,
-                                file->m_TextureChunks[i].packedSize, length);
-            outFile.write(unpackedChunk, length);
-            delete[] unpackedChunk;
-          } else {
-            boost::shared_array<unsigned char> unpackedChunk =
-                decompress(chunk, file->m_TextureChunks[i].packedSize, result, length);
-            if (result == ERROR_NONE) {
-              outFile.write(reinterpret_cast<char*>(unpackedChunk.get()), length);
-            }
+      result = deflateBuffer(source.first.get(), source.second, sizeof(BSAUInt),
+                             packed.data.first, packed.data.second);
+    }
+    if (result == ERROR_NONE) {
+      BSAUInt originalSize = static_cast<BSAUInt>(source.second);
+      memcpy(packed.data.first.get(), &originalSize, sizeof(BSAUInt));
+    }
+    return result;
+  } catch (const std::exception&) {
+    return ERROR_INVALIDDATA;
+  }
+}
+
+EErrorCode Archive::packChunk(PackedFile& packed, size_t index) const
+{
+  FO4TextureChunk& chunk = packed.chunkRecords[index];
+  const unsigned char* source =
+      packed.data.first.get() + static_cast<size_t>(chunk.offset);
+
+  EErrorCode result = ERROR_NONE;
+  chunk.packedSize  = 0;
+  try {
+    if (packed.compressed) {
+      DataBuffer& target = packed.chunks[index];
+      if (m_Type == TYPE_STARFIELD_LZ4_TEXTURE) {
+        result =
+            lz4BlockBuffer(source, chunk.unpackedSize, 0, target.first, target.second);
+      } else {
+        result =
+            deflateBuffer(source, chunk.unpackedSize, 0, target.first, target.second);
+      }
+      if ((result == ERROR_NONE) && (target.second < chunk.unpackedSize)) {
+        chunk.packedSize = target.second;
+        return ERROR_NONE;
+      }
+    }
+    // stored uncompressed, straight from the source file
+    packed.chunks[index] = std::make_pair(
+        boost::shared_array<unsigned char>(packed.data.first,
+                                           const_cast<unsigned char*>(source)),
+        chunk.unpackedSize);
+    return result;
+  } catch (const std::exception&) {
+    return ERROR_INVALIDDATA;
+  }
+}
+
+void Archive::runPacker(PackState& state) const
+{
+  for (;;) {
+    size_t index;
+    size_t chunk = PackState::NO_CHUNK;
+    {
+      boost::unique_lock<boost::mutex> lock(state.mutex);
+      while (!state.canceled && state.chunkTasks.empty() &&
+             (state.nextFile < state.files.size()) &&
+             (state.nextFile >= state.filesWritten + PackState::MAX_AHEAD)) {
+        state.changed.wait(lock);
+      }
+      if (state.canceled) {
+        return;
+      }
+      if (!state.chunkTasks.empty()) {
+        // finish the textures that were started before taking on new files
+        index = state.chunkTasks.front().first;
+        chunk = state.chunkTasks.front().second;
+        state.chunkTasks.pop_front();
+      } else if (state.nextFile < state.files.size()) {
+        index = state.nextFile++;
+      } else {
+        return;
+      }
+    }
+
+    PackedFile& packed = state.files[index];
+    if (chunk == PackState::NO_CHUNK) {
+      EErrorCode result = packFile(state, index);
+      boost::lock_guard<boost::mutex> lock(state.mutex);
+      packed.result = result;
+      if ((result == ERROR_NONE) && (packed.pendingChunks > 0)) {
+        // the chunks of a texture are compressed by whichever packers are free
+        for (size_t i = 0; i < packed.pendingChunks; ++i) {
+          state.chunkTasks.push_back(std::make_pair(index, i));
+        }
+      } else {
+        packed.done = true;
+      }
+    } else {
+      EErrorCode result = packChunk(packed, chunk);
+      boost::lock_guard<boost::mutex> lock(state.mutex);
+      if (result != ERROR_NONE) {
+        packed.result = result;
+      }
+      if (--packed.pendingChunks == 0) {
+        packed.done = true;
+      }
+    }
+    state.changed.notify_all();
+  }
+}
+
+EErrorCode
+Archive::packFiles(PackState& state, const WriteOptions& options,
+                   const boost::function<EErrorCode(PackedFile&)>& writeFile) const
+{
+  unsigned int numPackers = options.compressThreads;
+  if (numPackers == 0) {
+    numPackers = (std::max)(1U, boost::thread::hardware_concurrency());
+  }
+  // a name prefix in front of the data belongs to a single file
+  state.deduplicate = options.deduplicate && !namePrefixed();
+  boost::thread_group packThreads;
+  for (unsigned int i = 0; i < numPackers; ++i) {
+    packThreads.create_thread(
+        boost::bind(&Archive::runPacker, this, boost::ref(state)));
+  }
+
+  EErrorCode result = ERROR_NONE;
+  try {
+    for (size_t i = 0; (i < state.files.size()) && (result == ERROR_NONE); ++i) {
+      PackedFile& packed = state.files[i];
+      {
+        boost::unique_lock<boost::mutex> lock(state.mutex);
+        while (!packed.done) {
+          state.changed.wait(lock);
+        }
+      }
+      result = (packed.result != ERROR_NONE) ? packed.result : writeFile(packed);
+      if ((result != ERROR_NONE) && options.fileError) {
+        options.fileError(packed.file, result);
+      }
+
+      // only the records and sizes are needed from here on
+      packed.data.first.reset();
+      packed.chunks.clear();
+      {
+        boost::lock_guard<boost::mutex> lock(state.mutex);
+        state.filesWritten = i + 1;
+      }
+      state.changed.notify_all();
+    }
+  } catch (std::ios_base::failure&) {
+    result = ERROR_INVALIDDATA;
+  }
+
+  {
+    // stops the packers if the writer gave up early
+    boost::lock_guard<boost::mutex> lock(state.mutex);
+    state.canceled = true;
+  }
+  state.changed.notify_all();
+  packThreads.join_all();
+  return result;
+}
+
+EErrorCode Archive::write(const char* fileName)
+{
+  return write(fileName, WriteOptions());
+}
+
+EErrorCode Archive::write(const char* fileName, const WriteOptions& options)
+{
+  if (m_Type == TYPE_MORROWIND) {
+    // no writer for this format
+    return ERROR_INVALIDDATA;
+  }
+
+  std::fstream outfile;
+  outfile.open(fileName, fstream::out | fstream::binary | fstream::trunc);
+  if (!outfile.is_open()) {
+    return ERROR_ACCESSFAILED;
+  }
+  outfile.exceptions(std::ios_base::badbit);
+
+  EErrorCode result;
+  try {
+    result = isBA2() ? writeBA2(outfile, options) : writeBSA(outfile, options);
+  } catch (std::ios_base::failure&) {
+    result = ERROR_INVALIDDATA;
+  }
+  outfile.close();
+  return result;
+}
+
+EErrorCode Archive::writeBSA(std::fstream& outfile, const WriteOptions& options)
+{
+  // the full paths are built once here and used for hashes, names and prefixes alike
+  std::vector<std::pair<Folder::Ptr, std::string>> folders;
+  m_RootFolder->collectFolderPaths(std::string(), folders);
+
+  // the games look up folders and the files within them with a binary search over the
+  // hashes. Folders placed in the tree by path don't necessarily have the hash of their
+  // full path yet
+  for (std::vector<std::pair<Folder::Ptr, std::string>>::iterator folderIter =
+           folders.begin();
+       folderIter != folders.end(); ++folderIter) {
+    folderIter->first->m_NameHash = calculateBSAHash(folderIter->second);
+    std::stable_sort(folderIter->first->m_Files.begin(),
+                     folderIter->first->m_Files.end(),
+                     [](const File::Ptr& lhs, const File::Ptr& rhs) {
+                       return lhs->getNameHash() < rhs->getNameHash();
+                     });
+  }
+  std::stable_sort(folders.begin(), folders.end(),
+                   [](const std::pair<Folder::Ptr, std::string>& lhs,
+                      const std::pair<Folder::Ptr, std::string>& rhs) {
+                     return lhs.first->m_NameHash < rhs.first->m_NameHash;
+                   });
+
+  bool writeFolderNames = (m_ArchiveFlags & FLAG_HASDIRNAMES) != 0;
+  bool writeFileNames   = (m_ArchiveFlags & FLAG_HASFILENAMES) != 0;
+
+  PackState state;
+  std::vector<std::string> fileNames;
+  // index into folders for each file, for the name prefixes
+  std::vector<size_t> fileFolders;
+  BSAULong folderNamesLength = 0;
+  BSAULong fileNamesLength   = 0;
+  for (size_t i = 0; i < folders.size(); ++i) {
+    // names are cut off at 255 characters by writeBString
+    folderNamesLength +=
+        static_cast<BSAULong>((std::min)(folders[i].second.length(), size_t(255)) + 1);
+    for (std::vector<File::Ptr>::const_iterator fileIter =
+             folders[i].first->m_Files.begin();
+         fileIter != folders[i].first->m_Files.end(); ++fileIter) {
+      state.files.emplace_back();
+      state.files.back().file = *fileIter;
+      fileFolders.push_back(i);
+      fileNames.emplace_back((*fileIter)->getNameView());
+      fileNamesLength += static_cast<BSAULong>(fileNames.back().length() + 1);
+    }
+  }
+
+  // everything in front of the file data has a size known up front. The folder offsets
+  // are assigned here, the data offsets while the data is written behind the directory
+  BSAHash recordSize = (m_Type == TYPE_SKYRIMSE) ? sizeof(BSAFolderRecordSE)
+                                                 : sizeof(BSAFolderRecord);
+  BSAHash offset     = 0x24 + recordSize * folders.size();
+  for (std::vector<std::pair<Folder::Ptr, std::string>>::const_iterator folderIter =
+           folders.begin();
+       folderIter != folders.end(); ++folderIter) {
+    // the stored offset points past the file names
+    folderIter->first->m_OffsetWrite = offset + fileNamesLength;
+    if (writeFolderNames) {
+      offset += (std::min)(folderIter->second.length(), size_t(255)) + 2;
+    }
+    offset += sizeof(BSAFileRecord) * folderIter->first->m_Files.size();
+  }
+  BSAHash dataOffset = offset + (writeFileNames ? fileNamesLength : 0);
+
+  // write the data in archive order as the packers finish it
+  outfile.seekp(static_cast<std::streamoff>(dataOffset), fstream::beg);
+  RunCopier copier(m_Source, outfile);
+  size_t fileIndex  = 0;
+  EErrorCode result = packFiles(state, options, [&](PackedFile& packed) {
+    const File::Ptr& file = packed.file;
+    BSAHash size          = packed.data.second;
+    std::string path;
+    if (namePrefixed() && !packed.copied) {
+      const std::string& folderPath = folders[fileFolders[fileIndex]].second;
+      path = (folderPath + "\\" + file->getName()).substr(0, 255);
+      size += path.length() + 1;
+    }
+    ++fileIndex;
+    if (packed.sharedWith != PackedFile::NOT_SHARED) {
+      const File::Ptr& original = state.files[packed.sharedWith].file;
+      file->setWritePosition(original->getDataOffsetWrite(),
+                             original->getFileSizeWrite());
+      return ERROR_NONE;
+    }
+    if (dataOffset + size > 0xFFFFFFFFULL) {
+      // offsets of files are 32 bit
+      return ERROR_INVALIDDATA;
+    }
+    if (packed.copied) {
+      // the stored blob includes the name prefix
+      if (!copier.add(file->getDataOffset(), size)) {
+        return ERROR_INVALIDDATA;
+      }
+    } else {
+      if (!copier.flush()) {
+        return ERROR_INVALIDDATA;
+      }
+      if (namePrefixed()) {
+        writeType<unsigned char>(outfile, static_cast<unsigned char>(path.length()));
+        outfile.write(path.c_str(), path.length());
+      }
+      outfile.write(reinterpret_cast<const char*>(packed.data.first.get()),
+                    packed.data.second);
+    }
+    file->setWritePosition(static_cast<BSAULong>(dataOffset),
+                           static_cast<BSAULong>(size));
+    dataOffset += size;
+    return ERROR_NONE;
+  });
+  if ((result == ERROR_NONE) && !copier.flush()) {
+    result = ERROR_INVALIDDATA;
+  }
+  if (result != ERROR_NONE) {
+    return result;
+  }
+
+  outfile.seekp(0, fstream::beg);
+  writeHeader(outfile, determineFileFlags(fileNames),
+              static_cast<BSAULong>(folders.size()), folderNamesLength,
+              fileNamesLength);
+
+  for (std::vector<std::pair<Folder::Ptr, std::string>>::const_iterator folderIter =
+           folders.begin();
+       folderIter != folders.end(); ++folderIter) {
+    folderIter->first->writeHeader(outfile, m_Type);
+  }
+
+  for (std::vector<std::pair<Folder::Ptr, std::string>>::const_iterator folderIter =
+           folders.begin();
+       folderIter != folders.end(); ++folderIter) {
+    folderIter->first->writeData(outfile, folderIter->second, writeFolderNames);
+  }
+
+  if (writeFileNames) {
+    for (std::vector<std::string>::const_iterator fileIter = fileNames.begin();
+         fileIter != fileNames.end(); ++fileIter) {
+      writeZString(outfile, *fileIter);
+    }
+  }
+  return ERROR_NONE;
+}
+
+EErrorCode Archive::writeBA2(std::fstream& outfile, const WriteOptions& options)
+{
+  std::vector<File::Ptr> files;
+  m_RootFolder->collectFiles(files);
+
+  // an archive holding nothing but textures is written as a texture archive
+  bool textures = !files.empty();
+  for (const File::Ptr& file : files) {
+    if (file->getSourceFile().empty() ? (file->getChunkCount() == 0)
+                                      : !endsWith(file->getName(), ".dds")) {
+      textures = false;
+    }
+  }
+
+  PackState state;
+  state.files.resize(files.size());
+  BSAHash recordsSize = 0;
+  for (size_t i = 0; (i < files.size()) && textures; ++i) {
+    PackedFile& packed = state.files[i];
+    packed.file        = files[i];
+    EErrorCode result  = planTexture(packed);
+    if (result == ERROR_NONE) {
+      recordsSize += sizeof(BA2TextureRecord) +
+                     packed.chunkRecords.size() * sizeof(FO4TextureChunk);
+      continue;
+    }
+    if (options.fileError) {
+      options.fileError(files[i], result);
+    }
+    if ((result != ERROR_INVALIDDATA) || files[i]->getSourceFile().empty()) {
+      return result;
+    }
+    // a pixel format or layout without a texture record, e.g. legacy luminance
+    // formats or texture arrays. A general archive stores the dds as it is
+    textures = false;
+  }
+  if (!textures) {
+    recordsSize = 0;
+    for (size_t i = 0; i < files.size(); ++i) {
+      state.files[i]      = PackedFile();
+      state.files[i].file = files[i];
+      if (files[i]->getSourceFile().empty() && (files[i]->getChunkCount() != 0)) {
+        // the chunks of a texture can't be stored in a general archive
+        if (options.fileError) {
+          options.fileError(files[i], ERROR_INVALIDDATA);
+        }
+        return ERROR_INVALIDDATA;
+      }
+      recordsSize += sizeof(BA2FileRecord);
+    }
+  }
+
+  BSAHash headerSize;
+  switch (m_Type) {
+  case TYPE_STARFIELD:
+    headerSize = 32;
+    break;
+  case TYPE_STARFIELD_LZ4_TEXTURE:
+    headerSize = 36;
+    break;
+  default:
+    headerSize = 24;
+  }
+
+  // the records have a size known up front, the data follows them
+  BSAHash dataOffset = headerSize + recordsSize;
+  outfile.seekp(static_cast<std::streamoff>(dataOffset), fstream::beg);
+  RunCopier copier(m_Source, outfile);
+  EErrorCode result = packFiles(state, options, [&](PackedFile& packed) {
+    if (packed.sharedWith != PackedFile::NOT_SHARED) {
+      // the records of the earlier file point to where its data was written
+      const PackedFile& original = state.files[packed.sharedWith];
+      packed.chunkRecords        = original.chunkRecords;
+      packed.compressed          = original.compressed;
+      packed.unpackedSize        = original.unpackedSize;
+      packed.data.second         = original.data.second;
+      packed.offset              = original.offset;
+      return ERROR_NONE;
+    }
+    if (packed.copied) {
+      for (FO4TextureChunk& chunk : packed.chunkRecords) {
+        BSAULong size = chunk.packedSize > 0 ? chunk.packedSize : chunk.unpackedSize;
+        if (!copier.add(chunk.offset, size)) {
+          return ERROR_INVALIDDATA;
+        }
+        chunk.offset = dataOffset;
+        dataOffset += size;
+      }
+      if (!textures) {
+        if (!copier.add(packed.file->getDataOffset(), packed.data.second)) {
+          return ERROR_INVALIDDATA;
+        }
+        packed.offset = dataOffset;
+        dataOffset += packed.data.second;
+      }
+      return ERROR_NONE;
+    }
+
+    if (!copier.flush()) {
+      return ERROR_INVALIDDATA;
+    }
+    for (size_t i = 0; i < packed.chunks.size(); ++i) {
+      packed.chunkRecords[i].offset = dataOffset;
+      outfile.write(reinterpret_cast<const char*>(packed.chunks[i].first.get()),
+                    packed.chunks[i].second);
+      dataOffset += packed.chunks[i].second;
+    }
+    if (!textures) {
+      packed.offset = dataOffset;
+      outfile.write(reinterpret_cast<const char*>(packed.data.first.get()),
+                    packed.data.second);
+      dataOffset += packed.data.second;
+    }
+    return ERROR_NONE;
+  });
+  if ((result == ERROR_NONE) && !copier.flush()) {
+    result = ERROR_INVALIDDATA;
+  }
+  if (result != ERROR_NONE) {
+    return result;
+  }
+
+  // the names of all files follow the data
+  BSAHash nameTableOffset = dataOffset;
+  for (const File::Ptr& file : files) {
+    std::string path = ba2Path(file);
+    writeType<BSAUShort>(outfile, static_cast<BSAUShort>(path.length()));
+    outfile.write(path.c_str(), path.length());
+  }
+
+  outfile.seekp(0, fstream::beg);
+  outfile.write("BTDX", 4);
+  writeType<BSAUInt>(outfile, static_cast<BSAUInt>(typeToID(m_Type)));
+  outfile.write(textures ? "DX10" : "GNRL", 4);
+  writeType<BSAUInt>(outfile, static_cast<BSAUInt>(files.size()));
+  writeType<BSAHash>(outfile, nameTableOffset);
+  if (headerSize > 24) {
+    writeType<BSAUInt>(outfile, 1U);
+    writeType<BSAUInt>(outfile, 0U);
+  }
+  if (headerSize > 32) {
+    // compression method of the textures
+    writeType<BSAUInt>(outfile, textures ? 3U : 0U);
+  }
+
+  for (const PackedFile& packed : state.files) {
+    std::string path = ba2Path(packed.file);
+    if (textures) {
+      const FO4TextureHeader& header = packed.textureHeader;
+      BA2TextureRecord record;
+      setBA2Hashes(path, record);
+      record.unknown1        = header.unknown1;
+      record.chunkNumber     = static_cast<BSAUChar>(packed.chunkRecords.size());
+      record.chunkHeaderSize = sizeof(FO4TextureChunk);
+      record.height          = header.height;
+      record.width           = header.width;
+      record.mipCount        = header.mipCount;
+      record.format          = static_cast<BSAUChar>(header.format);
+      record.isCubemap       = header.isCubemap ? 1 : 0;
+      record.unknown2        = header.unknown2;
+      writeType<BA2TextureRecord>(outfile, record);
+      for (const FO4TextureChunk& chunk : packed.chunkRecords) {
+        writeType<FO4TextureChunk>(outfile, chunk);
+      }
+    } else {
+      BA2FileRecord record;
+      setBA2Hashes(path, record);
+      record.flags        = 0x00100100;
+      record.offset       = packed.offset;
+      record.packedSize   = packed.compressed ? packed.data.second : 0;
+      record.unpackedSize = packed.unpackedSize;
+      record.align        = 0xBAADF00D;
+      writeType<BA2FileRecord>(outfile, record);
+    }
+  }
+  return ERROR_NONE;
+}
+
+DirectX::DDS_HEADER Archive::getDDSHeader(File::Ptr file,
+                                          DirectX::DDS_HEADER_DXT10& DX10Header,
+                                          bool& isDX10) const
+{
+  DirectX::DDS_HEADER DDSHeaderData = {};
+  DDSHeaderData.size                = sizeof(DDSHeaderData);
+  DDSHeaderData.flags =
+      DDS_HEADER_FLAGS_TEXTURE | DDS_HEADER_FLAGS_LINEARSIZE | DDS_HEADER_FLAGS_MIPMAP;
+  DDSHeaderData.height      = file->getTextureHeader().height;
+  DDSHeaderData.width       = file->getTextureHeader().width;
+  DDSHeaderData.mipMapCount = file->getTextureHeader().mipCount;
+  DDSHeaderData.ddspf.size  = sizeof(DirectX::DDS_PIXELFORMAT);
+  DDSHeaderData.caps        = DDS_SURFACE_FLAGS_TEXTURE | DDS_SURFACE_FLAGS_MIPMAP;
+
+  if (file->getTextureHeader().isCubemap)
+    DDSHeaderData.caps2 = DDS_CUBEMAP_ALLFACES;
+
+  const DDSFormat* format = findDDSFormat(file->getTextureHeader().format);
+  if (format == nullptr) {
+    return {};
+  }
+  DDSHeaderData.pitchOrLinearSize = static_cast<uint32_t>(
+      uint64_t(file->getTextureHeader().width) * file->getTextureHeader().height *
+      format->linearBits / 8);
+  if (format->pixelFormat != nullptr) {
+    DDSHeaderData.ddspf = *format->pixelFormat;
+  } else {
+    DDSHeaderData.ddspf   = DirectX::DDSPF_DX10;
+    isDX10                = true;
+    DX10Header.dxgiFormat = format->format;
+  }
+
+  return DDSHeaderData;
+}
+
+void Archive::getDX10Header(DirectX::DDS_HEADER_DXT10& DX10Header, File::Ptr file) const
+{
+  DX10Header.resourceDimension = DirectX::DDS_DIMENSION_TEXTURE2D;
+  DX10Header.miscFlag          = 0;
+  if (file->getTextureHeader().isCubemap) {
+    DX10Header.miscFlag = DirectX::DDS_RESOURCE_MISC_TEXTURECUBE;
+  }
+  DX10Header.arraySize  = 1;
+  DX10Header.miscFlags2 = 0;
+}
+
+const unsigned char* Archive::fetch(BSAHash offset, BSAHash length,
+                                    std::unique_ptr<unsigned char[]>& buffer) const
+{
+  if ((offset > m_Source.size()) || (length > m_Source.size() - offset)) {
+    // sizes taken from a damaged archive would otherwise be allocated first
+    throw data_invalid_exception("data offset out of range");
+  }
+  if (m_Source.isMapped()) {
+    const unsigned char* data = m_Source.data(offset, length);
+    if (data == nullptr) {
+      throw data_invalid_exception("data offset out of range");
+    }
+    return data;
+  }
+
+  buffer.reset(new unsigned char[length]);
+  if (!m_Source.read(offset, buffer.get(), length)) {
+    throw data_invalid_exception("can't read from bsa");
+  }
+  return buffer.get();
+}
+
+static void noDelete(unsigned char*) {}
+
+boost::shared_array<unsigned char>
+Archive::fetchShared(BSAHash offset, BSAULong length, const ReadBatch* batch) const
+{
+  if ((batch != nullptr) && (offset >= batch->offset) &&
+      (length <= batch->size) && (offset - batch->offset <= batch->size - length)) {
+    // the range was already read together with its neighbours
+    return boost::shared_array<unsigned char>(
+        batch->data, batch->data.get() + (offset - batch->offset));
+  }
+  if ((offset > m_Source.size()) || (length > m_Source.size() - offset)) {
+    throw data_invalid_exception("data offset out of range");
+  }
+  if (m_Source.isMapped()) {
+    const unsigned char* data = m_Source.data(offset, length);
+    if (data == nullptr) {
+      throw data_invalid_exception("data offset out of range");
+    }
+    // the mapping outlives the extraction so the buffer doesn't need to own anything
+    return boost::shared_array<unsigned char>(const_cast<unsigned char*>(data),
+                                              noDelete);
+  }
+
+  boost::shared_array<unsigned char> buffer = BufferPool::instance().allocate(length);
+  if (!m_Source.read(offset, buffer.get(), length)) {
+    throw data_invalid_exception("can't read from bsa");
+  }
+  return buffer;
+}
+
+bool Archive::skipNamePrefix(const unsigned char*& data, BSAULong& size) const
+{
+  if (namePrefixed()) {
+    BSAULong prefixLength = static_cast<BSAULong>(data[0]) + 1;
+    if (size <= prefixLength) {
+      return false;
+    }
+    data += prefixLength;
+    size -= prefixLength;
+  }
+  return true;
+}
+
+BSAULong Archive::buildDDSHeader(File::Ptr file, unsigned char* buffer) const
+{
+  bool isDX10                              = false;
+  DirectX::DDS_HEADER_DXT10 DX10HeaderData = {};
+  DirectX::DDS_HEADER DDSHeaderData = getDDSHeader(file, DX10HeaderData, isDX10);
+
+  BSAULong length = 0;
+  memcpy(buffer, "DDS ", 4);
+  length += 4;
+  memcpy(buffer + length, &DDSHeaderData, sizeof(DDSHeaderData));
+  length += sizeof(DDSHeaderData);
+  if (isDX10) {
+    getDX10Header(DX10HeaderData, file);
+    memcpy(buffer + length, &DX10HeaderData, sizeof(DX10HeaderData));
+    length += sizeof(DX10HeaderData);
+  }
+  return length;
+}
+
+void Archive::loadTextureInfo(File& file) const
+{
+  if (file.getTextureRecordOffset(std::memory_order_acquire) == 0ULL) {
+    return;
+  }
+
+  boost::lock_guard<boost::mutex> lock(m_LazyMutex);
+  BSAHash offset = file.getTextureRecordOffset(std::memory_order_relaxed);
+  if (offset == 0ULL) {
+    // another thread got here first
+    return;
+  }
+  BA2TextureRecord record;
+  if (!m_Source.read(offset, &record, sizeof(record))) {
+    throw data_invalid_exception("can't read from bsa");
+  }
+  if ((record.chunkNumber != file.getChunkCount()) ||
+      !m_Source.read(offset + sizeof(record), &m_TextureChunks[file.getFirstChunk()],
+                     file.getChunkCount() * sizeof(FO4TextureChunk))) {
+    throw data_invalid_exception("can't read from bsa");
+  }
+  file.setTextureHeader(textureHeader(record));
+  file.setTextureRecordOffset(0ULL, std::memory_order_release);
+}
+
+EErrorCode Archive::getExtractedSize(File::Ptr file, BSAULong& size) const
+{
+  try {
+    loadTextureInfo(*file);
+    if (isBA2()) {
+      if (file->getChunkCount() != 0) {
+        if (!textureExtractedSize(file->getTextureHeader(), textureChunks(*file),
+                                  size)) {
+          return ERROR_INVALIDDATA;
+        }
+      } else {
+        size = file->getUncompressedFileSize();
+      }
+      return ERROR_NONE;
+    }
+
+    // the name prefix and the size of compressed files are stored in front of the data
+    BSAULong blobSize = file->getFileSize();
+    if (blobSize == 0) {
+      size = 0;
+      return ERROR_NONE;
+    }
+    std::unique_ptr<unsigned char[]> buffer;
+    const unsigned char* data =
+        fetch(file->getDataOffset(), (std::min)(blobSize, BSAULong(256 + 4)), buffer);
+    if (!skipNamePrefix(data, blobSize)) {
+      return ERROR_INVALIDDATA;
+    }
+    if (compressed(file)) {
+      if (blobSize < sizeof(BSAULong)) {
+        return ERROR_INVALIDDATA;
+      }
+      memcpy(&size, data, sizeof(BSAULong));
+    } else {
+      size = blobSize;
+    }
+    return ERROR_NONE;
+  } catch (const std::exception&) {
+    return ERROR_INVALIDDATA;
+  }
+}
+
+EErrorCode Archive::fetchFile(FileInfo& fileInfo, const ReadBatch* batch) const
+{
+  const File::Ptr& file = fileInfo.file;
+  fileInfo.compressed   = compressed(file);
+  fileInfo.data         = DataBuffer();
+  fileInfo.chunks.clear();
+
+  try {
+    loadTextureInfo(*file);
+    if (isBA2()) {
+      if (file->getChunkCount() != 0) {
+        // the header itself is built straight into the output buffer later
+        std::span<const FO4TextureChunk> chunks = textureChunks(*file);
+        if (!textureExtractedSize(file->getTextureHeader(), chunks,
+                                  fileInfo.extractedSize)) {
+          return ERROR_INVALIDDATA;
+        }
+        for (const FO4TextureChunk& chunk : chunks) {
+          if ((chunk.packedSize > 0) &&
+              !plausibleUnpackedSize(chunk.packedSize, chunk.unpackedSize)) {
+            return ERROR_INVALIDDATA;
           }
-          delete[] chunk;
-        } else {
-          char* chunk = new char[length];
-          m_File.read(chunk, length);
-          outFile.write(chunk, length);
-          delete[] chunk;
+          BSAULong size = chunk.packedSize > 0 ? chunk.packedSize : chunk.unpackedSize;
+          fileInfo.chunks.push_back(
+              std::make_pair(fetchShared(chunk.offset, size, batch), size));
+        }
+      } else {
+        // uncompressed files in a ba2 only store the unpacked size
+        BSAULong size =
+            fileInfo.compressed ? file->getFileSize() : file->getUncompressedFileSize();
+        if (fileInfo.compressed &&
+            !plausibleUnpackedSize(size, file->getUncompressedFileSize())) {
+          return ERROR_INVALIDDATA;
         }
+        fileInfo.data =
+            std::make_pair(fetchShared(file->getDataOffset(), size, batch), size);
+        fileInfo.extractedSize = file->getUncompressedFileSize();
       }
+      return ERROR_NONE;
+    }
+
+    BSAULong size = file->getFileSize();
+    if (size == 0) {
+      // don't try to read empty file
+      fileInfo.compressed    = false;
+      fileInfo.extractedSize = 0;
+      fileInfo.data          = std::make_pair(BufferPool::instance().allocate(1), 0UL);
+      return ERROR_NONE;
+    }
+    boost::shared_array<unsigned char> blob =
+        fetchShared(file->getDataOffset(), size, batch);
+    const unsigned char* data = blob.get();
+    if (!skipNamePrefix(data, size)) {
+      return ERROR_INVALIDDATA;
     }
+    if (fileInfo.compressed) {
+      // the size of compressed files is stored in front of the data
+      if (size < sizeof(BSAULong)) {
+        return ERROR_INVALIDDATA;
+      }
+      memcpy(&fileInfo.extractedSize, data, sizeof(BSAULong));
+      data += sizeof(BSAULong);
+      size -= sizeof(BSAULong);
+      if (!plausibleUnpackedSize(size, fileInfo.extractedSize)) {
+        // the whole file is decompressed into a buffer of the stored size
+        return ERROR_INVALIDDATA;
+      }
+    } else {
+      fileInfo.extractedSize = size;
+    }
+    fileInfo.data = std::make_pair(
+        boost::shared_array<unsigned char>(blob, const_cast<unsigned char*>(data)),
+        size);
+    return ERROR_NONE;
+  } catch (const std::exception&) {
+    return ERROR_INVALIDDATA;
+  }
+}
+
+EErrorCode Archive::decompressInto(const FileInfo& fileInfo,
+                                  unsigned char* target) const
+{
+  const File::Ptr& file = fileInfo.file;
+  EErrorCode result     = ERROR_NONE;
+
+  if (fileInfo.chunks.size()) {
+    target += buildDDSHeader(file, target);
+    for (size_t i = 0; i < fileInfo.chunks.size() && result == ERROR_NONE; ++i) {
+      result = decompressChunk(fileInfo, i, target);
+      target += textureChunks(*file)[i].unpackedSize;
+    }
+  } else if (fileInfo.extractedSize == 0) {
+    // nothing to extract, target may not even point to a buffer
+  } else if (!fileInfo.compressed) {
+    memcpy(target, fileInfo.data.first.get(), fileInfo.extractedSize);
   } else if (m_Type == TYPE_SKYRIMSE) {
-    BSAULong inSize = file->m_FileSize;
-    if (namePrefixed()) {
-      std::string fullName = readBString(m_File);
-      if (inSize <= fullName.length()) {
-#pragma message("report error!")
-        return result;
-      }
-      inSize -= fullName.length() + 1;
-    }
-    BSAULong outSize = readType<BSAULong>(m_File);
-    inSize -= sizeof(BSAULong);
-    std::unique_ptr<unsigned char[]> inBuffer(new unsigned char[inSize]);
-    m_File.read(reinterpret_cast<char*>(inBuffer.get()), inSize);
-
-    LZ4F_decompressionContext_t dcContext = nullptr;
-    LZ4F_decompressOptions_t options      = {};
-    LZ4F_createDecompressionContext(&dcContext, LZ4F_VERSION);
-    size_t lzOutSize = outSize;
-    size_t lzInSize  = inSize;
-
-    std::unique_ptr<unsigned char[]> outBuffer(new unsigned char[outSize]);
-    LZ4F_decompress(dcContext, outBuffer.get(), &lzOutSize, inBuffer.get(), &lzInSize,
-                    &options);
-
-    outFile.write(reinterpret_cast<char*>(outBuffer.get()), outSize);
+    // Skyrim SE uses LZ4 Frame compression
+    result = lz4FrameInto(fileInfo.data.first.get(), fileInfo.data.second, target,
+                          fileInfo.extractedSize);
   } else {
-    BSAULong inSize = file->m_FileSize;
-    if (namePrefixed()) {
-      std::string fullName = readBString(m_File);
-      if (inSize <= fullName.length()) {
-#pragma message("report error!")
-        return result;
-      }
-      inSize -= fullName.length() + 1;
-    }
-    std::unique_ptr<unsigned char[]> inBuffer(new unsigned char[inSize]);
-    m_File.read(reinterpret_cast<char*>(inBuffer.get()), inSize);
-    BSAULong length = 0UL;
+    // Oblivion - Skyrim LE and BA2 use gzip compression
+    result = inflateInto(fileInfo.data.first.get(), fileInfo.data.second, target,
+                         fileInfo.extractedSize);
+  }
+  return result;
+}
+
+EErrorCode Archive::decompressChunk(const FileInfo& fileInfo, size_t index,
+                                   unsigned char* target) const
+{
+  const FO4TextureChunk& chunk = textureChunks(*fileInfo.file)[index];
+  const DataBuffer& stored     = fileInfo.chunks[index];
+  if (chunk.packedSize == 0) {
+    memcpy(target, stored.first.get(), chunk.unpackedSize);
+    return ERROR_NONE;
+  } else if (m_Type == TYPE_STARFIELD_LZ4_TEXTURE) {
+    return lz4BlockInto(stored.first.get(), stored.second, target, chunk.unpackedSize);
+  } else {
+    return inflateInto(stored.first.get(), stored.second, target, chunk.unpackedSize);
+  }
+}
+
+void Archive::decompressFile(FileInfo& fileInfo) const
+{
+  if (!fileInfo.compressed && !fileInfo.chunks.size()) {
+    // the stored data can be written as is
+    return;
+  }
+
+  try {
     boost::shared_array<unsigned char> buffer =
-        decompress(inBuffer.get(), inSize, result, length);
-    if (result == ERROR_NONE) {
-      outFile.write(reinterpret_cast<char*>(buffer.get()), length);
+        BufferPool::instance().allocate(fileInfo.extractedSize);
+    fileInfo.result = decompressInto(fileInfo, buffer.get());
+    fileInfo.data   = std::make_pair(buffer, fileInfo.extractedSize);
+  } catch (const std::bad_alloc&) {
+    fileInfo.result = ERROR_INVALIDDATA;
+    fileInfo.data   = DataBuffer();
+  }
+  fileInfo.compressed = false;
+  fileInfo.chunks.clear();
+}
+
+EErrorCode Archive::streamFile(FileInfo& fileInfo, std::ostream& target) const
+{
+  const File::Ptr& file = fileInfo.file;
+  fileInfo.compressed   = compressed(file);
+  BSAHash offset        = file->getDataOffset();
+  BSAULong size         = 0;
+
+  if (isBA2()) {
+    // uncompressed files in a ba2 only store the unpacked size
+    size = fileInfo.compressed ? file->getFileSize() : file->getUncompressedFileSize();
+    fileInfo.extractedSize = file->getUncompressedFileSize();
+  } else if (file->getFileSize() == 0) {
+    fileInfo.compressed    = false;
+    fileInfo.extractedSize = 0;
+  } else {
+    // only read what is stored in front of the data: the name and, for compressed
+    // files, the extracted size
+    unsigned char prefix[256 + sizeof(BSAULong)];
+    size = file->getFileSize();
+    if (!m_Source.read(offset, prefix, (std::min)(size, BSAULong(sizeof(prefix))))) {
+      return ERROR_INVALIDDATA;
+    }
+    const unsigned char* data = prefix;
+    if (!skipNamePrefix(data, size)) {
+      return ERROR_INVALIDDATA;
+    }
+    if (fileInfo.compressed) {
+      if (size < sizeof(BSAULong)) {
+        return ERROR_INVALIDDATA;
+      }
+      memcpy(&fileInfo.extractedSize, data, sizeof(BSAULong));
+      data += sizeof(BSAULong);
+      size -= sizeof(BSAULong);
+    } else {
+      fileInfo.extractedSize = size;
+    }
+    offset += data - prefix;
+  }
+
+  fileInfo.storedSize = size;
+  if (!fileInfo.compressed) {
+    return m_Source.copyTo(offset, size, target) ? ERROR_NONE : ERROR_INVALIDDATA;
+  } else if (m_Type == TYPE_SKYRIMSE) {
+    return lz4FrameStream(m_Source, offset, size, target, fileInfo.extractedSize);
+  } else {
+    return inflateStream(m_Source, offset, size, target, fileInfo.extractedSize);
+  }
+}
+
+/**
+ * @return size of the data of a file as it's stored, part of its key in the cache
+ */
+static BSAHash cacheSize(const File& file)
+{
+  // uncompressed files in a ba2 only store the unpacked size
+  return (std::max)(file.getFileSize(), file.getUncompressedFileSize());
+}
+
+EErrorCode Archive::extractToMemory(File::Ptr file, std::span<std::byte> out) const
+{
+  if (m_Cache) {
+    FileCache::Data cached =
+        m_Cache->find(m_CacheKey, file->getDataOffset(), cacheSize(*file));
+    if (cached) {
+      if (out.size() < cached->size()) {
+        return ERROR_BUFFERTOOSMALL;
+      }
+      memcpy(out.data(), cached->data(), cached->size());
+      return ERROR_NONE;
+    }
+  }
+
+  FileInfo fileInfo;
+  fileInfo.file     = file;
+  EErrorCode result = fetchFile(fileInfo);
+  if (result != ERROR_NONE) {
+    return result;
+  }
+  if (out.size() < fileInfo.extractedSize) {
+    return ERROR_BUFFERTOOSMALL;
+  }
+  return decompressInto(fileInfo, reinterpret_cast<unsigned char*>(out.data()));
+}
+
+EErrorCode Archive::readFile(File::Ptr file, std::vector<std::byte>& data) const
+{
+  if (m_Cache) {
+    FileCache::Data cached =
+        m_Cache->find(m_CacheKey, file->getDataOffset(), cacheSize(*file));
+    if (cached) {
+      data = *cached;
+      return ERROR_NONE;
+    }
+  }
+
+  FileInfo fileInfo;
+  fileInfo.file     = file;
+  EErrorCode result = fetchFile(fileInfo);
+  if (result != ERROR_NONE) {
+    return result;
+  }
+  data.resize(fileInfo.extractedSize);
+  return decompressInto(fileInfo, reinterpret_cast<unsigned char*>(data.data()));
+}
+
+EErrorCode Archive::readShared(File::Ptr file, FileCache::Data& data) const
+{
+  if (m_Cache) {
+    data = m_Cache->find(m_CacheKey, file->getDataOffset(), cacheSize(*file));
+    if (data) {
+      return ERROR_NONE;
     }
   }
 
-  return result;
+  FileInfo fileInfo;
+  fileInfo.file     = file;
+  EErrorCode result = fetchFile(fileInfo);
+  if (result != ERROR_NONE) {
+    return result;
+  }
+  try {
+    std::shared_ptr<std::vector<std::byte>> content =
+        std::make_shared<std::vector<std::byte>>(fileInfo.extractedSize);
+    result = decompressInto(fileInfo, reinterpret_cast<unsigned char*>(content->data()));
+    if (result != ERROR_NONE) {
+      return result;
+    }
+    data = content;
+  } catch (const std::bad_alloc&) {
+    return ERROR_INVALIDDATA;
+  }
+  if (m_Cache) {
+    m_Cache->insert(m_CacheKey, file->getDataOffset(), cacheSize(*file), data);
+  }
+  return ERROR_NONE;
+}
+
+void Archive::setCache(const FileCache::Ptr& cache)
+{
+  releaseCache();
+  m_Cache = cache;
+}
+
+void Archive::releaseCache()
+{
+  if (m_Cache) {
+    m_Cache->remove(m_CacheKey);
+  }
+  m_CacheKey = FileCache::newArchiveKey();
 }
 
 EErrorCode Archive::extract(File::Ptr file, const char* outputDirectory) const
@@ -884,114 +2352,283 @@ EErrorCode Archive::extract(File::Ptr file, const char* outputDirectory) const
     return ERROR_ACCESSFAILED;
   }
 
-  EErrorCode result = ERROR_NONE;
-  if (compressed(file)) {
-    result = extractCompressed(file, outputFile);
+  EErrorCode result;
+  if (file->getChunkCount() == 0) {
+    // everything but ba2 textures is decompressed straight into the file
+    FileInfo fileInfo;
+    fileInfo.file = file;
+    result        = streamFile(fileInfo, outputFile);
   } else {
-    result = extractDirect(file, outputFile);
+    std::vector<std::byte> data;
+    result = readFile(file, data);
+    if (result == ERROR_NONE) {
+      outputFile.write(reinterpret_cast<const char*>(data.data()), data.size());
+    }
   }
   outputFile.close();
   return result;
 }
 
-void Archive::readFiles(std::queue<FileInfo>& queue, boost::mutex& mutex,
-                        boost::interprocess::interprocess_semaphore& bufferCount,
-                        boost::interprocess::interprocess_semaphore& queueFree,
-                        std::vector<File::Ptr>::iterator begin,
-                        std::vector<File::Ptr>::iterator end)
+static uint64_t microsecondsSince(std::chrono::steady_clock::time_point start)
 {
-  for (; begin != end && !boost::this_thread::interruption_requested(); ++begin) {
-    queueFree.wait();
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
 
-    FileInfo fileInfo;
-    fileInfo.file = *begin;
-    size_t size   = static_cast<size_t>(fileInfo.file->m_FileSize);
+bool Archive::streamable(const File& file, uint64_t streamThreshold) const
+{
+  return (file.getChunkCount() == 0) &&
+         ((std::max)(file.getFileSize(), file.getUncompressedFileSize()) >
+          streamThreshold);
+}
 
-    m_File.seekg(fileInfo.file->m_DataOffset);
-    if (m_Type != TYPE_FALLOUT4 && m_Type != TYPE_STARFIELD &&
-        m_Type != TYPE_STARFIELD_LZ4_TEXTURE && m_Type != TYPE_FALLOUT4NG_7 &&
-        m_Type != TYPE_FALLOUT4NG_8) {
-      if (namePrefixed()) {
-        std::string fullName = readBString(m_File);
-        if (size <= fullName.length()) {
-#pragma message("report error!")
-          continue;
+void Archive::planReads(std::vector<File::Ptr>& files, uint64_t streamThreshold,
+                        std::vector<ReadBatch>& batches) const
+{
+  // a mapped archive is read through page faults, merging ranges wouldn't gain anything
+  bool merge = !m_Source.isMapped();
+  BSAHash batchEnd = 0;
+  for (std::vector<File::Ptr>::iterator iter = files.begin(); iter != files.end();
+       ++iter) {
+    File& file     = **iter;
+    BSAHash begin  = file.getDataOffset();
+    BSAHash end    = begin;
+    bool mergeable = merge && !streamable(file, streamThreshold);
+    if (mergeable) {
+      try {
+        loadTextureInfo(file);
+        if (file.getChunkCount() != 0) {
+          for (const FO4TextureChunk& chunk : textureChunks(file)) {
+            BSAULong size =
+                chunk.packedSize > 0 ? chunk.packedSize : chunk.unpackedSize;
+            end = (std::max)(end, chunk.offset + size);
+          }
+        } else if (isBA2() && !compressed(*iter)) {
+          // uncompressed files in a ba2 only store the unpacked size
+          end += file.getUncompressedFileSize();
+        } else {
+          end += file.getFileSize();
         }
-        size -= fullName.length() + 1;
-      }
-      if (m_Type == TYPE_SKYRIMSE && compressed(fileInfo.file)) {
-        fileInfo.file->m_UncompressedFileSize = readType<BSAULong>(m_File);
-        size -= 4;
-      }
-      if (!fileInfo.file->m_TextureChunks.size()) {
-        fileInfo.data =
-            std::make_pair(boost::shared_array<unsigned char>(new unsigned char[size]),
-                           static_cast<BSAULong>(size));
-        m_File.read(reinterpret_cast<char*>(fileInfo.data.first.get()), size);
+      } catch (const std::exception&) {
+        // fetchFile runs into the same problem and reports it for this file
+        mergeable = false;
       }
+    }
+
+    if (mergeable && !batches.empty() && (batches.back().size > 0) &&
+        (begin >= batchEnd) && (begin - batchEnd <= READ_GAP_SIZE) &&
+        (end - batches.back().offset <= READ_BATCH_SIZE)) {
+      ReadBatch& batch = batches.back();
+      batch.end        = iter + 1;
+      batch.size       = end - batch.offset;
+      batchEnd         = end;
     } else {
-      if (!fileInfo.file->m_TextureChunks.size()) {
-        if (size == 0)
-          size = fileInfo.file->m_UncompressedFileSize;
-        fileInfo.data =
-            std::make_pair(boost::shared_array<unsigned char>(new unsigned char[size]),
-                           static_cast<BSAULong>(size));
-        m_File.read(reinterpret_cast<char*>(fileInfo.data.first.get()), size);
-      } else {
-        fileInfo.file->m_UncompressedFileSize = 0L;
-        BSAULong totalSize                    = 0U;
-        for (BSAUInt i = 0; i < fileInfo.file->m_TextureChunks.size(); ++i) {
-          totalSize += fileInfo.file->m_TextureChunks[i].unpackedSize;
-        }
-        char* chunkData     = new char[totalSize];
-        BSAULong currentPos = 0U;
-        for (BSAUInt i = 0; i < fileInfo.file->m_TextureChunks.size(); ++i) {
-          BSAULong length = fileInfo.file->m_TextureChunks[i].unpackedSize;
-          if (fileInfo.file->m_TextureChunks[i].packedSize > 0) {
-            char* chunk = new char[fileInfo.file->m_TextureChunks[i].packedSize];
-            m_File.read(chunk, fileInfo.file->m_TextureChunks[i].packedSize);
-            if (m_Type == TYPE_FALLOUT4 || m_Type == TYPE_STARFIELD || m_Type == TYPE_FALLOUT4NG_7 || m_Type == TYPE_FALLOUT4NG_8) {
-              EErrorCode result = ERROR_NONE;
-              try {
-                boost::shared_array<unsigned char> unpackedChunk = decompress(
-                    reinterpret_cast<unsigned char*>(chunk),
-                    fileInfo.file->m_TextureChunks[i].packedSize, result, length);
-                memcpy(chunkData + currentPos,
-                       reinterpret_cast<char*>(unpackedChunk.get()), length);
-                unpackedChunk.reset();
-              } catch (const std::exception&) {
-#pragma message("report error!")
-                continue;
-              }
-            } else {
-              char* unpackedChunk = new char[length];
-              LZ4_decompress_safe(chunk, unpackedChunk,
-                                  fileInfo.file->m_TextureChunks[i].packedSize, length);
-              memcpy(chunkData + currentPos, unpackedChunk, length);
-              delete[] unpackedChunk;
-            }
-            delete[] chunk;
-            fileInfo.file->m_UncompressedFileSize += length;
-          } else {
-            char* chunk = new char[length];
-            m_File.read(chunk, length);
-            memcpy(chunkData + currentPos, chunk, length);
-            delete[] chunk;
-          }
-          currentPos += length;
+      ReadBatch batch;
+      batch.begin = iter;
+      batch.end   = iter + 1;
+      if (mergeable && (end - begin <= READ_BATCH_SIZE)) {
+        batch.offset = begin;
+        batch.size   = end - begin;
+        batchEnd     = end;
+      }
+      batches.push_back(batch);
+    }
+  }
+}
+
+void Archive::readFiles(WorkQueue<DecompressTask>& queue, ReadPlan& plan,
+                        ByteBudget& budget, ExtractStats& stats)
+{
+  bool canceled = false;
+  while (!canceled) {
+    // batches are claimed in offset order, so the readers stay close to each other
+    size_t index = plan.nextBatch++;
+    if (index >= plan.batches.size()) {
+      break;
+    }
+    ReadBatch& batch = plan.batches[index];
+    if (batch.size > 0) {
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      try {
+        batch.data = BufferPool::instance().allocate(static_cast<size_t>(batch.size));
+        if (!m_Source.read(batch.offset, batch.data.get(), batch.size)) {
+          batch.data.reset();
         }
-        fileInfo.file->m_FileSize = 0;
-        fileInfo.data             = std::make_pair(boost::shared_array<unsigned char>(
-                                           reinterpret_cast<unsigned char*>(chunkData)),
-                                                   static_cast<BSAULong>(totalSize));
+      } catch (const std::bad_alloc&) {
+        batch.data.reset();
       }
+      // if the batch can't be read, every file is fetched on its own and reports its
+      // own error
+      stats.readMicroseconds += microsecondsSince(start);
+      ++stats.readRequests;
+    }
+    for (std::vector<File::Ptr>::iterator iter = batch.begin;
+         !canceled && (iter != batch.end); ++iter) {
+      canceled = !queueFile(queue, *iter, batch, plan.streamThreshold, budget, stats);
+    }
+    // the files keep the part of the buffer they need alive
+    batch.data.reset();
+  }
+  // the last reader to finish lets the decompressors know there is nothing more to come
+  if (++plan.readersDone == plan.readers) {
+    queue.close();
+  }
+}
+
+bool Archive::queueFile(WorkQueue<DecompressTask>& queue, const File::Ptr& file,
+                        const ReadBatch& batch, uint64_t streamThreshold,
+                        ByteBudget& budget, ExtractStats& stats)
+{
+  FileInfo::Ptr fileInfo = std::make_shared<FileInfo>();
+  fileInfo->file         = file;
+
+  if (streamable(*file, streamThreshold)) {
+    // too large to buffer, the writer streams it through its input and output windows
+    if (!budget.acquire(2 * STREAM_WINDOW_SIZE)) {
+      return false;
     }
+    fileInfo->reservedBytes = 2 * STREAM_WINDOW_SIZE;
+    fileInfo->streamed      = true;
+    DecompressTask task;
+    task.fileInfo = fileInfo;
+    return queue.push(task);
+  }
 
-    {
-      boost::interprocess::scoped_lock<boost::mutex> lock(mutex);
-      queue.push(fileInfo);
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  const ReadBatch* source = (batch.data.get() != nullptr) ? &batch : nullptr;
+  fileInfo->result        = fetchFile(*fileInfo, source);
+  stats.readMicroseconds += microsecondsSince(start);
+  if ((batch.data.get() == nullptr) && !m_Source.isMapped()) {
+    stats.readRequests += (std::max)(fileInfo->chunks.size(), size_t(1));
+  }
+  if (fileInfo->result == ERROR_NONE) {
+    uint64_t bytes = fileInfo->data.second;
+    for (const DataBuffer& chunk : fileInfo->chunks) {
+      bytes += chunk.second;
+    }
+    stats.bytesRead += bytes;
+    // stored data is written as is, everything else needs a second buffer
+    if (fileInfo->compressed || fileInfo->chunks.size()) {
+      bytes += fileInfo->extractedSize;
+    }
+    if (!budget.acquire(bytes)) {
+      return false;
+    }
+    fileInfo->reservedBytes = bytes;
+  }
+  if ((fileInfo->result == ERROR_NONE) && fileInfo->chunks.size()) {
+    return queueChunks(queue, fileInfo);
+  } else {
+    DecompressTask task;
+    task.fileInfo = fileInfo;
+    return queue.push(task);
+  }
+}
+
+bool Archive::queueChunks(WorkQueue<DecompressTask>& queue,
+                          const FileInfo::Ptr& fileInfo)
+{
+  try {
+    fileInfo->data =
+        std::make_pair(BufferPool::instance().allocate(fileInfo->extractedSize),
+                       fileInfo->extractedSize);
+  } catch (const std::bad_alloc&) {
+    fileInfo->result = ERROR_INVALIDDATA;
+    fileInfo->chunks.clear();
+    DecompressTask task;
+    task.fileInfo = fileInfo;
+    return queue.push(task);
+  }
+
+  // each chunk decompresses to its final position in the extracted file, so the chunks
+  // of one texture can be processed by different threads at the same time
+  // the chunks may be cleared by a decompressor before the loop ends
+  size_t numChunks        = fileInfo->chunks.size();
+  BSAULong offset         = buildDDSHeader(fileInfo->file, fileInfo->data.first.get());
+  fileInfo->pendingChunks = numChunks;
+  for (size_t i = 0; i < numChunks; ++i) {
+    DecompressTask task;
+    task.fileInfo     = fileInfo;
+    task.chunk        = i;
+    task.targetOffset = offset;
+    if (!queue.push(task)) {
+      return false;
+    }
+    offset += textureChunks(*fileInfo->file)[i].unpackedSize;
+  }
+  return true;
+}
+
+ECodec Archive::fileCodec(const FileInfo& fileInfo) const
+{
+  if (!fileInfo.compressed) {
+    return CODEC_STORED;
+  } else if (m_Type == TYPE_SKYRIMSE) {
+    return CODEC_LZ4_FRAME;
+  } else {
+    return CODEC_ZLIB;
+  }
+}
+
+ECodec Archive::chunkCodec(const FileInfo& fileInfo, size_t index) const
+{
+  if (textureChunks(*fileInfo.file)[index].packedSize == 0) {
+    return CODEC_STORED;
+  } else if (m_Type == TYPE_STARFIELD_LZ4_TEXTURE) {
+    return CODEC_LZ4_BLOCK;
+  } else {
+    return CODEC_ZLIB;
+  }
+}
+
+void Archive::decompressFiles(WorkQueue<DecompressTask>& inQueue,
+                              WorkQueue<FileInfo::Ptr>& outQueue,
+                              std::atomic<int>& workersDone, int totalWorkers,
+                              ExtractStats& stats)
+{
+  DecompressTask task;
+  while (inQueue.pop(task)) {
+    FileInfo& fileInfo = *task.fileInfo;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (task.chunk == DecompressTask::WHOLE_FILE) {
+      if ((fileInfo.result == ERROR_NONE) && !fileInfo.streamed) {
+        ECodec codec = fileCodec(fileInfo);
+        decompressFile(fileInfo);
+        ++stats.codecUnits[codec];
+        if (codec != CODEC_STORED) {
+          stats.bytesInflated += fileInfo.extractedSize;
+        }
+      }
+      stats.decompressMicroseconds += microsecondsSince(start);
+    } else {
+      ECodec codec      = chunkCodec(fileInfo, task.chunk);
+      EErrorCode result = decompressChunk(
+          fileInfo, task.chunk, fileInfo.data.first.get() + task.targetOffset);
+      stats.decompressMicroseconds += microsecondsSince(start);
+      ++stats.codecUnits[codec];
+      if (codec != CODEC_STORED) {
+        stats.bytesInflated += textureChunks(*fileInfo.file)[task.chunk].unpackedSize;
+      }
+      if (result != ERROR_NONE) {
+        fileInfo.result = result;
+      }
+      // the stored data of this chunk isn't needed anymore
+      fileInfo.chunks[task.chunk] = DataBuffer();
+      if (--fileInfo.pendingChunks != 0) {
+        // whoever decompresses the last chunk passes the texture on
+        continue;
+      }
+      fileInfo.compressed = false;
+      fileInfo.chunks.clear();
+    }
+    if (!outQueue.push(task.fileInfo)) {
+      break;
     }
-    bufferCount.post();
+  }
+  // the last worker to finish lets the writer know there is nothing more to come
+  if (++workersDone == totalWorkers) {
+    outQueue.close();
   }
 }
 
@@ -1001,151 +2638,222 @@ inline bool fileExists(const std::string& name)
   return stat(name.c_str(), &buffer) != -1;
 }
 
-void Archive::extractFiles(const std::string& targetDirectory,
-                           std::queue<FileInfo>& queue, boost::mutex& mutex,
-                           boost::interprocess::interprocess_semaphore& bufferCount,
-                           boost::interprocess::interprocess_semaphore& queueFree,
-                           int totalFiles, bool overwrite, int& filesDone)
+// key of a path relative to the output directory in ExtractTarget::existingFiles.
+// Windows file names are case insensitive and accept either separator
+static std::string targetKey(const std::string& path)
 {
-  for (int i = 0; i < totalFiles; ++i) {
-    bufferCount.wait();
-    if (boost::this_thread::interruption_requested()) {
-      break;
+  std::string key = path.substr((std::min)(path.find_first_not_of("\\/"), path.size()));
+  for (char& c : key) {
+    c = (c == '/') ? '\\' : static_cast<char>(tolower(static_cast<unsigned char>(c)));
+  }
+  return key;
+}
+
+static void scanTarget(const std::string& directory,
+                       std::unordered_set<std::string>& files)
+{
+  std::error_code error;
+  std::filesystem::path root(directory);
+  for (std::filesystem::recursive_directory_iterator iter(root, error), end;
+       !error && (iter != end); iter.increment(error)) {
+    if (iter->is_regular_file(error)) {
+      files.insert(targetKey(iter->path().lexically_relative(root).string()));
     }
+  }
+}
 
-    FileInfo fileInfo;
+void Archive::writeExtractedFile(const ExtractTarget& target, FileInfo& fileInfo,
+                                 ExtractStats& stats)
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  const std::string& filePath = fileInfo.file->getFilePath();
+  std::string fileName =
+      makeString("%s\\%s", target.directory.c_str(), filePath.c_str());
+  if (!target.overwrite) {
+    bool exists = target.scanned
+                      ? (target.existingFiles.count(targetKey(filePath)) != 0)
+                      : fileExists(fileName);
+    if (exists) {
+      return;
+    }
+  }
 
-    {
-      boost::interprocess::scoped_lock<boost::mutex> lock(mutex);
-      fileInfo = queue.front();
-      ++filesDone;
-      queue.pop();
+  // the size of streamed files is only known exactly for ba2 archives
+  BSAHash expectedSize = fileInfo.data.second;
+  if (fileInfo.streamed) {
+    expectedSize = isBA2() ? fileInfo.file->getUncompressedFileSize() : 0;
+  }
+  OutputFile outputFile;
+  if (!outputFile.open(fileName.c_str(), expectedSize)) {
+    fileInfo.result = ERROR_ACCESSFAILED;
+    return;
+  }
+  std::ostream output(&outputFile);
+
+  if (fileInfo.streamed) {
+    fileInfo.result = streamFile(fileInfo, output);
+    countStreamedFile(fileInfo, stats);
+  } else {
+    output.write(reinterpret_cast<char*>(fileInfo.data.first.get()),
+                 fileInfo.data.second);
+    stats.bytesWritten += fileInfo.data.second;
+  }
+  // closing writes out the rest of the buffer, which may fail if the disk is full
+  if (!outputFile.close() && (fileInfo.result == ERROR_NONE)) {
+    fileInfo.result = ERROR_ACCESSFAILED;
+  }
+  if (fileInfo.result != ERROR_NONE) {
+    // a file that failed while streaming is incomplete, don't leave it behind
+    std::error_code error;
+    std::filesystem::remove(fileName, error);
+  }
+  stats.writeMicroseconds += microsecondsSince(start);
+}
+
+void Archive::countStreamedFile(const FileInfo& fileInfo, ExtractStats& stats) const
+{
+  ++stats.codecUnits[fileCodec(fileInfo)];
+  stats.bytesRead += fileInfo.storedSize;
+  if (fileInfo.result == ERROR_NONE) {
+    if (fileInfo.compressed) {
+      stats.bytesInflated += fileInfo.extractedSize;
+    }
+    stats.bytesWritten += fileInfo.extractedSize;
+  }
+}
+
+// passes everything written to it on to a sink as pieces of one file
+class SinkBuffer : public std::streambuf
+{
+
+public:
+  SinkBuffer(ExtractSink& sink, const File::Ptr& file)
+      : m_Sink(sink), m_File(file), m_Offset(0)
+  {}
+
+  // end the file
+  void finish() { m_Sink.write(m_File, m_Offset, nullptr, 0, true); }
+
+protected:
+  int_type overflow(int_type c) override
+  {
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      char data = traits_type::to_char_type(c);
+      xsputn(&data, 1);
     }
-    queueFree.post();
+    return traits_type::not_eof(c);
+  }
 
-    DataBuffer dataBuffer = fileInfo.data;
+  std::streamsize xsputn(const char* data, std::streamsize size) override
+  {
+    m_Sink.write(m_File, m_Offset, reinterpret_cast<const std::byte*>(data),
+                 static_cast<size_t>(size), false);
+    m_Offset += size;
+    return size;
+  }
 
-    std::string fileName = makeString("%s\\%s", targetDirectory.c_str(),
-                                      fileInfo.file->getFilePath().c_str());
-    if (!overwrite && fileExists(fileName)) {
-      continue;
+private:
+  ExtractSink& m_Sink;
+  const File::Ptr& m_File;
+  BSAHash m_Offset;
+};
+
+void Archive::sinkExtractedFile(const ExtractTarget& target, FileInfo& fileInfo,
+                                ExtractStats& stats)
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  if (fileInfo.streamed) {
+    SinkBuffer buffer(*target.sink, fileInfo.file);
+    std::ostream output(&buffer);
+    fileInfo.result = streamFile(fileInfo, output);
+    countStreamedFile(fileInfo, stats);
+    if (fileInfo.result == ERROR_NONE) {
+      buffer.finish();
     }
+  } else {
+    target.sink->write(fileInfo.file, 0,
+                       reinterpret_cast<const std::byte*>(fileInfo.data.first.get()),
+                       fileInfo.data.second, true);
+    stats.bytesWritten += fileInfo.data.second;
+  }
+  stats.writeMicroseconds += microsecondsSince(start);
+}
 
-    std::ofstream outputFile(fileName.c_str(),
-                             fstream::out | fstream::binary | fstream::trunc);
+void Archive::writeFiles(const ExtractTarget& target, WorkQueue<FileInfo::Ptr>& queue,
+                         ByteBudget& budget, ExtractProgress& progress,
+                         ExtractStats& stats)
+{
+  FileInfo::Ptr fileInfo;
+  while (queue.pop(fileInfo)) {
+    {
+      boost::lock_guard<boost::mutex> lock(progress.mutex);
+      ++progress.filesDone;
+      progress.lastFile = fileInfo->file;
+    }
 
-    if (!outputFile.is_open()) {
-#pragma message("report error!")
-      continue;
-      // return ERROR_ACCESSFAILED;
-    }
-
-    if (m_Type != TYPE_FALLOUT4 && m_Type != TYPE_STARFIELD &&
-        m_Type != TYPE_STARFIELD_LZ4_TEXTURE && m_Type != TYPE_FALLOUT4NG_7 &&
-        m_Type != TYPE_FALLOUT4NG_8) {
-      // BSA extraction
-      if (compressed(fileInfo.file)) {
-        // Decompress data
-        if (m_Type != TYPE_SKYRIMSE) {
-          // Oblivion - Skyrim LE use gzip compression
-          EErrorCode result = ERROR_NONE;
-          try {
-            BSAULong length = 0UL;
-            boost::shared_array<unsigned char> buffer =
-                decompress(dataBuffer.first.get(), dataBuffer.second, result, length);
-            if (buffer.get() != nullptr) {
-              outputFile.write(reinterpret_cast<char*>(buffer.get()), length);
-              buffer.reset();
-            }
-          } catch (const std::exception&) {
-#pragma message("report error!")
-            dataBuffer.first.reset();
-            fileInfo.data.first.reset();
-            continue;
-          }
-        } else {
-          // Skyrim SE uses LZ4 Frame compression
-          if (!fileInfo.file->m_TextureChunks.size()) {
-            char* outBuffer = new char[fileInfo.file->m_UncompressedFileSize];
-
-            LZ4F_decompressionContext_t dcContext = nullptr;
-            LZ4F_decompressOptions_t options      = {};
-            LZ4F_createDecompressionContext(&dcContext, LZ4F_VERSION);
-            size_t outSize = fileInfo.file->m_UncompressedFileSize;
-            size_t inSize  = dataBuffer.second;
-
-            LZ4F_decompress(dcContext, outBuffer, &outSize, dataBuffer.first.get(),
-                            &inSize, &options);
-            outputFile.write(outBuffer, fileInfo.file->m_UncompressedFileSize);
-            LZ4F_freeDecompressionContext(dcContext);
-            delete[] outBuffer;
-          }
-        }
-      } else {
-        // No compression - just write the data.
-        outputFile.write(reinterpret_cast<char*>(dataBuffer.first.get()),
-                         dataBuffer.second);
+    if (target.sink != nullptr) {
+      if (fileInfo->result == ERROR_NONE) {
+        sinkExtractedFile(target, *fileInfo, stats);
       }
-    } else {
-      // BA2 format
-      if (fileInfo.file->m_TextureChunks.size()) {
-        // Texture stream format - requires building the header data for the DDS file
-        bool isDX10                              = false;
-        DirectX::DDS_HEADER_DXT10 DX10HeaderData = {};
-        DirectX::DDS_HEADER DDSHeaderData =
-            getDDSHeader(fileInfo.file, DX10HeaderData, isDX10);
-
-        outputFile.write("DDS ", 4);
-        char* DDSHeader = new char[sizeof(DDSHeaderData)];
-        memcpy(DDSHeader, &DDSHeaderData, sizeof(DDSHeaderData));
-        outputFile.write(DDSHeader, sizeof(DDSHeaderData));
-        delete[] DDSHeader;
-
-        if (isDX10) {
-          // This format requires DX10 header info
-          getDX10Header(DX10HeaderData, fileInfo.file, DDSHeaderData);
-
-          char* DX10Header = new char[sizeof(DX10HeaderData)];
-          memcpy(DX10Header, &DX10HeaderData, sizeof(DX10HeaderData));
-          outputFile.write(DX10Header, sizeof(DX10HeaderData));
-          delete[] DX10Header;
-        }
+      // streaming may fail as well, so this isn't the else branch
+      if (fileInfo->result != ERROR_NONE) {
+        target.sink->failed(fileInfo->file, fileInfo->result);
       }
+    } else if (fileInfo->result == ERROR_NONE) {
+      writeExtractedFile(target, *fileInfo, stats);
+    }
 
-      EErrorCode result = ERROR_NONE;
-      try {
-        BSAULong length = fileInfo.file->m_UncompressedFileSize;
-        if (fileInfo.file->m_FileSize > 0 && !fileInfo.file->m_TextureChunks.size()) {
-          BSAULong length = fileInfo.file->m_UncompressedFileSize;
-          boost::shared_array<unsigned char> buffer =
-              decompress(dataBuffer.first.get(), dataBuffer.second, result, length);
-          if (buffer.get() != nullptr) {
-            outputFile.write(reinterpret_cast<char*>(buffer.get()), length);
-            buffer.reset();
-          }
-        } else {
-          outputFile.write(reinterpret_cast<char*>(dataBuffer.first.get()),
-                           dataBuffer.second);
-        }
-      } catch (const std::exception&) {
-#pragma message("report error!")
-        dataBuffer.first.reset();
-        fileInfo.data.first.reset();
-        continue;
+    if (fileInfo->result != ERROR_NONE) {
+      ++stats.filesFailed;
+      boost::lock_guard<boost::mutex> lock(progress.mutex);
+      if (progress.firstError == ERROR_NONE) {
+        progress.firstError = fileInfo->result;
       }
     }
-    dataBuffer.first.reset();
-    fileInfo.data.first.reset();
+
+    // free the buffers before their space is handed back to the reader
+    uint64_t reservedBytes = fileInfo->reservedBytes;
+    fileInfo.reset();
+    budget.release(reservedBytes);
   }
 }
 
-void Archive::createFolders(const std::string& targetDirectory, Folder::Ptr folder)
+void Archive::createFolders(const std::string& targetDirectory,
+                            unsigned int numThreads,
+                            const std::unordered_set<const Folder*>* folders)
 {
-  for (std::vector<Folder::Ptr>::iterator iter = folder->m_SubFolders.begin();
-       iter != folder->m_SubFolders.end(); ++iter) {
-    std::string subDirName = targetDirectory + "\\" + (*iter)->getName();
-    ::CreateDirectoryA(subDirName.c_str(), nullptr);
-    createFolders(subDirName, *iter);
+  // a directory can only be created once its parent exists, so the tree is created
+  // level by level
+  std::vector<std::pair<Folder::Ptr, std::string>> level;
+  level.push_back(std::make_pair(m_RootFolder, targetDirectory));
+  while (!level.empty()) {
+    std::vector<std::pair<Folder::Ptr, std::string>> nextLevel;
+    for (const std::pair<Folder::Ptr, std::string>& folder : level) {
+      for (const Folder::Ptr& subFolder : folder.first->m_SubFolders) {
+        if ((folders != nullptr) && (folders->count(subFolder.get()) == 0)) {
+          continue;
+        }
+        nextLevel.push_back(
+            std::make_pair(subFolder, folder.second + "\\" + subFolder->getName()));
+      }
+    }
+
+    std::atomic<size_t> nextFolder(0);
+    boost::function<void()> create = [&nextLevel, &nextFolder]() {
+      for (size_t i = nextFolder++; i < nextLevel.size(); i = nextFolder++) {
+        ::CreateDirectoryA(nextLevel[i].second.c_str(), nullptr);
+      }
+    };
+    boost::thread_group helpers;
+    unsigned int numHelpers =
+        (std::min)(numThreads, static_cast<unsigned int>(nextLevel.size() / 16));
+    for (unsigned int i = 1; i < numHelpers; ++i) {
+      helpers.create_thread(create);
+    }
+    create();
+    helpers.join_all();
+
+    level.swap(nextLevel);
   }
 }
 
@@ -1154,71 +2862,277 @@ EErrorCode Archive::extractAll(
     const boost::function<bool(int value, std::string fileName)>& progress,
     bool overwrite)
 {
-#pragma message("report errors")
-  createFolders(outputDirectory, m_RootFolder);
+  ExtractOptions options;
+  options.overwrite = overwrite;
+  return extractAll(outputDirectory, progress, options);
+}
+
+EErrorCode Archive::extractAll(
+    const char* outputDirectory,
+    const boost::function<bool(int value, std::string fileName)>& progress,
+    const ExtractOptions& options)
+{
+  std::vector<File::Ptr> fileList;
+  m_RootFolder->collectFiles(fileList);
+  std::sort(fileList.begin(), fileList.end(), ByOffset);
+  return extractToDirectory(outputDirectory, fileList, nullptr, progress, options);
+}
+
+EErrorCode Archive::extractAll(
+    ExtractSink& sink,
+    const boost::function<bool(int value, std::string fileName)>& progress,
+    const ExtractOptions& options)
+{
+  ExtractTarget target;
+  target.sink = &sink;
+
+  std::vector<File::Ptr> fileList;
+  m_RootFolder->collectFiles(fileList);
+  std::sort(fileList.begin(), fileList.end(), ByOffset);
+  return extractPipeline(target, fileList, progress, options);
+}
+
+EErrorCode Archive::extractFiles(
+    std::span<const File::Ptr> files, const char* outputDirectory,
+    const boost::function<bool(int value, std::string fileName)>& progress,
+    const ExtractOptions& options)
+{
+  std::vector<File::Ptr> fileList;
+  std::unordered_set<const Folder*> folders;
+  EErrorCode result = selectFiles(files, fileList, &folders);
+  if (result != ERROR_NONE) {
+    return result;
+  }
+  return extractToDirectory(outputDirectory, fileList, &folders, progress, options);
+}
+
+EErrorCode Archive::extractFiles(
+    std::span<const File::Ptr> files, ExtractSink& sink,
+    const boost::function<bool(int value, std::string fileName)>& progress,
+    const ExtractOptions& options)
+{
+  std::vector<File::Ptr> fileList;
+  EErrorCode result = selectFiles(files, fileList, nullptr);
+  if (result != ERROR_NONE) {
+    return result;
+  }
+
+  ExtractTarget target;
+  target.sink = &sink;
+  return extractPipeline(target, fileList, progress, options);
+}
+
+EErrorCode Archive::extractIf(
+    const boost::function<bool(const File::Ptr& file)>& predicate,
+    const char* outputDirectory,
+    const boost::function<bool(int value, std::string fileName)>& progress,
+    const ExtractOptions& options)
+{
+  std::vector<File::Ptr> fileList;
+  m_RootFolder->collectFiles(fileList);
+  fileList.erase(std::remove_if(fileList.begin(), fileList.end(),
+                                [&predicate](const File::Ptr& file) {
+                                  return !predicate(file);
+                                }),
+                 fileList.end());
+  return extractFiles(fileList, outputDirectory, progress, options);
+}
 
+EErrorCode Archive::extractIf(
+    const boost::function<bool(const File::Ptr& file)>& predicate, ExtractSink& sink,
+    const boost::function<bool(int value, std::string fileName)>& progress,
+    const ExtractOptions& options)
+{
   std::vector<File::Ptr> fileList;
   m_RootFolder->collectFiles(fileList);
+  fileList.erase(std::remove_if(fileList.begin(), fileList.end(),
+                                [&predicate](const File::Ptr& file) {
+                                  return !predicate(file);
+                                }),
+                 fileList.end());
+  return extractFiles(fileList, sink, progress, options);
+}
+
+EErrorCode Archive::selectFiles(std::span<const File::Ptr> files,
+                                std::vector<File::Ptr>& fileList,
+                                std::unordered_set<const Folder*>* folders) const
+{
+  std::unordered_set<const File*> selected;
+  fileList.reserve(files.size());
+  for (const File::Ptr& file : files) {
+    if (!selected.insert(file.get()).second) {
+      continue;
+    }
+
+    // walk up to the root, which also tells whether the file belongs to this archive
+    const Folder* folder = file->getFolder();
+    while ((folder != nullptr) && (folder != m_RootFolder.get())) {
+      if (folders != nullptr) {
+        folders->insert(folder);
+      }
+      folder = folder->m_Parent;
+    }
+    if (folder == nullptr) {
+      return ERROR_FILENOTFOUND;
+    }
+    fileList.push_back(file);
+  }
   std::sort(fileList.begin(), fileList.end(), ByOffset);
-  m_File.seekg((*(fileList.begin()))->m_DataOffset);
-
-  std::queue<FileInfo> buffers;
-  boost::mutex queueMutex;
-  int filesDone = 0;
-  boost::interprocess::interprocess_semaphore bufferCount(0);
-  boost::interprocess::interprocess_semaphore queueFree(100);
-
-  boost::thread readerThread(boost::bind(&Archive::readFiles, this, boost::ref(buffers),
-                                         boost::ref(queueMutex),
-                                         boost::ref(bufferCount), boost::ref(queueFree),
-                                         fileList.begin(), fileList.end()));
-
-  boost::thread extractThread(boost::bind(
-      &Archive::extractFiles, this, outputDirectory, boost::ref(buffers),
-      boost::ref(queueMutex), boost::ref(bufferCount), boost::ref(queueFree),
-      static_cast<int>(fileList.size()), overwrite, boost::ref(filesDone)));
-
-  bool readerDone  = false;
-  bool extractDone = false;
-  bool canceled    = false;
-  while (!readerDone || !extractDone) {
-    if (!readerDone) {
-      readerDone = readerThread.timed_join(boost::posix_time::millisec(100));
-    }
-    if (readerDone) {
-      extractDone = extractThread.timed_join(boost::posix_time::millisec(100));
-      // don't cancel extractor before reader is done or else reader may be stuck trying
-      // to write to a queue
-      if (canceled) {
-        // ensure the extract thread wakes up.
-        extractThread.interrupt();
-        bufferCount.post();
-      }
-    }
-    size_t index = (std::min)(static_cast<size_t>(filesDone), fileList.size() - 1);
+  return ERROR_NONE;
+}
+
+EErrorCode Archive::extractToDirectory(
+    const char* outputDirectory, std::vector<File::Ptr>& fileList,
+    const std::unordered_set<const Folder*>* folders,
+    const boost::function<bool(int value, std::string fileName)>& progress,
+    const ExtractOptions& options)
+{
+  unsigned int numWriters = options.writeThreads > 0 ? options.writeThreads
+                                                     : WRITE_THREADS;
+  createFolders(outputDirectory, numWriters, folders);
+
+  ExtractTarget target;
+  target.directory = outputDirectory;
+  target.overwrite = options.overwrite;
+  if (!options.overwrite && options.scanTarget) {
+    scanTarget(target.directory, target.existingFiles);
+    target.scanned = true;
+  }
+  return extractPipeline(target, fileList, progress, options);
+}
+
+EErrorCode Archive::extractPipeline(
+    const ExtractTarget& target, std::vector<File::Ptr>& fileList,
+    const boost::function<bool(int value, std::string fileName)>& progress,
+    const ExtractOptions& options)
+{
+  if (fileList.empty()) {
+    return ERROR_NONE;
+  }
+
+  unsigned int numWriters = options.writeThreads > 0 ? options.writeThreads
+                                                     : WRITE_THREADS;
+  int numDecompressors = static_cast<int>(options.decompressThreads);
+  if (numDecompressors <= 0) {
+    numDecompressors =
+        (std::max)(1, static_cast<int>(boost::thread::hardware_concurrency()));
+  }
+
+  // readers -> decompressors -> writers. The readers work through the archive in
+  // offset order, merging neighbouring files into larger reads. Decompressed files
+  // reach the writers in whatever order they are done. Memory is bounded by the
+  // budget, the queues only limit the bookkeeping
+  WorkQueue<DecompressTask> readQueue(QUEUE_CAPACITY);
+  WorkQueue<FileInfo::Ptr> writeQueue(QUEUE_CAPACITY);
+  ByteBudget budget((std::max)(options.memoryBudget, uint64_t(1)));
+  ReadPlan readPlan;
+  readPlan.readers = static_cast<int>(options.readThreads);
+  if (readPlan.readers <= 0) {
+    readPlan.readers = READ_THREADS;
+  }
+  readPlan.streamThreshold = (std::min)(options.streamThreshold, options.memoryBudget);
+  planReads(fileList, readPlan.streamThreshold, readPlan.batches);
+  ExtractProgress extractProgress;
+  std::atomic<int> decompressorsDone(0);
+
+  // the stages always count, the caller just may not be interested
+  ExtractStats localStats;
+  ExtractStats& stats = options.stats != nullptr ? *options.stats : localStats;
+  stats.queueCapacity = readQueue.capacity();
+
+  boost::thread_group readerThreads;
+  for (int i = 0; i < readPlan.readers; ++i) {
+    readerThreads.create_thread(boost::bind(&Archive::readFiles, this,
+                                            boost::ref(readQueue), boost::ref(readPlan),
+                                            boost::ref(budget), boost::ref(stats)));
+  }
+
+  boost::thread_group decompressThreads;
+  for (int i = 0; i < numDecompressors; ++i) {
+    decompressThreads.create_thread(boost::bind(
+        &Archive::decompressFiles, this, boost::ref(readQueue), boost::ref(writeQueue),
+        boost::ref(decompressorsDone), numDecompressors, boost::ref(stats)));
+  }
+
+  // creating files is slow enough on some systems that one thread can't keep up
+  std::vector<boost::thread> writerThreads;
+  for (unsigned int i = 0; i < numWriters; ++i) {
+    writerThreads.emplace_back(boost::bind(
+        &Archive::writeFiles, this, boost::cref(target), boost::ref(writeQueue),
+        boost::ref(budget), boost::ref(extractProgress), boost::ref(stats)));
+  }
+
+  bool canceled        = false;
+  bool done            = false;
+  size_t writersJoined = 0;
+  while (!done) {
+    // the writers are waited for one after the other, waking up regularly to report
+    // progress
+    if (writerThreads[writersJoined].timed_join(boost::posix_time::millisec(100))) {
+      ++writersJoined;
+    }
+    done = writersJoined == writerThreads.size();
+
+    stats.readQueueSize     = readQueue.size();
+    stats.writeQueueSize    = writeQueue.size();
+    stats.readQueuePeak     = readQueue.peak();
+    stats.writeQueuePeak    = writeQueue.peak();
+    stats.bytesBuffered     = budget.used();
+    stats.bytesBufferedPeak = budget.peak();
+    if (options.observer && !done) {
+      options.observer(stats);
+    }
+
+    int filesDone;
+    File::Ptr lastFile;
+    {
+      boost::lock_guard<boost::mutex> lock(extractProgress.mutex);
+      filesDone = extractProgress.filesDone;
+      lastFile  = extractProgress.lastFile;
+    }
+    if (lastFile.get() == nullptr) {
+      lastFile = fileList.front();
+    }
     if (!progress((filesDone * 100) / static_cast<int>(fileList.size()),
-                  fileList[index]->getName()) &&
+                  lastFile->getName()) &&
         !canceled) {
-      readerThread.interrupt();
-      canceled = true;  // don't interrupt repeatedly
+      // wake up all stages, they stop as soon as they see the queues canceled
+      readQueue.cancel();
+      writeQueue.cancel();
+      budget.cancel();
+      canceled = true;  // don't cancel repeatedly
     }
   }
 
-  return ERROR_NONE;
+  readerThreads.join_all();
+  decompressThreads.join_all();
+
+  if (options.observer) {
+    options.observer(stats);
+  }
+  // the writers are done, nothing else touches the error anymore
+  return canceled ? ERROR_CANCELED : extractProgress.firstError;
 }
 
 bool Archive::compressed(const File::Ptr& file) const
 {
   if (m_Type != TYPE_FALLOUT4 && m_Type != TYPE_FALLOUT4NG_7 && m_Type != TYPE_FALLOUT4NG_8)
     return file->compressToggled() ^ defaultCompressed();
-  return (file->m_FileSize > 0);
+  return (file->getFileSize() > 0);
 }
 
 File::Ptr Archive::createFile(const std::string& name, const std::string& sourceName,
                               bool compressed)
 {
-  return File::Ptr(
-      new File(name, sourceName, nullptr, defaultCompressed() != compressed));
+  return m_FileTable->create(name, sourceName, nullptr,
+                             defaultCompressed() != compressed);
+}
+
+void Archive::updateFile(const File::Ptr& file, const std::string& sourceName,
+                         bool compressed)
+{
+  file->setSourceFile(sourceName);
+  file->setCompressToggledWrite(defaultCompressed() != compressed);
 }
 
 void Archive::cleanFolder(Folder::Ptr folder)
@@ -23,29 +23,182 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include "dxgiformat.h"
 #include "DDS.h"
+#include "bsacache.h"
 #include "bsafolder.h"
+#include "bsaindex.h"
+#include "bsasource.h"
 #include "bsatypes.h"
 #include "errorcodes.h"
-#include <queue>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <span>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #ifndef Q_MOC_RUN
 #include <boost/function.hpp>
 #include <boost/shared_array.hpp>
+#include <boost/thread/mutex.hpp>
 #endif  // Q_MOC_RUN
 
-namespace boost
+namespace BSA
 {
-class mutex;
-namespace interprocess
+
+class File;
+class ByteBudget;
+template <typename T>
+class WorkQueue;
+
+/**
+ * flags controlling how an archive is opened by Archive::read
+ */
+enum EOpenFlags
 {
-  class interprocess_semaphore;
-}
-}  // namespace boost
+  OPEN_DEFAULT = 0x00,
+  /// map the archive into memory instead of reading file data through a stream
+  OPEN_MEMORYMAPPED = 0x01,
+  /// only read what is needed for the file list. Details like the header and chunk
+  /// table of textures are read the first time a file is extracted
+  OPEN_LAZY = 0x02
+};
 
-namespace BSA
+/**
+ * ways file data can be stored in an archive
+ */
+enum ECodec
 {
+  CODEC_STORED,
+  CODEC_ZLIB,
+  CODEC_LZ4_FRAME,
+  CODEC_LZ4_BLOCK,
+  CODEC_COUNT
+};
 
-class File;
+/**
+ * counters collected by Archive::extractAll. The stages update them while they run so
+ * they can be read at any time. Times are the sum over all threads of a stage and only
+ * include the time spent working, not the time spent waiting on a queue. Files that
+ * are streamed are read and decompressed by the writer and count towards its time
+ */
+struct ExtractStats
+{
+  /// bytes fetched from the archive
+  std::atomic<uint64_t> bytesRead{0};
+  /// bytes produced by decompressing, stored data is not counted
+  std::atomic<uint64_t> bytesInflated{0};
+  /// bytes written to the output files
+  std::atomic<uint64_t> bytesWritten{0};
+  std::atomic<uint64_t> readMicroseconds{0};
+  std::atomic<uint64_t> decompressMicroseconds{0};
+  std::atomic<uint64_t> writeMicroseconds{0};
+  /// number of files, or texture chunks, handled by each codec. Indexed by ECodec
+  std::atomic<uint64_t> codecUnits[CODEC_COUNT] = {};
+  /// items waiting for the decompressors and for the writer, sampled periodically
+  std::atomic<size_t> readQueueSize{0};
+  std::atomic<size_t> writeQueueSize{0};
+  /// highest number of items that were waiting in each queue
+  std::atomic<size_t> readQueuePeak{0};
+  std::atomic<size_t> writeQueuePeak{0};
+  /// number of items each queue holds before the stage feeding it blocks
+  std::atomic<size_t> queueCapacity{0};
+  /// number of reads issued to the archive, a batch of neighbouring files counts as
+  /// one. Memory mapped archives don't issue any
+  std::atomic<uint64_t> readRequests{0};
+  /// bytes held by the pipeline, currently and at most. Bounded by
+  /// ExtractOptions::memoryBudget
+  std::atomic<uint64_t> bytesBuffered{0};
+  std::atomic<uint64_t> bytesBufferedPeak{0};
+  /// number of files that couldn't be read, decompressed or written
+  std::atomic<uint64_t> filesFailed{0};
+};
+
+/**
+ * settings for Archive::extractAll
+ */
+struct ExtractOptions
+{
+  /// if true (default) files are overwritten if they exist
+  bool overwrite = true;
+  /// number of threads decompressing files. 0 (default) uses one per processor core
+  unsigned int decompressThreads = 0;
+  /// number of threads reading from the archive, each with one read in flight.
+  /// 0 (default) uses 4
+  unsigned int readThreads = 0;
+  /// number of threads creating and writing the output files. 0 (default) uses 4
+  unsigned int writeThreads = 0;
+  /// if true and overwrite is false, the output directory is listed once up front
+  /// instead of checking for each file whether it exists
+  bool scanTarget = false;
+  /// number of bytes of stored and extracted data the pipeline may hold at the same
+  /// time. The reader waits while this is used up
+  uint64_t memoryBudget = 256ULL * 1024 * 1024;
+  /// files stored in more bytes than this, or than memoryBudget, aren't buffered.
+  /// They are decompressed straight into their output file window by window. This
+  /// doesn't apply to ba2 textures, their chunks are always buffered
+  uint64_t streamThreshold = 32ULL * 1024 * 1024;
+  /// if set, receives the counters of the extraction. Has to stay valid until
+  /// extractAll returns
+  ExtractStats* stats = nullptr;
+  /// if set, called with the counters about every 100 ms and once after all files
+  /// are extracted
+  boost::function<void(const ExtractStats&)> observer;
+};
+
+/**
+ * settings for Archive::write
+ */
+struct WriteOptions
+{
+  /// number of threads compressing files. 0 (default) uses one per processor core
+  unsigned int compressThreads = 0;
+  /// store the data of files with identical contents once, all their records point to
+  /// it. Files with the same 64 bit hash and size are compared byte by byte before
+  /// they share data. Has no effect on bsa archives that store the file names in front
+  /// of the data
+  bool deduplicate = false;
+  /// if set, called with a file that couldn't be written as asked and the reason. This
+  /// includes dds files that can't be stored in a texture archive, the archive is then
+  /// written as a general one with the files as they are
+  boost::function<void(const File::Ptr& file, EErrorCode error)> fileError;
+};
+
+/**
+ * @brief receives the files extracted by Archive::extractAll instead of them being
+ * written to disc. The sink is called from the writer threads, so with more than one
+ * of those (see ExtractOptions::writeThreads) calls for different files happen
+ * concurrently. The pieces of one file arrive on one thread in order
+ */
+class ExtractSink
+{
+
+public:
+  virtual ~ExtractSink() {}
+
+  /**
+   * receive a piece of an extracted file. Files below ExtractOptions::streamThreshold
+   * arrive in one piece. Larger ones arrive in consecutive pieces and are ended by a
+   * call with last set that may not carry any data
+   * @param file the file the data belongs to
+   * @param offset position of the piece in the file
+   * @param data the extracted data. Only valid during the call
+   * @param size number of bytes in data
+   * @param last true if this is the final piece of the file
+   */
+  virtual void write(const File::Ptr& file, BSAHash offset, const std::byte* data,
+                     size_t size, bool last) = 0;
+
+  /**
+   * called instead of write for a file that couldn't be extracted. Pieces of the file
+   * may have been passed to write before
+   * @param file the file that failed
+   * @param error the reason
+   */
+  virtual void failed(const File::Ptr& /*file*/, EErrorCode /*error*/) {}
+};
 
 /**
  * @brief top level structure to represent a bsa file
@@ -53,6 +206,8 @@ class File;
 class Archive
 {
 
+  friend class ArchiveSet;
+
 public:
   typedef std::pair<boost::shared_array<unsigned char>, BSAULong> DataBuffer;
 
@@ -78,15 +233,37 @@ public:
    * @param fileName name of the file to read from
    * @param testHashes if true, the hashes of file names will be checked to ensure the
    * file is valid. This can be skipped for performance reasons
+   * @param openFlags combination of EOpenFlags
    * @return ERROR_NONE on success or an error code
    */
-  EErrorCode read(const char* fileName, bool testHashes);
+  EErrorCode read(const char* fileName, bool testHashes,
+                  unsigned int openFlags = OPEN_DEFAULT);
+  /**
+   * read the archive from file, using an index file to skip parsing the directory.
+   * If the index matches the size and modification time of the archive the file list
+   * is built from it, otherwise the archive is read as usual and the index is written
+   * for the next time
+   * @param indexFile name of the index file, created or replaced as needed
+   * @see read
+   */
+  EErrorCode read(const char* fileName, bool testHashes, unsigned int openFlags,
+                  const char* indexFile);
   /**
    * write the archive to disc
    * @param fileName name of the file to write to
    * @return ERROR_NONE on success or an error code
    */
   EErrorCode write(const char* fileName);
+  /**
+   * write the archive to disc. Files are compressed by a pool of threads and written
+   * in a single pass. Morrowind archives can't be written. A ba2 holding nothing but
+   * dds files is written as a texture archive with the textures split into chunks,
+   * unless one of them has a pixel format or layout a texture archive can't hold
+   * @param fileName name of the file to write to
+   * @param options write settings
+   * @return ERROR_NONE on success or an error code
+   */
+  EErrorCode write(const char* fileName, const WriteOptions& options);
   /**
    * @brief close the archive
    */
@@ -105,6 +282,13 @@ public:
    * @return descriptor of the root folder
    */
   Folder::Ptr getRoot() { return m_RootFolder; }
+  /**
+   * look up a file by its path inside the archive. This uses an index built by read
+   * so it takes constant time, files added to the archive afterwards are not found
+   * @param path path of the file, case insensitive and with either kind of slashes
+   * @return the file or a null pointer if there is no file with that path
+   */
+  File::Ptr findFile(std::string_view path) const;
   /**
    * extract a file from the archive
    * @param file descriptor of the file to extract
@@ -113,6 +297,51 @@ public:
    * @return ERROR_NONE on success or an error code
    */
   EErrorCode extract(File::Ptr file, const char* outputDirectory) const;
+  /**
+   * determine the size of a file once extracted. For textures this includes the
+   * generated dds header
+   * @param file descriptor of the file
+   * @param size receives the size in bytes
+   * @return ERROR_NONE on success or an error code
+   */
+  EErrorCode getExtractedSize(File::Ptr file, BSAULong& size) const;
+  /**
+   * extract a file into memory. Unlike extractAll this doesn't modify the archive so
+   * any number of threads may extract from the same archive concurrently
+   * @param file descriptor of the file to extract
+   * @param out buffer to extract to, needs to be at least getExtractedSize() bytes
+   * @return ERROR_NONE on success, ERROR_BUFFERTOOSMALL if out is too small or an error
+   *         code
+   */
+  EErrorCode extractToMemory(File::Ptr file, std::span<std::byte> out) const;
+  /**
+   * extract a file into a newly sized buffer. This is thread-safe like
+   * extractToMemory
+   * @param file descriptor of the file to extract
+   * @param data receives the file content
+   * @return ERROR_NONE on success or an error code
+   */
+  EErrorCode readFile(File::Ptr file, std::vector<std::byte>& data) const;
+  /**
+   * extract a file into a shared, immutable buffer. If the archive has a cache the
+   * content is kept there, so reading the same file again costs a lookup instead of
+   * decompressing it. This is thread-safe like extractToMemory
+   * @param file descriptor of the file to extract
+   * @param data receives the file content
+   * @return ERROR_NONE on success or an error code
+   */
+  EErrorCode readShared(File::Ptr file, FileCache::Data& data) const;
+  /**
+   * set the cache of decompressed files used by this archive. The same cache may be
+   * shared by any number of archives. Only readShared adds files to the cache,
+   * extractToMemory and readFile copy files that are already in it
+   * @param cache the cache to use, an empty pointer disables caching
+   */
+  void setCache(const FileCache::Ptr& cache);
+  /**
+   * @return the cache of decompressed files used by this archive
+   */
+  const FileCache::Ptr& getCache() const { return m_Cache; }
   /**
    * @return archive flags
    */
@@ -131,6 +360,85 @@ public:
   extractAll(const char* outputDirectory,
              const boost::function<bool(int value, std::string fileName)>& progress,
              bool overwrite = true);
+  /**
+   * extract all files. Files are read in the order they are stored in the archive and
+   * decompressed by a pool of threads
+   * @param outputDirectory name of the directory to extract to.
+   *                        may be absolute or relative
+   * @param progress callback function called on progress
+   * @param options extraction settings
+   * @return ERROR_NONE on success, ERROR_CANCELED if progress returned false, otherwise
+   *         the error of the first file that couldn't be extracted. The other files
+   *         are still extracted, ExtractStats::filesFailed counts the failures
+   */
+  EErrorCode
+  extractAll(const char* outputDirectory,
+             const boost::function<bool(int value, std::string fileName)>& progress,
+             const ExtractOptions& options);
+  /**
+   * extract all files into a sink instead of the file system. The decompressed data is
+   * passed to the sink directly, without being copied. writeThreads of the options
+   * sets the number of threads calling the sink, overwrite and scanTarget don't apply
+   * @param sink receives the content of the files
+   * @param progress callback function called on progress
+   * @param options extraction settings
+   * @return ERROR_NONE on success or an error code
+   */
+  EErrorCode
+  extractAll(ExtractSink& sink,
+             const boost::function<bool(int value, std::string fileName)>& progress,
+             const ExtractOptions& options);
+  /**
+   * extract some of the files through the same threads as extractAll. The files are
+   * reordered by their offset in the archive, files listed more than once are only
+   * extracted once. Only the folders containing one of the files are created
+   * @param files the files to extract, all from this archive
+   * @param outputDirectory name of the directory to extract to.
+   *                        may be absolute or relative
+   * @param progress callback function called on progress
+   * @param options extraction settings
+   * @return ERROR_NONE on success, ERROR_FILENOTFOUND if one of the files isn't part of
+   *         this archive or an error code
+   */
+  EErrorCode
+  extractFiles(std::span<const File::Ptr> files, const char* outputDirectory,
+               const boost::function<bool(int value, std::string fileName)>& progress,
+               const ExtractOptions& options);
+  /**
+   * extract some of the files into a sink
+   * @see extractFiles
+   * @see extractAll
+   */
+  EErrorCode
+  extractFiles(std::span<const File::Ptr> files, ExtractSink& sink,
+               const boost::function<bool(int value, std::string fileName)>& progress,
+               const ExtractOptions& options);
+  /**
+   * extract the files matching a predicate
+   * @param predicate called once for every file of the archive, before the extraction
+   *                  starts. Returns true for the files to extract
+   * @param outputDirectory name of the directory to extract to.
+   *                        may be absolute or relative
+   * @param progress callback function called on progress
+   * @param options extraction settings
+   * @return ERROR_NONE on success or an error code
+   * @see extractFiles
+   */
+  EErrorCode
+  extractIf(const boost::function<bool(const File::Ptr& file)>& predicate,
+            const char* outputDirectory,
+            const boost::function<bool(int value, std::string fileName)>& progress,
+            const ExtractOptions& options);
+  /**
+   * extract the files matching a predicate into a sink
+   * @see extractIf
+   * @see extractAll
+   */
+  EErrorCode
+  extractIf(const boost::function<bool(const File::Ptr& file)>& predicate,
+            ExtractSink& sink,
+            const boost::function<bool(int value, std::string fileName)>& progress,
+            const ExtractOptions& options);
 
   /**
    * @param file the file to check
@@ -142,11 +450,22 @@ public:
    * added to a folder, use BSA::Folder::addFile for that
    * @param name name of the file to be used inside the archive
    * @param sourceName filename path to the file to add
-   * @param compressed true if the file should be compressed (not supported yet!)
+   * @param compressed true if the file should be compressed. Compression happens when
+   *        the archive is written
    * @return pointer to the new file
    */
   File::Ptr createFile(const std::string& name, const std::string& sourceName,
                        bool compressed);
+  /**
+   * replace the content of a file with a file from disc. When the archive is written
+   * only new and updated files are read and compressed, all others are copied as
+   * stored in the source archive
+   * @param file the file to update
+   * @param sourceName filename path to the new content
+   * @param compressed true if the file should be compressed
+   */
+  void updateFile(const File::Ptr& file, const std::string& sourceName,
+                  bool compressed);
 
 private:
   struct Header
@@ -166,20 +485,135 @@ private:
 
   struct FileInfo
   {
+    typedef std::shared_ptr<FileInfo> Ptr;
+
+    File::Ptr file;
+    // data as stored in the archive, the extracted data once decompressed
+    DataBuffer data;
+    // stored data of each chunk of a texture
+    std::vector<DataBuffer> chunks;
+    // size of the file once extracted
+    BSAULong extractedSize = 0;
+    // true while data still needs to be decompressed
+    bool compressed = false;
+    // number of texture chunks not yet decompressed into data
+    std::atomic<size_t> pendingChunks{0};
+    std::atomic<EErrorCode> result{ERROR_NONE};
+    // space reserved in the ByteBudget of extractAll for this file
+    uint64_t reservedBytes = 0;
+    // true if the file isn't fetched but extracted by streamFile
+    bool streamed = false;
+    // number of bytes streamFile read from the archive
+    BSAULong storedSize = 0;
+  };
+
+  // number of items in each queue of extractAll. The memory held by the items is
+  // limited by ExtractOptions::memoryBudget
+  static const size_t QUEUE_CAPACITY = 1024;
+
+  // work item of the decompressors, either a complete file or a single texture chunk
+  struct DecompressTask
+  {
+    static const size_t WHOLE_FILE = static_cast<size_t>(-1);
+
+    FileInfo::Ptr fileInfo;
+    size_t chunk = WHOLE_FILE;
+    // offset in the extracted data the chunk decompresses to
+    BSAULong targetOffset = 0;
+  };
+
+  struct ExtractProgress
+  {
+    boost::mutex mutex;
+    int filesDone = 0;
+    File::Ptr lastFile;
+    // error of the first file that failed, returned once all files are done
+    EErrorCode firstError = ERROR_NONE;
+  };
+
+  // where and how the writers of extractAll create files
+  struct ExtractTarget
+  {
+    // if set, files are passed here instead of being written to directory
+    ExtractSink* sink = nullptr;
+    std::string directory;
+    bool overwrite = true;
+    // if scanned, the files that existed before extracting as returned by targetKey
+    bool scanned = false;
+    std::unordered_set<std::string> existingFiles;
+  };
+
+  // default number of writers of extractAll
+  static const unsigned int WRITE_THREADS = 4;
+
+  // default number of readers of extractAll
+  static const unsigned int READ_THREADS = 4;
+  // neighbouring files are read in one go as long as the batch stays below
+  // READ_BATCH_SIZE bytes and the gap between them below READ_GAP_SIZE bytes
+  static const BSAHash READ_BATCH_SIZE = 4 * 1024 * 1024;
+  static const BSAHash READ_GAP_SIZE   = 64 * 1024;
+
+  // files whose stored data is read from the archive in one go
+  struct ReadBatch
+  {
+    std::vector<File::Ptr>::iterator begin;
+    std::vector<File::Ptr>::iterator end;
+    // range of the archive covering the files. Empty if they are fetched one by one
+    BSAHash offset = 0;
+    BSAHash size   = 0;
+    // content of the range once it was read
+    boost::shared_array<unsigned char> data;
+  };
+
+  // the work of the readers of extractAll
+  struct ReadPlan
+  {
+    std::vector<ReadBatch> batches;
+    std::atomic<size_t> nextBatch{0};
+    std::atomic<int> readersDone{0};
+    int readers              = 1;
+    uint64_t streamThreshold = 0;
+  };
+
+  // a file prepared for writing by the packers
+  struct PackedFile
+  {
+    static const size_t NOT_SHARED = static_cast<size_t>(-1);
+
     File::Ptr file;
+    // the file exactly as it's stored in the new archive. For textures in a ba2 this is
+    // the source dds while its chunks are compressed
     DataBuffer data;
+    // ba2 only: size once extracted, whether data is compressed and where it's written
+    BSAULong unpackedSize = 0;
+    bool compressed       = false;
+    BSAHash offset        = 0;
+    // textures in a ba2: the chunk offsets refer to the source dds until the chunks
+    // are written
+    FO4TextureHeader textureHeader = {};
+    std::vector<FO4TextureChunk> chunkRecords;
+    std::vector<DataBuffer> chunks;
+    // number of chunks still to be compressed
+    size_t pendingChunks = 0;
+    // the stored data is copied from the source archive by the writer, data is empty
+    bool copied = false;
+    // index of an earlier file in the pack state whose data this file shares, data is
+    // empty then
+    size_t sharedWith = NOT_SHARED;
+    EErrorCode result = ERROR_NONE;
+    bool done         = false;
   };
 
+  struct PackState;
+
 private:
-  static Header readHeader(std::fstream& infile);
+  /**
+   * @throw data_invalid_exception if the data isn't the header of a supported archive
+   */
+  static Header readHeader(const unsigned char* pos, const unsigned char* end);
 
   static ArchiveType typeFromID(BSAULong typeID);
 
-  static boost::shared_array<unsigned char> decompress(unsigned char* inBuffer,
-                                                       BSAULong inSize,
-                                                       EErrorCode& result,
-                                                       BSAULong& outSize);
-
   BSAULong typeToID(ArchiveType type);
 
   Folder readFolderRecord(std::fstream& file);
@@ -187,7 +621,17 @@ private:
   //  EErrorCode extractDirect(const File &fileInfo, std::ofstream &outFile);
   //  EErrorCode extractCompressed(const File &fileInfo, std::ofstream &outFile);
 
+  // magic, DDS_HEADER and DDS_HEADER_DXT10
+  static const unsigned int DDS_HEADER_MAXSIZE =
+      4 + sizeof(DirectX::DDS_HEADER) + sizeof(DirectX::DDS_HEADER_DXT10);
+
   bool defaultCompressed() const { return m_ArchiveFlags & FLAG_DEFAULTCOMPRESSED; }
+  bool isBA2() const
+  {
+    return (m_Type == TYPE_FALLOUT4) || (m_Type == TYPE_STARFIELD) ||
+           (m_Type == TYPE_STARFIELD_LZ4_TEXTURE) || (m_Type == TYPE_FALLOUT4NG_7) ||
+           (m_Type == TYPE_FALLOUT4NG_8);
+  }
   // starting with FO3 the bsa may prefix the file name to the file blob if archive flag
   // 0x100 is set
   bool namePrefixed() const
@@ -197,6 +641,25 @@ private:
 
   BSAULong countFiles() const;
 
+  /**
+   * verify the name hashes of the files read from the archive, spread across all cores
+   * @param folders the folders of the archive
+   * @return true if the hashes of all files match their names
+   */
+  static bool testNameHashes(const std::vector<Folder::Ptr>& folders);
+
+  void buildFileIndex();
+  void indexFolder(const Folder& folder, const std::string& path);
+  /**
+   * @return true if path (without leading separators) is the path of file
+   */
+  static bool matchesPath(const File& file, std::string_view path);
+  /**
+   * @param path path of a file, leading separators are removed
+   * @return the key of the path in the file index
+   */
+  static BSAHash pathKey(std::string_view& path);
+
   std::vector<std::string> collectFolderNames() const;
   std::vector<std::string> collectFileNames() const;
 
@@ -206,38 +669,253 @@ private:
   void writeHeader(std::fstream& outfile, BSAULong fileFlags, BSAULong numFolders,
                    BSAULong folderNamesLength, BSAULong fileNamesLength);
 
+  EErrorCode writeBSA(std::fstream& outfile, const WriteOptions& options);
+  EErrorCode writeBA2(std::fstream& outfile, const WriteOptions& options);
+
+  /**
+   * the reverse of getDDSHeader
+   * @param data start of a dds file
+   * @param size number of bytes available at data
+   * @param header receives the dimensions and format of the texture
+   * @param headerSize receives the size of the headers in front of the texture data
+   * @return false if this isn't a dds file with a supported format
+   */
+  static bool readDDSHeader(const unsigned char* data, BSAULong size,
+                            FO4TextureHeader& header, BSAULong& headerSize);
+  /**
+   * determine the texture header and chunks of a texture to be written to a ba2. For
+   * textures from a dds file only the header of the file is read
+   */
+  EErrorCode planTexture(PackedFile& packed) const;
+  /**
+   * read and if necessary compress a file for writing. Files from an archive are
+   * copied as they are stored. The chunks of textures from a dds file are left to
+   * packChunk. With deduplication files whose data is already being written are only
+   * hashed
+   */
+  EErrorCode packFile(PackState& state, size_t index) const;
+  EErrorCode packChunk(PackedFile& packed, size_t index) const;
+  /**
+   * pack files and texture chunks until all are done. Packers don't get further ahead
+   * of the writer than PackState allows
+   */
+  void runPacker(PackState& state) const;
+  /**
+   * pack all files of state on a pool of threads and hand them to writeFile in order
+   */
+  EErrorCode packFiles(PackState& state, const WriteOptions& options,
+                       const boost::function<EErrorCode(PackedFile&)>& writeFile) const;
+
   DirectX::DDS_HEADER getDDSHeader(File::Ptr file,
                                    DirectX::DDS_HEADER_DXT10& DX10Header,
                                    bool& isDX10) const;
-  void getDX10Header(DirectX::DDS_HEADER_DXT10& DX10Header, File::Ptr file,
-                     DirectX::DDS_HEADER DDSHeader) const;
+  void getDX10Header(DirectX::DDS_HEADER_DXT10& DX10Header, File::Ptr file) const;
 
-  EErrorCode extractDirect(File::Ptr file, std::ofstream& outFile) const;
-  EErrorCode extractCompressed(File::Ptr file, std::ofstream& outFile) const;
+  /**
+   * make a range of the archive available. If the archive is memory mapped this points
+   * into the mapping, otherwise the data is read into buffer. The range is checked
+   * against the size of the archive before anything is allocated
+   * @throw data_invalid_exception if the range can't be read
+   */
+  const unsigned char* fetch(BSAHash offset, BSAHash length,
+                             std::unique_ptr<unsigned char[]>& buffer) const;
+  /**
+   * like fetch but the result can be handed to another thread. When memory mapped the
+   * buffer references the mapping without owning it
+   */
+  boost::shared_array<unsigned char>
+  fetchShared(BSAHash offset, BSAULong length, const ReadBatch* batch = nullptr) const;
+  /**
+   * skip over the file name that may be stored in front of a files data
+   * @return false if the prefix doesn't fit into size
+   */
+  bool skipNamePrefix(const unsigned char*& data, BSAULong& size) const;
 
-  void createFolders(const std::string& targetDirectory, Folder::Ptr folder);
+  /**
+   * write the dds header for a texture to buffer
+   * @param buffer buffer of at least DDS_HEADER_MAXSIZE bytes
+   * @return number of bytes written
+   */
+  BSAULong buildDDSHeader(File::Ptr file, unsigned char* buffer) const;
 
-  void readFiles(std::queue<FileInfo>& queue, boost::mutex& mutex,
-                 boost::interprocess::interprocess_semaphore& bufferCount,
-                 boost::interprocess::interprocess_semaphore& queueFree,
-                 std::vector<File::Ptr>::iterator begin,
-                 std::vector<File::Ptr>::iterator end);
+  /**
+   * read the texture header and chunk table of a file that was skipped by OPEN_LAZY.
+   * Does nothing if they are already available
+   * @throw data_invalid_exception if the record can't be read
+   */
+  void loadTextureInfo(File& file) const;
+  /**
+   * @return the texture chunks of a file in this archive, empty if it isn't a texture
+   */
+  std::span<const FO4TextureChunk> textureChunks(const File& file) const
+  {
+    return std::span<const FO4TextureChunk>(
+        m_TextureChunks.data() + file.getFirstChunk(), file.getChunkCount());
+  }
+
+  /**
+   * create the directory tree of the archive below targetDirectory. Each level of the
+   * tree is spread over numThreads threads
+   * @param folders if set, only these folders are created
+   */
+  void createFolders(const std::string& targetDirectory, unsigned int numThreads,
+                     const std::unordered_set<const Folder*>* folders = nullptr);
+  /**
+   * copy the files of a selection to fileList, sorted by offset and without
+   * duplicates
+   * @param folders if set, receives the folders containing the files and their parents
+   * @return ERROR_NONE or ERROR_FILENOTFOUND if one of the files isn't in this archive
+   */
+  EErrorCode selectFiles(std::span<const File::Ptr> files,
+                         std::vector<File::Ptr>& fileList,
+                         std::unordered_set<const Folder*>* folders) const;
+  /**
+   * create the folders for and extract a list of files below outputDirectory
+   * @param folders the folders to create, all of them if null
+   */
+  EErrorCode extractToDirectory(
+      const char* outputDirectory, std::vector<File::Ptr>& fileList,
+      const std::unordered_set<const Folder*>* folders,
+      const boost::function<bool(int value, std::string fileName)>& progress,
+      const ExtractOptions& options);
+
+  /**
+   * read the stored data of a file. This only does I/O, the data is decompressed by
+   * decompressInto or decompressFile
+   * @param batch if set, data inside its range is taken from it instead of the archive
+   */
+  EErrorCode fetchFile(FileInfo& fileInfo, const ReadBatch* batch = nullptr) const;
+  /**
+   * extract a file straight to target without holding it in memory. This sets
+   * compressed, extractedSize and storedSize of fileInfo. Not supported for ba2
+   * textures
+   */
+  EErrorCode streamFile(FileInfo& fileInfo, std::ostream& target) const;
+  /**
+   * extract a fetched file to target, which needs to be fileInfo.extractedSize large
+   */
+  EErrorCode decompressInto(const FileInfo& fileInfo, unsigned char* target) const;
+  /**
+   * extract a single chunk of a fetched texture
+   * @param target buffer at the position of the chunk, needs to be at least as large as
+   *        the unpacked chunk
+   */
+  EErrorCode decompressChunk(const FileInfo& fileInfo, size_t index,
+                             unsigned char* target) const;
+  /**
+   * replace the stored data of a fetched file with the extracted data
+   */
+  void decompressFile(FileInfo& fileInfo) const;
+
+  /**
+   * @return true if extractAll streams the file instead of buffering it
+   */
+  bool streamable(const File& file, uint64_t streamThreshold) const;
+  /**
+   * group files sorted by offset into batches of neighbours that are read together
+   */
+  void planReads(std::vector<File::Ptr>& files, uint64_t streamThreshold,
+                 std::vector<ReadBatch>& batches) const;
 
-  void extractFiles(const std::string& targetDirectory, std::queue<FileInfo>& queue,
-                    boost::mutex& mutex,
-                    boost::interprocess::interprocess_semaphore& bufferCount,
-                    boost::interprocess::interprocess_semaphore& queueFree,
-                    int totalFiles, bool overwrite, int& filesDone);
+  void readFiles(WorkQueue<DecompressTask>& queue, ReadPlan& plan, ByteBudget& budget,
+                 ExtractStats& stats);
+  /**
+   * fetch a file of a batch, or prepare it for streaming, and queue it
+   * @return false if the pipeline was canceled
+   */
+  bool queueFile(WorkQueue<DecompressTask>& queue, const File::Ptr& file,
+                 const ReadBatch& batch, uint64_t streamThreshold, ByteBudget& budget,
+                 ExtractStats& stats);
+  /**
+   * allocate the extracted texture and queue each of its chunks separately
+   * @return false if the queue was canceled
+   */
+  bool queueChunks(WorkQueue<DecompressTask>& queue, const FileInfo::Ptr& fileInfo);
+
+  /**
+   * @return codec used for the stored data of a fetched file, or of one of its chunks
+   */
+  ECodec fileCodec(const FileInfo& fileInfo) const;
+  ECodec chunkCodec(const FileInfo& fileInfo, size_t index) const;
+
+  void decompressFiles(WorkQueue<DecompressTask>& inQueue,
+                       WorkQueue<FileInfo::Ptr>& outQueue,
+                       std::atomic<int>& workersDone, int totalWorkers,
+                       ExtractStats& stats);
+
+  /**
+   * write a decompressed file to its place below targetDirectory. If that fails the
+   * error ends up in fileInfo.result and the incomplete file is removed
+   */
+  void writeExtractedFile(const ExtractTarget& target, FileInfo& fileInfo,
+                          ExtractStats& stats);
+  /**
+   * pass a decompressed file to the sink of target
+   */
+  void sinkExtractedFile(const ExtractTarget& target, FileInfo& fileInfo,
+                         ExtractStats& stats);
+  /**
+   * account for a file streamFile extracted
+   */
+  void countStreamedFile(const FileInfo& fileInfo, ExtractStats& stats) const;
+  /**
+   * run files through the reader, decompressor and writer threads
+   * @param fileList the files to extract, sorted by offset
+   */
+  EErrorCode extractPipeline(
+      const ExtractTarget& target, std::vector<File::Ptr>& fileList,
+      const boost::function<bool(int value, std::string fileName)>& progress,
+      const ExtractOptions& options);
+
+  void writeFiles(const ExtractTarget& target, WorkQueue<FileInfo::Ptr>& queue,
+                  ByteBudget& budget, ExtractProgress& progress, ExtractStats& stats);
 
   void cleanFolder(Folder::Ptr folder);
 
+  /**
+   * build the file list from an index file
+   * @param testHashes if true, an index written without testing the hashes is ignored
+   * @param result receives the result of the read the index was written after
+   * @return true if the index was used
+   */
+  bool loadIndex(const char* indexFile, const ArchiveIndex::Key& key, bool testHashes,
+                 EErrorCode& result);
+  /**
+   * write the file list to an index file. Failure is ignored, the index is only an
+   * optimization
+   */
+  void saveIndex(const char* indexFile, const ArchiveIndex::Key& key, bool testHashes,
+                 EErrorCode result) const;
+
+  /**
+   * drop the files of this archive from the cache. The archive gets a new cache key, so
+   * offsets of a previously opened file can't be confused with the current ones
+   */
+  void releaseCache();
+
 private:
-  mutable std::fstream m_File;
+  ArchiveSource m_Source;
+  // serializes loading of details deferred by OPEN_LAZY
+  mutable boost::mutex m_LazyMutex;
 
   Folder::Ptr m_RootFolder;
+  // storage for the files read from the archive
+  std::shared_ptr<FileTable> m_FileTable;
+  // chunks of all textures, files refer to a range. With OPEN_LAZY the slots are filled
+  // on first use
+  mutable std::vector<FO4TextureChunk> m_TextureChunks;
+  // files by the hashes of their folder path and name
+  std::unordered_multimap<BSAHash, File::Ptr> m_FileIndex;
 
   BSAULong m_ArchiveFlags;
   ArchiveType m_Type;
+  // type of the archive the files were read from. Their data can only be copied as
+  // stored as long as the type doesn't change
+  ArchiveType m_SourceType;
+
+  FileCache::Ptr m_Cache;
+  // identifies the opened file in m_Cache
+  uint64_t m_CacheKey;
 };
 
 }  // namespace BSA
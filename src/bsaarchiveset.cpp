@@ -0,0 +1,260 @@
+/*
+Mod Organizer BSA handling
+
+Copyright (C) 2012 Sebastian Herbord. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "bsaarchiveset.h"
+
+#include <algorithm>
+#include <atomic>
+#include <boost/thread.hpp>
+#include <boost/thread/lock_types.hpp>
+
+namespace BSA
+{
+
+ArchiveSet::ArchiveSet() : m_NextSequence(0ULL) {}
+
+ArchiveSet::~ArchiveSet() {}
+
+EErrorCode ArchiveSet::add(const std::string& fileName, int priority,
+                           unsigned int openFlags)
+{
+  ArchivePtr archive(new Archive);
+  EErrorCode result;
+  try {
+    result = archive->read(fileName.c_str(), true, openFlags);
+  } catch (const std::exception&) {
+    // read lets exceptions through for some kinds of damage
+    return ERROR_INVALIDDATA;
+  }
+  if ((result != ERROR_NONE) && (result != ERROR_INVALIDHASHES)) {
+    return result;
+  }
+
+  boost::unique_lock<boost::shared_mutex> lock(m_Mutex);
+  if (!insertMember(fileName, archive, priority)) {
+    return ERROR_DUPLICATENAME;
+  }
+  return result;
+}
+
+void ArchiveSet::add(const std::vector<std::pair<std::string, int>>& archives,
+                     unsigned int openFlags, std::vector<EErrorCode>& results)
+{
+  results.assign(archives.size(), ERROR_NONE);
+  std::vector<ArchivePtr> opened(archives.size());
+
+  // reading is the expensive part, merging the file lists is done serially afterwards
+  std::atomic<size_t> nextArchive(0);
+  boost::function<void()> open = [&]() {
+    for (size_t i = nextArchive++; i < archives.size(); i = nextArchive++) {
+      ArchivePtr archive(new Archive);
+      try {
+        results[i] = archive->read(archives[i].first.c_str(), true, openFlags);
+      } catch (const std::exception&) {
+        // an exception escaping a worker thread would end the process
+        results[i] = ERROR_INVALIDDATA;
+      }
+      if ((results[i] == ERROR_NONE) || (results[i] == ERROR_INVALIDHASHES)) {
+        opened[i] = archive;
+      }
+    }
+  };
+  unsigned int numThreads = (std::min)(
+      (std::max)(boost::thread::hardware_concurrency(), 1U),
+      static_cast<unsigned int>(archives.size()));
+  boost::thread_group threads;
+  for (unsigned int i = 1; i < numThreads; ++i) {
+    threads.create_thread(open);
+  }
+  open();
+  threads.join_all();
+
+  boost::unique_lock<boost::shared_mutex> lock(m_Mutex);
+  for (size_t i = 0; i < archives.size(); ++i) {
+    if (opened[i] && !insertMember(archives[i].first, opened[i], archives[i].second)) {
+      results[i] = ERROR_DUPLICATENAME;
+    }
+  }
+}
+
+bool ArchiveSet::insert(const std::string& name, const ArchivePtr& archive,
+                        int priority)
+{
+  boost::unique_lock<boost::shared_mutex> lock(m_Mutex);
+  return insertMember(name, archive, priority);
+}
+
+bool ArchiveSet::remove(const std::string& name)
+{
+  boost::unique_lock<boost::shared_mutex> lock(m_Mutex);
+  MemberMap::iterator iter = m_Members.find(name);
+  if (iter == m_Members.end()) {
+    return false;
+  }
+  if (iter->second->enabled) {
+    unindexMember(*iter->second);
+  }
+  m_Members.erase(iter);
+  return true;
+}
+
+bool ArchiveSet::setEnabled(const std::string& name, bool enabled)
+{
+  boost::unique_lock<boost::shared_mutex> lock(m_Mutex);
+  MemberMap::iterator iter = m_Members.find(name);
+  if (iter == m_Members.end()) {
+    return false;
+  }
+  Member& member = *iter->second;
+  if (member.enabled != enabled) {
+    member.enabled = enabled;
+    if (enabled) {
+      indexMember(member);
+    } else {
+      unindexMember(member);
+    }
+  }
+  return true;
+}
+
+bool ArchiveSet::setPriority(const std::string& name, int priority)
+{
+  boost::unique_lock<boost::shared_mutex> lock(m_Mutex);
+  MemberMap::iterator iter = m_Members.find(name);
+  if (iter == m_Members.end()) {
+    return false;
+  }
+  Member& member = *iter->second;
+  if (member.enabled) {
+    unindexMember(member);
+  }
+  member.priority = priority;
+  member.sequence = m_NextSequence++;
+  if (member.enabled) {
+    indexMember(member);
+  }
+  return true;
+}
+
+bool ArchiveSet::find(std::string_view path, Provider& provider) const
+{
+  BSAHash key = Archive::pathKey(path);
+
+  boost::shared_lock<boost::shared_mutex> lock(m_Mutex);
+  auto iter = m_Index.find(key);
+  if (iter == m_Index.end()) {
+    return false;
+  }
+  for (const Entry& entry : iter->second) {
+    if (Archive::matchesPath(*entry.file, path)) {
+      provider.name     = entry.member->name;
+      provider.archive  = entry.member->archive;
+      provider.file     = entry.file;
+      provider.priority = entry.member->priority;
+      return true;
+    }
+  }
+  return false;
+}
+
+std::vector<ArchiveSet::Provider> ArchiveSet::conflicts(std::string_view path) const
+{
+  BSAHash key = Archive::pathKey(path);
+  std::vector<Provider> result;
+
+  boost::shared_lock<boost::shared_mutex> lock(m_Mutex);
+  auto iter = m_Index.find(key);
+  if (iter != m_Index.end()) {
+    for (const Entry& entry : iter->second) {
+      if (Archive::matchesPath(*entry.file, path)) {
+        result.push_back(Provider{entry.member->name, entry.member->archive, entry.file,
+                                  entry.member->priority});
+      }
+    }
+  }
+  return result;
+}
+
+ArchiveSet::ArchivePtr ArchiveSet::getArchive(const std::string& name) const
+{
+  boost::shared_lock<boost::shared_mutex> lock(m_Mutex);
+  MemberMap::const_iterator iter = m_Members.find(name);
+  return iter != m_Members.end() ? iter->second->archive : ArchivePtr();
+}
+
+bool ArchiveSet::precedes(const Member& lhs, const Member& rhs)
+{
+  return (lhs.priority != rhs.priority) ? (lhs.priority > rhs.priority)
+                                        : (lhs.sequence > rhs.sequence);
+}
+
+bool ArchiveSet::insertMember(const std::string& name, const ArchivePtr& archive,
+                              int priority)
+{
+  std::unique_ptr<Member> member(new Member);
+  member->name     = name;
+  member->archive  = archive;
+  member->priority = priority;
+  member->enabled  = true;
+  member->sequence = m_NextSequence++;
+  std::pair<MemberMap::iterator, bool> inserted =
+      m_Members.emplace(name, std::move(member));
+  if (!inserted.second) {
+    return false;
+  }
+  indexMember(*inserted.first->second);
+  return true;
+}
+
+void ArchiveSet::indexMember(const Member& member)
+{
+  // the archive already hashed all its paths for its own index, they are reused as is
+  const Archive& archive = *member.archive;
+  m_Index.reserve(m_Index.size() + archive.m_FileIndex.size());
+  for (const std::pair<const BSAHash, File::Ptr>& file : archive.m_FileIndex) {
+    std::vector<Entry>& entries = m_Index[file.first];
+    std::vector<Entry>::iterator pos =
+        std::find_if(entries.begin(), entries.end(), [&member](const Entry& entry) {
+          return precedes(member, *entry.member);
+        });
+    entries.insert(pos, Entry{&member, file.second});
+  }
+}
+
+void ArchiveSet::unindexMember(const Member& member)
+{
+  for (const std::pair<const BSAHash, File::Ptr>& file : member.archive->m_FileIndex) {
+    auto iter = m_Index.find(file.first);
+    if (iter == m_Index.end()) {
+      continue;
+    }
+    std::vector<Entry>& entries = iter->second;
+    entries.erase(std::remove_if(entries.begin(), entries.end(),
+                                 [&member](const Entry& entry) {
+                                   return entry.member == &member;
+                                 }),
+                  entries.end());
+    if (entries.empty()) {
+      m_Index.erase(iter);
+    }
+  }
+}
+
+}  // namespace BSA
@@ -0,0 +1,178 @@
+/*
+Mod Organizer BSA handling
+
+Copyright (C) 2012 Sebastian Herbord. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef BSAARCHIVESET_H
+#define BSAARCHIVESET_H
+
+#include "bsaarchive.h"
+#include "bsafile.h"
+#include "bsatypes.h"
+#include "errorcodes.h"
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#ifndef Q_MOC_RUN
+#include <boost/thread/shared_mutex.hpp>
+#endif  // Q_MOC_RUN
+
+namespace BSA
+{
+
+/**
+ * @brief merges the file lists of many archives into one index. For every path the
+ * archive with the highest priority wins, the others are kept as conflicts.
+ * Archives can be added, removed, enabled and disabled one at a time, this only
+ * touches the paths of that archive. Lookups may run concurrently with each other,
+ * changes are serialized
+ */
+class ArchiveSet
+{
+
+public:
+  typedef std::shared_ptr<Archive> ArchivePtr;
+
+  /// an archive providing a file
+  struct Provider
+  {
+    std::string name;
+    ArchivePtr archive;
+    File::Ptr file;
+    int priority;
+  };
+
+public:
+  ArchiveSet();
+  ~ArchiveSet();
+
+  /**
+   * open an archive and add it to the set
+   * @param fileName name of the archive file, also the name of the archive in the set
+   * @param priority load order of the archive. Of several archives containing the same
+   *                 file the one with the higher priority wins, on a tie the one added
+   *                 last
+   * @param openFlags combination of EOpenFlags
+   * @return ERROR_NONE on success, ERROR_DUPLICATENAME if the set already holds an
+   *         archive of that name or the error of Archive::read. Archives with invalid
+   *         hashes are still added
+   */
+  EErrorCode add(const std::string& fileName, int priority,
+                 unsigned int openFlags = OPEN_DEFAULT);
+  /**
+   * open many archives and add them to the set. The archives are read in parallel,
+   * spread over up to one thread per core
+   * @param archives names and priorities of the archives
+   * @param openFlags combination of EOpenFlags
+   * @param results receives the result of each archive, in the same order. These are
+   *         the same as the ones of the single add
+   */
+  void add(const std::vector<std::pair<std::string, int>>& archives,
+           unsigned int openFlags, std::vector<EErrorCode>& results);
+  /**
+   * add an archive that is already open
+   * @param name name of the archive in the set
+   * @param archive the archive. Files added to it after this call are not found
+   * @return false if there already is an archive of that name
+   */
+  bool insert(const std::string& name, const ArchivePtr& archive, int priority);
+  /**
+   * remove an archive from the set
+   * @return false if there is no archive of that name
+   */
+  bool remove(const std::string& name);
+  /**
+   * enable or disable an archive. A disabled archive stays open but doesn't provide
+   * any files, so it can be enabled again without being read again
+   * @return false if there is no archive of that name
+   */
+  bool setEnabled(const std::string& name, bool enabled);
+  /**
+   * change the priority of an archive
+   * @return false if there is no archive of that name
+   */
+  bool setPriority(const std::string& name, int priority);
+
+  /**
+   * look up the archive that wins for a path
+   * @param path path of a file, case insensitive and with either kind of slashes
+   * @param provider receives the archive and the file
+   * @return false if no enabled archive contains the file
+   */
+  bool find(std::string_view path, Provider& provider) const;
+  /**
+   * @param path path of a file, case insensitive and with either kind of slashes
+   * @return all enabled archives containing the file, the winner first
+   */
+  std::vector<Provider> conflicts(std::string_view path) const;
+  /**
+   * @return the archive of that name or a null pointer
+   */
+  ArchivePtr getArchive(const std::string& name) const;
+
+private:
+  struct Member
+  {
+    std::string name;
+    ArchivePtr archive;
+    int priority;
+    bool enabled;
+    // orders members of the same priority, later insertions win
+    unsigned long long sequence;
+  };
+
+  struct Entry
+  {
+    const Member* member;
+    File::Ptr file;
+  };
+
+  typedef std::unordered_map<std::string, std::unique_ptr<Member>> MemberMap;
+
+private:
+  // copy constructor not implemented
+  ArchiveSet(const ArchiveSet& reference);
+
+  // assignment operator not implemented
+  ArchiveSet& operator=(const ArchiveSet& reference);
+
+  /**
+   * @return true if lhs wins over rhs
+   */
+  static bool precedes(const Member& lhs, const Member& rhs);
+
+  // the lock needs to be held exclusively by the callers of these
+  bool insertMember(const std::string& name, const ArchivePtr& archive, int priority);
+  void indexMember(const Member& member);
+  void unindexMember(const Member& member);
+
+private:
+  mutable boost::shared_mutex m_Mutex;
+  MemberMap m_Members;
+  unsigned long long m_NextSequence;
+  // providers of the files by the key of their path, the winner first. Different paths
+  // with the same key share a list
+  std::unordered_map<BSAHash, std::vector<Entry>> m_Index;
+};
+
+}  // namespace BSA
+
+#endif  // BSAARCHIVESET_H
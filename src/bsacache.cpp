@@ -0,0 +1,111 @@
+/*
+Mod Organizer BSA handling
+
+Copyright (C) 2012 Sebastian Herbord. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "bsacache.h"
+
+#include <boost/thread/lock_guard.hpp>
+
+namespace BSA
+{
+
+FileCache::FileCache(uint64_t capacity)
+    : m_Capacity(capacity), m_Size(0ULL), m_Hits(0ULL), m_Misses(0ULL)
+{}
+
+uint64_t FileCache::newArchiveKey()
+{
+  static std::atomic<uint64_t> nextKey(1ULL);
+  return nextKey++;
+}
+
+FileCache::Data FileCache::find(uint64_t archive, BSAHash offset, BSAHash size)
+{
+  boost::lock_guard<boost::mutex> lock(m_Mutex);
+  auto iter = m_Index.find(Key{archive, offset, size});
+  if (iter == m_Index.end()) {
+    ++m_Misses;
+    return Data();
+  }
+  ++m_Hits;
+  m_Entries.splice(m_Entries.begin(), m_Entries, iter->second);
+  return iter->second->second;
+}
+
+void FileCache::insert(uint64_t archive, BSAHash offset, BSAHash size,
+                       const Data& data)
+{
+  if (!data || data->empty() || (data->size() > m_Capacity)) {
+    return;
+  }
+
+  boost::lock_guard<boost::mutex> lock(m_Mutex);
+  Key key{archive, offset, size};
+  auto iter = m_Index.find(key);
+  if (iter != m_Index.end()) {
+    // another thread read the same file in the meantime
+    m_Size -= iter->second->second->size();
+    m_Entries.erase(iter->second);
+    m_Index.erase(iter);
+  }
+  m_Entries.push_front(std::make_pair(key, data));
+  m_Index[key] = m_Entries.begin();
+  m_Size += data->size();
+  evict();
+}
+
+void FileCache::remove(uint64_t archive)
+{
+  boost::lock_guard<boost::mutex> lock(m_Mutex);
+  for (EntryList::iterator iter = m_Entries.begin(); iter != m_Entries.end();) {
+    if (iter->first.archive == archive) {
+      m_Size -= iter->second->size();
+      m_Index.erase(iter->first);
+      iter = m_Entries.erase(iter);
+    } else {
+      ++iter;
+    }
+  }
+}
+
+void FileCache::clear()
+{
+  boost::lock_guard<boost::mutex> lock(m_Mutex);
+  m_Index.clear();
+  m_Entries.clear();
+  m_Size = 0ULL;
+}
+
+uint64_t FileCache::size() const
+{
+  boost::lock_guard<boost::mutex> lock(m_Mutex);
+  return m_Size;
+}
+
+void FileCache::evict()
+{
+  while (m_Size > m_Capacity) {
+    const std::pair<Key, Data>& oldest = m_Entries.back();
+    m_Size -= oldest.second->size();
+    m_Index.erase(oldest.first);
+    m_Entries.pop_back();
+  }
+}
+
+}  // namespace BSA
@@ -0,0 +1,158 @@
+/*
+Mod Organizer BSA handling
+
+Copyright (C) 2012 Sebastian Herbord. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef BSACACHE_H
+#define BSACACHE_H
+
+#include "bsatypes.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#ifndef Q_MOC_RUN
+#include <boost/thread/mutex.hpp>
+#endif  // Q_MOC_RUN
+
+namespace BSA
+{
+
+/**
+ * @brief keeps the decompressed content of recently read files in memory. Entries are
+ * keyed by the archive they come from and the offset and size of their data in it, so
+ * one cache can be shared by any number of archives and threads. Once the cached content
+ * exceeds the capacity the least recently used entries are dropped.
+ * The content is handed out as shared, immutable buffers that stay valid after their
+ * entry is dropped
+ */
+class FileCache
+{
+
+public:
+  typedef std::shared_ptr<FileCache> Ptr;
+  typedef std::shared_ptr<const std::vector<std::byte>> Data;
+
+public:
+  /**
+   * @param capacity upper limit for the bytes held by the cache
+   */
+  explicit FileCache(uint64_t capacity);
+
+  /**
+   * @return a key that identifies an opened archive within all caches
+   */
+  static uint64_t newArchiveKey();
+
+  /**
+   * look up a file and mark it as recently used
+   * @param archive key of the archive the file is in
+   * @param offset offset of the file data in the archive
+   * @param size size of the file data in the archive. Empty files may share their
+   *             offset with the file after them
+   * @return the cached content or an empty pointer
+   */
+  Data find(uint64_t archive, BSAHash offset, BSAHash size);
+  /**
+   * add the content of a file. Empty data and data larger than the capacity isn't
+   * cached
+   * @param archive key of the archive the file is in
+   * @param offset offset of the file data in the archive
+   * @param size size of the file data in the archive
+   * @param data the decompressed content
+   */
+  void insert(uint64_t archive, BSAHash offset, BSAHash size, const Data& data);
+  /**
+   * drop all entries of an archive, i.e. because it is closed
+   */
+  void remove(uint64_t archive);
+  /**
+   * drop all entries
+   */
+  void clear();
+
+  /**
+   * @return upper limit for the bytes held by the cache
+   */
+  uint64_t capacity() const { return m_Capacity; }
+  /**
+   * @return bytes currently held by the cache
+   */
+  uint64_t size() const;
+  /**
+   * @return number of lookups that found an entry
+   */
+  uint64_t hits() const { return m_Hits.load(); }
+  /**
+   * @return number of lookups that found nothing
+   */
+  uint64_t misses() const { return m_Misses.load(); }
+
+private:
+  struct Key
+  {
+    uint64_t archive;
+    BSAHash offset;
+    BSAHash size;
+
+    bool operator==(const Key& other) const
+    {
+      return (archive == other.archive) && (offset == other.offset) &&
+             (size == other.size);
+    }
+  };
+
+  struct KeyHash
+  {
+    size_t operator()(const Key& key) const
+    {
+      return static_cast<size_t>(key.offset ^ (key.size << 32) ^
+                                 (key.archive * 0x9E3779B97F4A7C15ULL));
+    }
+  };
+
+  typedef std::list<std::pair<Key, Data>> EntryList;
+
+private:
+  // copy constructor not implemented
+  FileCache(const FileCache& reference);
+
+  // assignment operator not implemented
+  FileCache& operator=(const FileCache& reference);
+
+  // drop the least recently used entries until the size is within the capacity. The
+  // mutex needs to be held
+  void evict();
+
+private:
+  mutable boost::mutex m_Mutex;
+  const uint64_t m_Capacity;
+  uint64_t m_Size;
+  // most recently used entries first
+  EntryList m_Entries;
+  std::unordered_map<Key, EntryList::iterator, KeyHash> m_Index;
+  std::atomic<uint64_t> m_Hits;
+  std::atomic<uint64_t> m_Misses;
+};
+
+}  // namespace BSA
+
+#endif  // BSACACHE_H
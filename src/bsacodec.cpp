@@ -0,0 +1,482 @@
+/*
+Mod Organizer BSA handling
+
+Copyright (C) 2012 Sebastian Herbord. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+
+#include "bsacodec.h"
+#include "bsasource.h"
+
+#include <algorithm>
+#include <bit>
+#include <boost/thread/lock_guard.hpp>
+#include <ostream>
+#include <lz4.h>
+#include <lz4frame.h>
+#include <zlib.h>
+
+namespace BSA
+{
+
+namespace
+{
+
+// z_stream of the current thread, initialized on first use
+struct InflateContext
+{
+  z_stream stream  = {};
+  bool initialized = false;
+
+  ~InflateContext()
+  {
+    if (initialized) {
+      inflateEnd(&stream);
+    }
+  }
+};
+
+// LZ4 frame decompression context of the current thread, created on first use
+struct LZ4FrameContext
+{
+  LZ4F_dctx* context = nullptr;
+
+  ~LZ4FrameContext()
+  {
+    if (context != nullptr) {
+      LZ4F_freeDecompressionContext(context);
+    }
+  }
+};
+
+// z_stream for compression of the current thread, initialized on first use
+struct DeflateContext
+{
+  z_stream stream  = {};
+  bool initialized = false;
+
+  ~DeflateContext()
+  {
+    if (initialized) {
+      deflateEnd(&stream);
+    }
+  }
+};
+
+// LZ4 frame compression context of the current thread, created on first use
+struct LZ4FrameCompressContext
+{
+  LZ4F_cctx* context = nullptr;
+
+  ~LZ4FrameCompressContext()
+  {
+    if (context != nullptr) {
+      LZ4F_freeCompressionContext(context);
+    }
+  }
+};
+
+thread_local InflateContext s_InflateContext;
+thread_local LZ4FrameContext s_LZ4FrameContext;
+thread_local DeflateContext s_DeflateContext;
+thread_local LZ4FrameCompressContext s_LZ4FrameCompressContext;
+
+// initialize or reset the z_stream of the current thread for a new stream
+EErrorCode prepareInflate()
+{
+  z_stream& stream = s_InflateContext.stream;
+  if (!s_InflateContext.initialized) {
+    if (inflateInit2(&stream, 15 + 32) != Z_OK) {
+      return ERROR_ZLIBINITFAILED;
+    }
+    s_InflateContext.initialized = true;
+  } else if (inflateReset(&stream) != Z_OK) {
+    return ERROR_ZLIBINITFAILED;
+  }
+  return ERROR_NONE;
+}
+
+// create the LZ4 frame decompression context of the current thread if necessary
+EErrorCode prepareLZ4Frame()
+{
+  LZ4F_dctx*& context = s_LZ4FrameContext.context;
+  if ((context == nullptr) &&
+      LZ4F_isError(LZ4F_createDecompressionContext(&context, LZ4F_VERSION))) {
+    context = nullptr;
+    return ERROR_INVALIDDATA;
+  }
+  return ERROR_NONE;
+}
+
+// hands out the compressed data of a file window by window. A mapped range is handed
+// out in one piece without copying
+class StreamInput
+{
+
+public:
+  StreamInput(const ArchiveSource& source, BSAHash offset, BSAULong size)
+      : m_Source(source), m_Offset(offset), m_Remaining(size)
+  {}
+
+  // @return false if the source couldn't be read, size is 0 once all data is consumed
+  bool next(const unsigned char*& data, size_t& size)
+  {
+    size = 0;
+    if (m_Remaining == 0) {
+      return true;
+    }
+    if (m_Source.isMapped()) {
+      data = m_Source.data(m_Offset, m_Remaining);
+      size = m_Remaining;
+    } else {
+      if (m_Window.get() == nullptr) {
+        m_Window = BufferPool::instance().allocate(STREAM_WINDOW_SIZE);
+      }
+      data = m_Window.get();
+      size = static_cast<size_t>((std::min)(m_Remaining, BSAULong(STREAM_WINDOW_SIZE)));
+      if (!m_Source.read(m_Offset, m_Window.get(), size)) {
+        data = nullptr;
+      }
+    }
+    if (data == nullptr) {
+      return false;
+    }
+    m_Offset += size;
+    m_Remaining -= static_cast<BSAULong>(size);
+    return true;
+  }
+
+private:
+  const ArchiveSource& m_Source;
+  BSAHash m_Offset;
+  BSAULong m_Remaining;
+  boost::shared_array<unsigned char> m_Window;
+};
+
+}  // namespace
+
+EErrorCode inflateInto(const unsigned char* inBuffer, BSAULong inSize,
+                       unsigned char* outBuffer, BSAULong outSize)
+{
+  EErrorCode result = prepareInflate();
+  if (result != ERROR_NONE) {
+    return result;
+  }
+
+  z_stream& stream = s_InflateContext.stream;
+  stream.avail_in  = inSize;
+  stream.next_in   = const_cast<Bytef*>(inBuffer);
+  stream.avail_out = outSize;
+  stream.next_out  = outBuffer;
+  inflate(&stream, Z_FINISH);
+  if (stream.avail_out != 0) {
+    // the stream ended before the expected amount of data was produced
+    return ERROR_INVALIDDATA;
+  }
+  return ERROR_NONE;
+}
+
+EErrorCode lz4FrameInto(const unsigned char* inBuffer, BSAULong inSize,
+                        unsigned char* outBuffer, BSAULong outSize)
+{
+  EErrorCode result = prepareLZ4Frame();
+  if (result != ERROR_NONE) {
+    return result;
+  }
+
+  LZ4F_dctx* context = s_LZ4FrameContext.context;
+  LZ4F_decompressOptions_t options = {};
+  size_t lzOutSize                 = outSize;
+  size_t lzInSize                  = inSize;
+  size_t lzRet = LZ4F_decompress(context, outBuffer, &lzOutSize, inBuffer, &lzInSize,
+                                 &options);
+  if (LZ4F_isError(lzRet) || (lzOutSize != outSize)) {
+    // the context is left in the middle of a frame
+    LZ4F_resetDecompressionContext(context);
+    return ERROR_INVALIDDATA;
+  }
+  if (lzRet != 0) {
+    // the frame has more data than expected, start over with the next one
+    LZ4F_resetDecompressionContext(context);
+  }
+  return ERROR_NONE;
+}
+
+EErrorCode lz4BlockInto(const unsigned char* inBuffer, BSAULong inSize,
+                        unsigned char* outBuffer, BSAULong outSize)
+{
+  int lzRet = LZ4_decompress_safe(reinterpret_cast<const char*>(inBuffer),
+                                  reinterpret_cast<char*>(outBuffer), inSize, outSize);
+  return (lzRet == static_cast<int>(outSize)) ? ERROR_NONE : ERROR_INVALIDDATA;
+}
+
+EErrorCode inflateStream(const ArchiveSource& source, BSAHash offset, BSAULong inSize,
+                         std::ostream& target, BSAULong outSize)
+{
+  EErrorCode result = prepareInflate();
+  if (result != ERROR_NONE) {
+    return result;
+  }
+
+  z_stream& stream = s_InflateContext.stream;
+  StreamInput input(source, offset, inSize);
+  boost::shared_array<unsigned char> window =
+      BufferPool::instance().allocate(STREAM_WINDOW_SIZE);
+  stream.avail_in  = 0;
+  BSAULong written = 0;
+  bool outputFull  = false;
+  int zlibRet      = Z_OK;
+  while ((written < outSize) && (zlibRet != Z_STREAM_END)) {
+    // a full output window may leave output pending even if all input is consumed
+    if ((stream.avail_in == 0) && !outputFull) {
+      const unsigned char* data = nullptr;
+      size_t size               = 0;
+      if (!input.next(data, size)) {
+        return ERROR_INVALIDDATA;
+      } else if (size == 0) {
+        // the compressed data ended before the expected amount was produced
+        break;
+      }
+      stream.next_in  = const_cast<Bytef*>(data);
+      stream.avail_in = static_cast<uInt>(size);
+    }
+    stream.next_out  = window.get();
+    stream.avail_out = static_cast<uInt>(STREAM_WINDOW_SIZE);
+    zlibRet          = inflate(&stream, Z_NO_FLUSH);
+    if ((zlibRet != Z_OK) && (zlibRet != Z_STREAM_END) && (zlibRet != Z_BUF_ERROR)) {
+      return ERROR_INVALIDDATA;
+    }
+    outputFull = stream.avail_out == 0;
+    // like inflateInto, anything past the expected size is ignored
+    BSAULong produced = static_cast<BSAULong>(STREAM_WINDOW_SIZE - stream.avail_out);
+    produced          = (std::min)(produced, outSize - written);
+    target.write(reinterpret_cast<const char*>(window.get()), produced);
+    written += produced;
+  }
+  if (!target.good()) {
+    return ERROR_ACCESSFAILED;
+  }
+  return (written == outSize) ? ERROR_NONE : ERROR_INVALIDDATA;
+}
+
+EErrorCode lz4FrameStream(const ArchiveSource& source, BSAHash offset,
+                          BSAULong inSize, std::ostream& target, BSAULong outSize)
+{
+  EErrorCode result = prepareLZ4Frame();
+  if (result != ERROR_NONE) {
+    return result;
+  }
+
+  LZ4F_dctx* context = s_LZ4FrameContext.context;
+  StreamInput input(source, offset, inSize);
+  boost::shared_array<unsigned char> window =
+      BufferPool::instance().allocate(STREAM_WINDOW_SIZE);
+  LZ4F_decompressOptions_t options = {};
+  const unsigned char* data        = nullptr;
+  size_t available                 = 0;
+  size_t lzRet                     = 1;
+  size_t lzOutSize                 = 0;
+  BSAULong written                 = 0;
+  while ((written < outSize) && (lzRet != 0)) {
+    // a full output window may leave output pending even if all input is consumed
+    if ((available == 0) && (lzOutSize < STREAM_WINDOW_SIZE)) {
+      if (!input.next(data, available)) {
+        result = ERROR_INVALIDDATA;
+        break;
+      } else if (available == 0) {
+        break;
+      }
+    }
+    size_t lzInSize = available;
+    lzOutSize       = STREAM_WINDOW_SIZE;
+    lzRet =
+        LZ4F_decompress(context, window.get(), &lzOutSize, data, &lzInSize, &options);
+    if (LZ4F_isError(lzRet)) {
+      result = ERROR_INVALIDDATA;
+      break;
+    }
+    data += lzInSize;
+    available -= lzInSize;
+    BSAULong produced = (std::min)(static_cast<BSAULong>(lzOutSize), outSize - written);
+    target.write(reinterpret_cast<const char*>(window.get()), produced);
+    written += produced;
+  }
+  if (lzRet != 0) {
+    // the context is left in the middle of a frame
+    LZ4F_resetDecompressionContext(context);
+  }
+  if (result != ERROR_NONE) {
+    return result;
+  } else if (!target.good()) {
+    return ERROR_ACCESSFAILED;
+  }
+  return (written == outSize) ? ERROR_NONE : ERROR_INVALIDDATA;
+}
+
+EErrorCode deflateBuffer(const unsigned char* inBuffer, BSAULong inSize,
+                         BSAULong headroom,
+                         boost::shared_array<unsigned char>& outBuffer,
+                         BSAULong& outSize)
+{
+  z_stream& stream = s_DeflateContext.stream;
+  if (!s_DeflateContext.initialized) {
+    if (deflateInit(&stream, Z_DEFAULT_COMPRESSION) != Z_OK) {
+      return ERROR_ZLIBINITFAILED;
+    }
+    s_DeflateContext.initialized = true;
+  } else if (deflateReset(&stream) != Z_OK) {
+    return ERROR_ZLIBINITFAILED;
+  }
+
+  BSAULong bound   = static_cast<BSAULong>(deflateBound(&stream, inSize));
+  outBuffer        = BufferPool::instance().allocate(headroom + bound);
+  stream.avail_in  = inSize;
+  stream.next_in   = const_cast<Bytef*>(inBuffer);
+  stream.avail_out = bound;
+  stream.next_out  = outBuffer.get() + headroom;
+  if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+    return ERROR_INVALIDDATA;
+  }
+  outSize = headroom + static_cast<BSAULong>(stream.total_out);
+  return ERROR_NONE;
+}
+
+EErrorCode lz4FrameBuffer(const unsigned char* inBuffer, BSAULong inSize,
+                          BSAULong headroom,
+                          boost::shared_array<unsigned char>& outBuffer,
+                          BSAULong& outSize)
+{
+  LZ4F_cctx*& context = s_LZ4FrameCompressContext.context;
+  if ((context == nullptr) &&
+      LZ4F_isError(LZ4F_createCompressionContext(&context, LZ4F_VERSION))) {
+    context = nullptr;
+    return ERROR_INVALIDDATA;
+  }
+
+  LZ4F_preferences_t preferences    = {};
+  preferences.frameInfo.contentSize = inSize;
+
+  size_t bound   = LZ4F_compressFrameBound(inSize, &preferences);
+  outBuffer      = BufferPool::instance().allocate(headroom + bound);
+  char* target   = reinterpret_cast<char*>(outBuffer.get() + headroom);
+  size_t written = LZ4F_compressBegin(context, target, bound, &preferences);
+  if (!LZ4F_isError(written)) {
+    size_t lzRet = LZ4F_compressUpdate(context, target + written, bound - written,
+                                       inBuffer, inSize, nullptr);
+    written      = LZ4F_isError(lzRet) ? lzRet : written + lzRet;
+  }
+  if (!LZ4F_isError(written)) {
+    size_t lzRet =
+        LZ4F_compressEnd(context, target + written, bound - written, nullptr);
+    written      = LZ4F_isError(lzRet) ? lzRet : written + lzRet;
+  }
+  if (LZ4F_isError(written)) {
+    // a failed frame leaves the context in an undefined state
+    LZ4F_freeCompressionContext(context);
+    context = nullptr;
+    return ERROR_INVALIDDATA;
+  }
+  outSize = headroom + static_cast<BSAULong>(written);
+  return ERROR_NONE;
+}
+
+EErrorCode lz4BlockBuffer(const unsigned char* inBuffer, BSAULong inSize,
+                          BSAULong headroom,
+                          boost::shared_array<unsigned char>& outBuffer,
+                          BSAULong& outSize)
+{
+  int bound = LZ4_compressBound(static_cast<int>(inSize));
+  if (bound <= 0) {
+    return ERROR_INVALIDDATA;
+  }
+  outBuffer = BufferPool::instance().allocate(headroom + bound);
+  int lzRet = LZ4_compress_default(reinterpret_cast<const char*>(inBuffer),
+                                   reinterpret_cast<char*>(outBuffer.get() + headroom),
+                                   static_cast<int>(inSize), bound);
+  if (lzRet <= 0) {
+    return ERROR_INVALIDDATA;
+  }
+  outSize = headroom + static_cast<BSAULong>(lzRet);
+  return ERROR_NONE;
+}
+
+struct BufferPool::Releaser
+{
+  BufferPool* pool;
+  unsigned int sizeClass;
+
+  void operator()(unsigned char* buffer) const { pool->release(buffer, sizeClass); }
+};
+
+BufferPool& BufferPool::instance()
+{
+  // never destroyed, buffers may still be released while static objects are torn down
+  static BufferPool* pool = new BufferPool();
+  return *pool;
+}
+
+BufferPool::BufferPool() {}
+
+BufferPool::~BufferPool()
+{
+  for (std::vector<unsigned char*>& buffers : m_FreeBuffers) {
+    for (unsigned char* buffer : buffers) {
+      delete[] buffer;
+    }
+  }
+}
+
+boost::shared_array<unsigned char> BufferPool::allocate(size_t size)
+{
+  unsigned int shift = (size <= (size_t(1) << MIN_CLASS_SHIFT))
+                           ? MIN_CLASS_SHIFT
+                           : static_cast<unsigned int>(std::bit_width(size - 1));
+  if (shift > MAX_CLASS_SHIFT) {
+    return boost::shared_array<unsigned char>(new unsigned char[size]);
+  }
+
+  unsigned int sizeClass = shift - MIN_CLASS_SHIFT;
+  unsigned char* buffer  = nullptr;
+  {
+    boost::lock_guard<boost::mutex> lock(m_Mutex);
+    std::vector<unsigned char*>& buffers = m_FreeBuffers[sizeClass];
+    if (!buffers.empty()) {
+      buffer = buffers.back();
+      buffers.pop_back();
+    }
+  }
+  if (buffer == nullptr) {
+    buffer = new unsigned char[size_t(1) << shift];
+  }
+  return boost::shared_array<unsigned char>(buffer, Releaser{this, sizeClass});
+}
+
+void BufferPool::release(unsigned char* buffer, unsigned int sizeClass)
+{
+  size_t maxBuffers = MAX_CACHED_BYTES >> (sizeClass + MIN_CLASS_SHIFT);
+  {
+    boost::lock_guard<boost::mutex> lock(m_Mutex);
+    std::vector<unsigned char*>& buffers = m_FreeBuffers[sizeClass];
+    if (buffers.size() < (std::max)(maxBuffers, size_t(1))) {
+      buffers.push_back(buffer);
+      return;
+    }
+  }
+  delete[] buffer;
+}
+
+}  // namespace BSA
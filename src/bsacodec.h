@@ -0,0 +1,191 @@
+/*
+Mod Organizer BSA handling
+
+Copyright (C) 2012 Sebastian Herbord. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+
+#ifndef BSACODEC_H
+#define BSACODEC_H
+
+#include "bsatypes.h"
+#include "errorcodes.h"
+#include <cstddef>
+#include <iosfwd>
+#include <vector>
+#ifndef Q_MOC_RUN
+#include <boost/shared_array.hpp>
+#include <boost/thread/mutex.hpp>
+#endif  // Q_MOC_RUN
+
+namespace BSA
+{
+
+class ArchiveSource;
+
+/**
+ * decompress a zlib or gzip stream. The z_stream is created once per thread and reset
+ * between calls
+ * @param inBuffer compressed data
+ * @param inSize size of the compressed data
+ * @param outBuffer buffer to decompress to
+ * @param outSize expected size of the decompressed data
+ * @return ERROR_NONE on success or an error code
+ */
+EErrorCode inflateInto(const unsigned char* inBuffer, BSAULong inSize,
+                       unsigned char* outBuffer, BSAULong outSize);
+
+/**
+ * decompress a LZ4 frame (Skyrim SE). The decompression context is created once per
+ * thread
+ * @see inflateInto
+ */
+EErrorCode lz4FrameInto(const unsigned char* inBuffer, BSAULong inSize,
+                        unsigned char* outBuffer, BSAULong outSize);
+
+/**
+ * decompress a raw LZ4 block (Starfield textures)
+ * @see inflateInto
+ */
+EErrorCode lz4BlockInto(const unsigned char* inBuffer, BSAULong inSize,
+                        unsigned char* outBuffer, BSAULong outSize);
+
+/**
+ * decompress a zlib or gzip stream from an archive straight into a stream. Data is
+ * passed through windows of STREAM_WINDOW_SIZE bytes so memory use doesn't depend on
+ * the size of the file. A mapped source is decompressed without copying the input
+ * @param source archive to read from
+ * @param offset offset of the compressed data in the archive
+ * @param inSize size of the compressed data
+ * @param target stream to write the decompressed data to
+ * @param outSize expected size of the decompressed data
+ * @return ERROR_NONE on success or an error code
+ */
+EErrorCode inflateStream(const ArchiveSource& source, BSAHash offset, BSAULong inSize,
+                         std::ostream& target, BSAULong outSize);
+
+/**
+ * decompress a LZ4 frame (Skyrim SE) from an archive straight into a stream
+ * @see inflateStream
+ */
+EErrorCode lz4FrameStream(const ArchiveSource& source, BSAHash offset,
+                          BSAULong inSize, std::ostream& target, BSAULong outSize);
+
+/// size of the input and output windows of the stream decompressors
+static const size_t STREAM_WINDOW_SIZE = 1024 * 1024;
+
+/// the most data the codecs produce per byte of input. Deflate can't exceed 1032:1,
+/// LZ4 stays below 256:1
+static const BSAHash MAX_EXPANSION = 1032;
+
+/**
+ * check a decompressed size read from an archive before a buffer that large is
+ * allocated for it
+ * @param inSize size of the compressed data
+ * @param outSize size the data is supposed to decompress to
+ * @return true if the codecs could produce outSize bytes from inSize bytes
+ */
+inline bool plausibleUnpackedSize(BSAHash inSize, BSAHash outSize)
+{
+  return outSize <= inSize * MAX_EXPANSION;
+}
+
+/**
+ * compress data into a zlib stream. The z_stream is created once per thread and reset
+ * between calls
+ * @param inBuffer data to compress
+ * @param inSize size of the data
+ * @param headroom number of bytes left free in front of the compressed data, e.g. for
+ *        the name and size stored in front of a file
+ * @param outBuffer receives the buffer holding the compressed data
+ * @param outSize receives the size of the compressed data including the headroom
+ * @return ERROR_NONE on success or an error code
+ */
+EErrorCode deflateBuffer(const unsigned char* inBuffer, BSAULong inSize,
+                         BSAULong headroom,
+                         boost::shared_array<unsigned char>& outBuffer,
+                         BSAULong& outSize);
+
+/**
+ * compress data into a LZ4 frame (Skyrim SE). The compression context is created once
+ * per thread
+ * @see deflateBuffer
+ */
+EErrorCode lz4FrameBuffer(const unsigned char* inBuffer, BSAULong inSize,
+                          BSAULong headroom,
+                          boost::shared_array<unsigned char>& outBuffer,
+                          BSAULong& outSize);
+
+/**
+ * compress data into a raw LZ4 block (Starfield textures)
+ * @see deflateBuffer
+ */
+EErrorCode lz4BlockBuffer(const unsigned char* inBuffer, BSAULong inSize,
+                          BSAULong headroom,
+                          boost::shared_array<unsigned char>& outBuffer,
+                          BSAULong& outSize);
+
+/**
+ * @brief recycles the buffers file data is read and decompressed into. Buffers are
+ * grouped in power-of-two size classes, a buffer handed out by allocate returns to its
+ * class once the last reference to it is released, no matter which thread that happens
+ * on
+ */
+class BufferPool
+{
+
+public:
+  /**
+   * @return the pool shared by all archives
+   */
+  static BufferPool& instance();
+
+  /**
+   * @param size minimum size of the buffer
+   * @return a buffer of at least size bytes. The content is undefined
+   */
+  boost::shared_array<unsigned char> allocate(size_t size);
+
+private:
+  // smallest and largest pooled size class, larger buffers are allocated directly
+  static const unsigned int MIN_CLASS_SHIFT = 12;
+  static const unsigned int MAX_CLASS_SHIFT = 24;
+  // upper limit for the memory kept around by each size class
+  static const size_t MAX_CACHED_BYTES = 16 * 1024 * 1024;
+
+  struct Releaser;
+
+private:
+  BufferPool();
+  ~BufferPool();
+
+  // copy constructor not implemented
+  BufferPool(const BufferPool& reference);
+
+  // assignment operator not implemented
+  BufferPool& operator=(const BufferPool& reference);
+
+  void release(unsigned char* buffer, unsigned int sizeClass);
+
+private:
+  boost::mutex m_Mutex;
+  std::vector<unsigned char*> m_FreeBuffers[MAX_CLASS_SHIFT - MIN_CLASS_SHIFT + 1];
+};
+
+}  // namespace BSA
+
+#endif  // BSACODEC_H
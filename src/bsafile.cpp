@@ -22,15 +22,10 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include "bsaexception.h"
 #include "bsafolder.h"
 #include "filehash.h"
-#include <algorithm>
 #include <climits>
-#include <cstring>
 #include <memory>
-#include <stdexcept>
 
 using std::fstream;
-using std::ifstream;
-using std::ofstream;
 
 namespace BSA
 {
@@ -40,113 +35,267 @@ bool ByOffset(const File::Ptr& LHS, const File::Ptr& RHS)
   return LHS->getDataOffset() < RHS->getDataOffset();
 }
 
-static const unsigned long CHUNK_SIZE = 128 * 1024;
+FileTable::FileTable() {}
 
-File::File(std::fstream& file, Folder* folder)
-    : m_Folder(folder), m_New(false), m_FileSize(0), m_UncompressedFileSize(0),
-      m_ToggleCompressedWrite(false), m_DataOffsetWrite(0)
+File::Ptr FileTable::create(const BSAFileRecord& record, Folder* folder)
 {
-  m_NameHash         = readType<BSAHash>(file);
-  m_FileSize         = readType<BSAULong>(file);
-  m_DataOffset       = readType<BSAULong>(file);
-  m_ToggleCompressed = m_FileSize & COMPRESSMASK;
-  m_FileSize         = m_FileSize & SIZEMASK;
+  return view(append(folder, record.nameHash, record.size & File::SIZEMASK,
+                     record.offset, 0, (record.size & File::COMPRESSMASK) != 0));
 }
 
-File::File(const std::string& name, Folder* folder, BSAULong fileSize,
-           BSAHash dataOffset, BSAULong uncompressedFileSize, FO4TextureHeader header,
-           std::vector<FO4TextureChunk>& texChunks)
-    : m_Folder(folder), m_New(false), m_Name(name), m_FileSize(fileSize),
-      m_UncompressedFileSize(uncompressedFileSize), m_DataOffset(dataOffset),
-      m_TextureHeader(header), m_ToggleCompressedWrite(false),
-      m_TextureChunks(texChunks), m_DataOffsetWrite(0)
+File::Ptr FileTable::create(const std::string& name, Folder* folder, BSAULong fileSize,
+                            BSAHash dataOffset, BSAULong uncompressedFileSize,
+                            FO4TextureHeader header, BSAUInt firstChunk,
+                            BSAUInt chunkCount)
 {
-  m_NameHash         = calculateBSAHash(name);
-  m_ToggleCompressed = false;
-  if (m_FileSize > 0 && m_UncompressedFileSize > 0)
-    m_ToggleCompressed = true;
+  BSAUInt index = append(folder, calculateBSAHash(name), fileSize, dataOffset,
+                         uncompressedFileSize,
+                         (fileSize > 0) && (uncompressedFileSize > 0));
+  setName(index, name);
+  if (chunkCount != 0) {
+    setTexture(index, header, firstChunk, chunkCount, 0);
+  }
+  return view(index);
+}
+
+File::Ptr FileTable::create(const std::string& name, const std::string& sourceFile,
+                            Folder* folder, bool toggleCompressed)
+{
+  BSAUInt index = append(folder, calculateBSAHash(name), 0, 0, 0, toggleCompressed);
+  setName(index, name);
+  m_SourceFiles[index] = sourceFile;
+  return view(index);
+}
+
+BSAUInt FileTable::append(Folder* folder, BSAHash nameHash, BSAULong fileSize,
+                          BSAHash dataOffset, BSAULong uncompressedFileSize,
+                          bool toggleCompressed)
+{
+  if (m_NameHashes.size() >= UINT_MAX) {
+    throw data_invalid_exception("too many files");
+  }
+  BSAUInt index = static_cast<BSAUInt>(m_NameHashes.size());
+  m_NameHashes.push_back(nameHash);
+  m_DataOffsets.push_back(dataOffset);
+  m_FileSizes.push_back(fileSize);
+  m_UncompressedFileSizes.push_back(uncompressedFileSize);
+  m_NameRefs.push_back({0, 0});
+  m_Folders.push_back(folder);
+  m_Flags.push_back(toggleCompressed
+                        ? (FLAG_COMPRESSTOGGLED | FLAG_COMPRESSTOGGLEDWRITE)
+                        : 0);
+  m_TextureIndices.push_back(NO_TEXTURE);
+  return index;
+}
+
+File::Ptr FileTable::view(BSAUInt index)
+{
+  return std::make_shared<File>(File::Token(), shared_from_this(), index);
 }
 
-File::File(const std::string& name, const std::string& sourceFile, Folder* folder,
-           bool toggleCompressed)
-    : m_Folder(folder), m_New(true), m_Name(name), m_FileSize(0),
-      m_UncompressedFileSize(0), m_DataOffset(0), m_ToggleCompressed(toggleCompressed),
-      m_SourceFile(sourceFile), m_ToggleCompressedWrite(toggleCompressed),
-      m_DataOffsetWrite(0)
+void FileTable::setName(BSAUInt index, std::string_view name)
 {
-  m_NameHash = calculateBSAHash(name);
+  if (m_Names.size() + name.size() > UINT_MAX) {
+    throw data_invalid_exception("file names too long");
+  }
+  m_NameRefs[index] = {static_cast<BSAUInt>(m_Names.size()),
+                       static_cast<BSAUInt>(name.size())};
+  m_Names.append(name);
+}
+
+void FileTable::setTexture(BSAUInt index, const FO4TextureHeader& header,
+                           BSAUInt firstChunk, BSAUInt chunkCount,
+                           BSAHash recordOffset)
+{
+  m_TextureIndices[index] = static_cast<BSAUInt>(m_Textures.size());
+  m_Textures.push_back({header, firstChunk, chunkCount});
+  m_TextureRecordOffsets.emplace_back(recordOffset);
+}
+
+File::File(Token, std::shared_ptr<FileTable> table, BSAUInt index)
+    : m_Table(std::move(table)), m_Index(index)
+{}
+
+std::string_view File::getNameView() const
+{
+  const FileTable::NameRef& name = m_Table->m_NameRefs[m_Index];
+  return std::string_view(m_Table->m_Names).substr(name.offset, name.length);
 }
 
 std::string File::getFilePath() const
 {
-  return m_Folder->getFullPath() + "\\" + m_Name;
+  return getFolder()->getFullPath() + "\\" + getName();
+}
+
+BSAULong File::getFileSize() const
+{
+  return m_Table->m_FileSizes[m_Index];
+}
+
+BSAULong File::getUncompressedFileSize() const
+{
+  return m_Table->m_UncompressedFileSizes[m_Index];
+}
+
+bool File::compressToggled() const
+{
+  return (m_Table->m_Flags[m_Index] & FileTable::FLAG_COMPRESSTOGGLED) != 0;
+}
+
+BSAHash File::getDataOffset() const
+{
+  return m_Table->m_DataOffsets[m_Index];
 }
 
 void File::writeHeader(fstream& file) const
 {
-  writeType<BSAHash>(file, m_NameHash);
-  BSAULong size = m_FileSize;
-  if (m_ToggleCompressed) {
+  writeType<BSAHash>(file, getNameHash());
+  BSAULong size = getFileSizeWrite();
+  if (compressToggledWrite()) {
     size |= (1 << 30);
   }
   writeType<BSAULong>(file, size);
-  writeType<BSAULong>(file, m_DataOffsetWrite);
+  writeType<BSAULong>(file, getDataOffsetWrite());
+}
+
+void File::setFileSize(BSAULong fileSize)
+{
+  m_Table->m_FileSizes[m_Index] = fileSize;
+}
+
+void File::readFileName(const unsigned char*& pos, const unsigned char* end)
+{
+  setName(readZString(pos, end));
+}
+
+void File::setName(std::string_view name)
+{
+  m_Table->setName(m_Index, name);
+}
+
+BSAHash File::getNameHash() const
+{
+  return m_Table->m_NameHashes[m_Index];
+}
+
+Folder* File::getFolder() const
+{
+  return m_Table->m_Folders[m_Index];
+}
+
+void File::setFolder(Folder* folder)
+{
+  m_Table->m_Folders[m_Index] = folder;
+}
+
+void File::setUncompressedFileSize(BSAULong size)
+{
+  m_Table->m_UncompressedFileSizes[m_Index] = size;
 }
 
-EErrorCode File::writeData(fstream& sourceArchive, fstream& targetArchive) const
+void File::setDataOffset(BSAHash dataOffset)
 {
-  m_DataOffsetWrite = static_cast<BSAULong>(targetArchive.tellp());
-  EErrorCode result = ERROR_NONE;
+  m_Table->m_DataOffsets[m_Index] = dataOffset;
+}
 
-  std::unique_ptr<char[]> inBuffer(new char[CHUNK_SIZE]);
+void File::setCompressToggled(bool toggleCompressed)
+{
+  m_Table->m_Flags[m_Index] =
+      toggleCompressed
+          ? (FileTable::FLAG_COMPRESSTOGGLED | FileTable::FLAG_COMPRESSTOGGLEDWRITE)
+          : 0;
+}
 
-  if (m_SourceFile.length() == 0) {
-    // copy from source archive
-#pragma message("we may have to compress/decompress!")
-    sourceArchive.seekg(m_DataOffset, fstream::beg);
+const std::string& File::getSourceFile() const
+{
+  static const std::string none;
+  auto iter = m_Table->m_SourceFiles.find(m_Index);
+  return (iter != m_Table->m_SourceFiles.end()) ? iter->second : none;
+}
 
-    try {
-      unsigned long sizeLeft = m_FileSize;
-      while (sizeLeft > 0) {
-        int chunkSize = (std::min)(sizeLeft, CHUNK_SIZE);
-        sourceArchive.read(inBuffer.get(), chunkSize);
-        targetArchive.write(inBuffer.get(), chunkSize);
-        sizeLeft -= chunkSize;
-      }
-    } catch (const std::exception&) {
-      result = ERROR_INVALIDDATA;
-    }
+void File::setSourceFile(const std::string& sourceFile)
+{
+  if (sourceFile.empty()) {
+    m_Table->m_SourceFiles.erase(m_Index);
   } else {
-    // copy from file on disc
-    fstream sourceFile;
-    sourceFile.open(m_SourceFile.c_str());
-    if (!sourceFile.is_open()) {
-      return ERROR_SOURCEFILEMISSING;
-    }
-    sourceFile.seekg(0, fstream::end);
-    m_FileSize             = static_cast<BSAULong>(sourceFile.tellg());
-    unsigned long sizeLeft = m_FileSize;
-    sourceFile.seekg(0, fstream::beg);
-    while (sizeLeft > 0) {
-      int chunkSize = (std::min)(sizeLeft, CHUNK_SIZE);
-      sourceFile.read(inBuffer.get(), chunkSize);
-      targetArchive.write(inBuffer.get(), chunkSize);
-      sizeLeft -= chunkSize;
-    }
+    m_Table->m_SourceFiles[m_Index] = sourceFile;
   }
-  return result;
 }
 
-void File::readFileName(fstream& file, bool testHashes)
+bool File::compressToggledWrite() const
+{
+  return (m_Table->m_Flags[m_Index] & FileTable::FLAG_COMPRESSTOGGLEDWRITE) != 0;
+}
+
+void File::setCompressToggledWrite(bool toggleCompressed)
 {
-  m_Name = readZString(file);
-  if (testHashes) {
-    if (calculateBSAHash(m_Name) != m_NameHash) {
-      throw data_invalid_exception(
-          makeString("invalid name hash for \"%s\" (%lx vs %lx)", m_Name.c_str(),
-                     calculateBSAHash(m_Name), m_NameHash));
-    }
+  if (toggleCompressed) {
+    m_Table->m_Flags[m_Index] |= FileTable::FLAG_COMPRESSTOGGLEDWRITE;
+  } else {
+    m_Table->m_Flags[m_Index] &= ~FileTable::FLAG_COMPRESSTOGGLEDWRITE;
   }
 }
 
+void File::setWritePosition(BSAULong dataOffset, BSAULong fileSize)
+{
+  std::vector<FileTable::WritePosition>& positions = m_Table->m_WritePositions;
+  if (positions.size() <= m_Index) {
+    positions.resize(m_Table->m_NameHashes.size(), {0, 0});
+  }
+  positions[m_Index] = {dataOffset, fileSize};
+}
+
+BSAULong File::getDataOffsetWrite() const
+{
+  const std::vector<FileTable::WritePosition>& positions = m_Table->m_WritePositions;
+  return (m_Index < positions.size()) ? positions[m_Index].dataOffset : 0;
+}
+
+BSAULong File::getFileSizeWrite() const
+{
+  const std::vector<FileTable::WritePosition>& positions = m_Table->m_WritePositions;
+  return (m_Index < positions.size()) ? positions[m_Index].fileSize : 0;
+}
+
+BSAUInt File::getFirstChunk() const
+{
+  BSAUInt texture = m_Table->m_TextureIndices[m_Index];
+  return (texture != FileTable::NO_TEXTURE) ? m_Table->m_Textures[texture].firstChunk
+                                            : 0;
+}
+
+BSAUInt File::getChunkCount() const
+{
+  BSAUInt texture = m_Table->m_TextureIndices[m_Index];
+  return (texture != FileTable::NO_TEXTURE) ? m_Table->m_Textures[texture].chunkCount
+                                            : 0;
+}
+
+const FO4TextureHeader& File::getTextureHeader() const
+{
+  static const FO4TextureHeader none = {};
+  BSAUInt texture = m_Table->m_TextureIndices[m_Index];
+  return (texture != FileTable::NO_TEXTURE) ? m_Table->m_Textures[texture].header
+                                            : none;
+}
+
+void File::setTextureHeader(const FO4TextureHeader& header)
+{
+  m_Table->m_Textures[m_Table->m_TextureIndices[m_Index]].header = header;
+}
+
+BSAHash File::getTextureRecordOffset(std::memory_order order) const
+{
+  BSAUInt texture = m_Table->m_TextureIndices[m_Index];
+  return (texture != FileTable::NO_TEXTURE)
+             ? m_Table->m_TextureRecordOffsets[texture].load(order)
+             : 0ULL;
+}
+
+void File::setTextureRecordOffset(BSAHash offset, std::memory_order order)
+{
+  m_Table->m_TextureRecordOffsets[m_Table->m_TextureIndices[m_Index]].store(offset,
+                                                                           order);
+}
+
 }  // namespace BSA
@@ -23,20 +23,31 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include "errorcodes.h"
 #include "filehash.h"
+#include <atomic>
+#include <deque>
 #include <fstream>
 #include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
 namespace BSA
 {
 
 class Folder;
+class FileTable;
 
+/**
+ * @brief a file of an archive. This is a view of one entry in the FileTable of the
+ * archive, it stores no data of its own
+ */
 class File
 {
 
   friend class Folder;
   friend class Archive;
+  friend class FileTable;
 
 public:
   typedef std::shared_ptr<File> Ptr;
@@ -46,11 +57,24 @@ private:
   static const unsigned int SIZEMASK     = 0x3fffffff;
   static const unsigned int COMPRESSMASK = 0xC0000000;
 
+  // restricts construction to the FileTable while still allowing std::make_shared
+  struct Token
+  {
+    explicit Token() = default;
+  };
+
 public:
+  File(Token, std::shared_ptr<FileTable> table, BSAUInt index);
+
   /**
    * @return the name of the file
    */
-  const std::string& getName() const { return m_Name; }
+  std::string getName() const { return std::string(getNameView()); }
+  /**
+   * @return the name of the file without copying it. The view points into the name
+   *         pool of the archive and is only valid until files are added to it
+   */
+  std::string_view getNameView() const;
   /**
    * @return full path of this file within the archive
    */
@@ -59,9 +83,9 @@ public:
    * @return size of the file. If the source is an archive and the file is
    *         compressed, this returns the compressed size!
    */
-  BSAULong getFileSize() const { return m_FileSize; }
+  BSAULong getFileSize() const;
 
-  BSAULong getUncompressedFileSize() const { return m_UncompressedFileSize; }
+  BSAULong getUncompressedFileSize() const;
 
 private:
   // copy constructor not implemented
@@ -71,73 +95,197 @@ private:
   File& operator=(const File& reference);
 
   /**
-   * construct file from source archive
-   * @param file a file read from
-   * @param folder the folder to add the file to
-   * @param type the archive type we're parsing
+   * @return true if its compression mode for this file differs from the archive default
+   */
+  bool compressToggled() const;
+
+  /**
+   * @return offset to the file data. Only valid if the source of the file is
+   *         an archive
+   */
+  BSAHash getDataOffset() const;
+  /**
+   * write the file record. setWritePosition needs to be called by the archive first
+   */
+  void writeHeader(std::fstream& file) const;
+
+  void setFileSize(BSAULong fileSize);
+
+  /**
+   * read the name of the file from the file name table
+   * @param pos position in the name table, advanced past the name
+   * @param end end of the name table
+   * @throw data_invalid_exception if the name can't be read
+   */
+  void readFileName(const unsigned char*& pos, const unsigned char* end);
+
+  void setName(std::string_view name);
+  BSAHash getNameHash() const;
+  Folder* getFolder() const;
+  void setFolder(Folder* folder);
+  void setUncompressedFileSize(BSAULong size);
+  void setDataOffset(BSAHash dataOffset);
+  void setCompressToggled(bool toggleCompressed);
+
+  /**
+   * @return the file to read the data from when writing the archive, empty if the data
+   *         comes from the archive read
+   */
+  const std::string& getSourceFile() const;
+  void setSourceFile(const std::string& sourceFile);
+  bool compressToggledWrite() const;
+  void setCompressToggledWrite(bool toggleCompressed);
+
+  /**
+   * set the size and position of the data in the archive being written
+   */
+  void setWritePosition(BSAULong dataOffset, BSAULong fileSize);
+  BSAULong getDataOffsetWrite() const;
+  BSAULong getFileSizeWrite() const;
+
+  // range of the chunks of a texture in the chunk table of the archive, empty if the
+  // file isn't a texture
+  BSAUInt getFirstChunk() const;
+  BSAUInt getChunkCount() const;
+  const FO4TextureHeader& getTextureHeader() const;
+  void setTextureHeader(const FO4TextureHeader& header);
+  /**
+   * @return offset of the texture record while header and chunks haven't been read, 0
+   *         otherwise
+   */
+  BSAHash getTextureRecordOffset(std::memory_order order) const;
+  void setTextureRecordOffset(BSAHash offset, std::memory_order order);
+
+private:
+  std::shared_ptr<FileTable> m_Table;
+  BSAUInt m_Index;
+};
+
+extern bool ByOffset(const File::Ptr& LHS, const File::Ptr& RHS);
+
+/**
+ * @brief storage for the files of an archive. Each property is kept in an array with
+ * one entry per file and the names are concatenated into a single string. Texture
+ * information and the data only needed for writing are kept in separate tables, so
+ * files that don't use them don't pay for them.
+ * The File objects handed out are views with their own reference count. They keep the
+ * table alive
+ */
+class FileTable : public std::enable_shared_from_this<FileTable>
+{
+
+  friend class File;
+  friend class Archive;
+
+public:
+  FileTable();
+
+  /**
+   * add a file from a bsa archive
+   * @param record the file record as stored in the archive
+   * @param folder the folder the file is in
    */
-  File(std::fstream& file, Folder* folder);
+  File::Ptr create(const BSAFileRecord& record, Folder* folder);
 
   /**
-   * construct file from morrowind BSA or BA2
+   * add a file from a morrowind BSA or BA2
    * @param name of the base file from source archive
-   * @param folder the folder to add the file to
+   * @param folder the folder the file is in
    * @param fileSize the file size of the file in the archive
    * @param dataOffset the offset of the file data in the archive
-   * @param toggleCompressed the detected compression mode of the archive
+   * @param firstChunk index of the first texture chunk in the chunk table of the
+   *                   archive
+   * @param chunkCount number of texture chunks, 0 if the file isn't a texture
    */
-  File(const std::string& name, Folder* folder, BSAULong fileSizee, BSAHash dataOffset,
-       BSAULong uncompressedFileSize, FO4TextureHeader header,
-       std::vector<FO4TextureChunk>& texChunks);
+  File::Ptr create(const std::string& name, Folder* folder, BSAULong fileSize,
+                   BSAHash dataOffset, BSAULong uncompressedFileSize,
+                   FO4TextureHeader header, BSAUInt firstChunk, BSAUInt chunkCount);
 
   /**
-   * construct from loose file
+   * add a loose file
    * @param name the base name of the file inside the archive
    * @param sourceFile the file to read from
-   * @param folder the folder to add the file to
+   * @param folder the folder the file is in
    * @param toggleCompressed if true, the default compression mode of the
    *                         archive is overwritten
    */
-  File(const std::string& name, const std::string& sourceFile, Folder* folder,
-       bool toggleCompressed);
+  File::Ptr create(const std::string& name, const std::string& sourceFile,
+                   Folder* folder, bool toggleCompressed);
+
+private:
+  // copy constructor not implemented
+  FileTable(const FileTable& reference);
+
+  // assignment operator not implemented
+  FileTable& operator=(const FileTable& reference);
 
   /**
-   * @return true if its compression mode for this file differs from the archive default
+   * append an entry to the per-file arrays
+   * @return the index of the new entry
    */
-  bool compressToggled() const { return m_ToggleCompressed; }
+  BSAUInt append(Folder* folder, BSAHash nameHash, BSAULong fileSize,
+                 BSAHash dataOffset, BSAULong uncompressedFileSize,
+                 bool toggleCompressed);
+
+  File::Ptr view(BSAUInt index);
+
+  void setName(BSAUInt index, std::string_view name);
 
   /**
-   * @return offset to the file data. Only valid if the source of the file is
-   *         an archive
+   * turn a file into a texture
    */
-  BSAHash getDataOffset() const { return m_DataOffset; }
-  void writeHeader(std::fstream& file) const;
-  EErrorCode writeData(std::fstream& sourceArchive, std::fstream& targetArchive) const;
+  void setTexture(BSAUInt index, const FO4TextureHeader& header, BSAUInt firstChunk,
+                  BSAUInt chunkCount, BSAHash recordOffset);
 
-  void setFileSize(BSAULong fileSize) { m_FileSize = fileSize; }
+private:
+  static const BSAUInt NO_TEXTURE = 0xFFFFFFFF;
 
-  void readFileName(std::fstream& file, bool testHashes);
+  enum Flags : unsigned char
+  {
+    FLAG_COMPRESSTOGGLED      = 0x01,
+    FLAG_COMPRESSTOGGLEDWRITE = 0x02
+  };
 
-private:
-  Folder* m_Folder;
-  bool m_New;
-
-  BSAHash m_NameHash;
-  std::string m_Name;
-  mutable BSAULong m_FileSize;
-  mutable BSAULong m_UncompressedFileSize;
-  BSAHash m_DataOffset;
-  bool m_ToggleCompressed;
-
-  FO4TextureHeader m_TextureHeader = {};
-  std::vector<FO4TextureChunk> m_TextureChunks;
-
-  std::string m_SourceFile;
-  bool m_ToggleCompressedWrite;
-  mutable BSAULong m_DataOffsetWrite;
-};
+  struct NameRef
+  {
+    BSAUInt offset;
+    BSAUInt length;
+  };
 
-extern bool ByOffset(const File::Ptr& LHS, const File::Ptr& RHS);
+  struct Texture
+  {
+    FO4TextureHeader header;
+    BSAUInt firstChunk;
+    BSAUInt chunkCount;
+  };
+
+  struct WritePosition
+  {
+    BSAULong dataOffset;
+    BSAULong fileSize;
+  };
+
+  // one entry per file
+  std::vector<BSAHash> m_NameHashes;
+  std::vector<BSAHash> m_DataOffsets;
+  std::vector<BSAULong> m_FileSizes;
+  std::vector<BSAULong> m_UncompressedFileSizes;
+  std::vector<NameRef> m_NameRefs;
+  std::vector<Folder*> m_Folders;
+  std::vector<unsigned char> m_Flags;
+  std::vector<BSAUInt> m_TextureIndices;
+
+  std::string m_Names;
+
+  // one entry per texture. The record offsets are atomic because the texture records of
+  // lazily opened archives are read on first use, so the deque keeps them in place
+  std::vector<Texture> m_Textures;
+  std::deque<std::atomic<BSAHash>> m_TextureRecordOffsets;
+
+  // only filled in while the archive is written
+  std::vector<WritePosition> m_WritePositions;
+  std::unordered_map<BSAUInt, std::string> m_SourceFiles;
+};
 
 }  // namespace BSA
 
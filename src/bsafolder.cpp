@@ -18,6 +18,8 @@ License along with this library; if not, write to the Free Software
 Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 */
 
+#include <algorithm>
+#include <cctype>
 #include <filesystem>
 #include <limits.h>
 
@@ -38,87 +40,64 @@ Folder::Folder() : m_Parent(nullptr), m_Name()
   m_Offset    = ULONG_MAX;
 }
 
-Folder::Ptr Folder::readFolder(std::fstream& file, BSAUInt fileNamesLength,
-                               BSAUInt& endPos)
+Folder::Ptr Folder::readFolder(BSAHash nameHash, BSAULong fileCount, BSAHash offset,
+                               const unsigned char* directory,
+                               const unsigned char* directoryEnd,
+                               BSAUInt fileNamesLength, BSAHash& endPos,
+                               FileTable& fileTable)
 {
   Folder::Ptr result(new Folder());
-  result->m_NameHash  = readType<BSAHash>(file);
-  result->m_FileCount = readType<unsigned long>(file);
-  result->m_Offset    = readType<unsigned long>(file);
-  std::streamoff pos  = file.tellg();
-
-  file.seekg(result->m_Offset - fileNamesLength, fstream::beg);
-
-  result->m_Name = readBString(file);
-
-  for (unsigned long i = 0UL; i < result->m_FileCount; ++i) {
-    result->m_Files.push_back(File::Ptr(new File(file, result.get())));
-  }
-
-  if (static_cast<unsigned long>(file.tellg()) > endPos) {
-    endPos = static_cast<BSAULong>(file.tellg());
+  result->m_NameHash  = nameHash;
+  result->m_FileCount = fileCount;
+  result->m_Offset    = offset;
+
+  // the stored offset points past the file names
+  if ((offset < fileNamesLength) ||
+      (offset - fileNamesLength > static_cast<BSAHash>(directoryEnd - directory))) {
+    throw data_invalid_exception("invalid folder offset");
   }
+  const unsigned char* pos = directory + (offset - fileNamesLength);
 
-  file.seekg(pos);
-
-  return result;
-}
-
-Folder::Ptr Folder::readFolderSE(std::fstream& file, BSAUInt fileNamesLength,
-                                 BSAUInt& endPos)
-{
-  Folder::Ptr result(new Folder());
-  result->m_NameHash  = readType<BSAHash>(file);
-  result->m_FileCount = readType<BSAUInt>(file);
-  readType<BSAUInt>(file);
-  result->m_Offset   = readType<BSAHash>(file);
-  std::streamoff pos = file.tellg();
-
-  file.seekg(result->m_Offset - fileNamesLength, fstream::beg);
-
-  result->m_Name = readBString(file);
+  result->m_Name = readBString(pos, directoryEnd);
 
+  result->m_Files.reserve((std::min)(
+      static_cast<size_t>(fileCount),
+      static_cast<size_t>(directoryEnd - pos) / sizeof(BSAFileRecord)));
   for (unsigned long i = 0UL; i < result->m_FileCount; ++i) {
-    result->m_Files.push_back(File::Ptr(new File(file, result.get())));
+    result->m_Files.push_back(
+        fileTable.create(readType<BSAFileRecord>(pos, directoryEnd), result.get()));
   }
 
-  if (static_cast<unsigned long>(file.tellg()) > endPos) {
-    endPos = static_cast<BSAULong>(file.tellg());
+  if (static_cast<BSAHash>(pos - directory) > endPos) {
+    endPos = static_cast<BSAHash>(pos - directory);
   }
 
-  file.seekg(pos);
-
   return result;
 }
 
-void Folder::writeHeader(std::fstream& file) const
+void Folder::writeHeader(std::fstream& file, ArchiveType type) const
 {
   writeType<BSAHash>(file, m_NameHash);
   writeType<BSAULong>(file, static_cast<BSAULong>(m_Files.size()));
-  writeType<BSAULong>(file, m_OffsetWrite);
-}
-
-void Folder::writeData(std::fstream& file, BSAULong fileNamesLength) const
-{
-  m_OffsetWrite = static_cast<BSAULong>(file.tellp()) + fileNamesLength;
-  writeBString(file, getFullPath());
-  for (std::vector<File::Ptr>::const_iterator iter = m_Files.begin();
-       iter != m_Files.end(); ++iter) {
-    (*iter)->writeHeader(file);
+  if (type == TYPE_SKYRIMSE) {
+    // Skyrim SE pads the record and uses a 64 bit offset
+    writeType<BSAUInt>(file, 0U);
+    writeType<BSAHash>(file, m_OffsetWrite);
+  } else {
+    writeType<BSAUInt>(file, static_cast<BSAUInt>(m_OffsetWrite));
   }
 }
 
-EErrorCode Folder::writeFileData(std::fstream& sourceFile,
-                                 std::fstream& targetFile) const
+void Folder::writeData(std::fstream& file, const std::string& fullPath,
+                       bool writeName) const
 {
+  if (writeName) {
+    writeBString(file, fullPath);
+  }
   for (std::vector<File::Ptr>::const_iterator iter = m_Files.begin();
        iter != m_Files.end(); ++iter) {
-    EErrorCode error = (*iter)->writeData(sourceFile, targetFile);
-    if (error != ERROR_NONE) {
-      return error;
-    }
+    (*iter)->writeHeader(file);
   }
-  return ERROR_NONE;
 }
 
 std::string Folder::getFullPath() const
@@ -136,99 +115,113 @@ std::string Folder::getFullPath() const
   }
 }
 
-void Folder::addFolderInt(Folder::Ptr folder)
+size_t Folder::NameHash::operator()(std::string_view name) const
 {
-  for (std::vector<Folder::Ptr>::iterator iter = m_SubFolders.begin();
-       iter != m_SubFolders.end(); ++iter) {
-    // for folder to be a subfolder of iter, the name of iter has to be the
-    // first path component of folders path and there has to be room left for a
-    // backslash and the name of folder itself
-    size_t nameLength = (*iter)->m_Name.length();
-    if ((folder->m_Name.length() > (*iter)->m_Name.length()) &&
-        (folder->m_Name.compare(0, (*iter)->m_Name.length(), (*iter)->m_Name) == 0) &&
-        ((folder->m_Name[nameLength] == '\\') || (folder->m_Name[nameLength] == '/'))) {
-      // remove the matched part of the path and recurse
-      folder->m_Name = folder->m_Name.substr((*iter)->m_Name.length() + 1);
-      (*iter)->addFolderInt(folder);
-      return;
-    }
+  // FNV-1a over the lower case name
+  size_t hash = static_cast<size_t>(14695981039346656037ULL);
+  for (char c : name) {
+    hash ^= static_cast<size_t>(tolower(static_cast<unsigned char>(c)));
+    hash *= static_cast<size_t>(1099511628211ULL);
   }
+  return hash;
+}
 
-  // no subfolder matches, create one
-  std::string::size_type pos = folder->m_Name.find_first_of("\\/");
-  if (pos == std::string::npos) {
-    // no more path components, add the new folder right here
-    folder->m_Parent = this;
-    m_SubFolders.push_back(folder);
-  } else {
-    // add dummy folder for the next path component
-    Folder::Ptr dummy(new Folder);
-    dummy->m_Parent = this;
-    dummy->m_Name   = folder->m_Name.substr(0, pos);
-    folder->m_Name  = folder->m_Name.substr(pos + 1);
-    dummy->addFolderInt(folder);
-    m_SubFolders.push_back(dummy);
+void Folder::insertSubFolder(const Folder::Ptr& folder)
+{
+  m_SubFolders.push_back(folder);
+  m_SubFolderIndex.emplace(folder->m_Name, folder);
+}
+
+Folder::Ptr Folder::addOrFindSubFolder(std::string_view name)
+{
+  auto iter = m_SubFolderIndex.find(name);
+  if (iter != m_SubFolderIndex.end()) {
+    return iter->second;
   }
+  Folder::Ptr folder(new Folder);
+  folder->m_Parent = this;
+  folder->m_Name   = std::string(name);
+  insertSubFolder(folder);
+  return folder;
 }
 
-Folder::Ptr Folder::addOrFindFolderInt(Folder* folder)
+Folder* Folder::addOrFindParent(std::string_view& path)
 {
-  for (std::vector<Folder::Ptr>::iterator iter = m_SubFolders.begin();
-       iter != m_SubFolders.end(); ++iter) {
-    // for folder to be a subfolder of iter, the name of iter has to be the
-    // first path component of folders path and there has to be room left for a
-    // backslash and the name of folder itself
-    size_t nameLength = (*iter)->m_Name.length();
-    if ((folder->m_Name.length() > (*iter)->m_Name.length()) &&
-        (folder->m_Name.compare(0, (*iter)->m_Name.length(), (*iter)->m_Name) == 0) &&
-        ((folder->m_Name[nameLength] == '\\') || (folder->m_Name[nameLength] == '/'))) {
-      // remove the matched part of the path and recurse
-      folder->m_Name = folder->m_Name.substr((*iter)->m_Name.length() + 1);
-      return (*iter)->addOrFindFolderInt(folder);
-    } else {
-      std::string::size_type pos = folder->m_Name.find_first_of("\\/");
-      if (pos == std::string::npos && (*iter)->m_Name.compare(folder->m_Name) == 0) {
-        return *iter;
-      }
+  Folder* parent = this;
+  for (size_t pos = path.find_first_of("\\/"); pos != std::string_view::npos;
+       pos        = path.find_first_of("\\/")) {
+    parent = parent->addOrFindSubFolder(path.substr(0, pos)).get();
+    path.remove_prefix(pos + 1);
+  }
+  return parent;
+}
+
+Folder::Ptr Folder::addFolderInt(Folder::Ptr folder)
+{
+  std::string_view name(folder->m_Name);
+  Folder* parent = addOrFindParent(name);
+
+  auto iter = parent->m_SubFolderIndex.find(name);
+  if ((iter != parent->m_SubFolderIndex.end()) && iter->second->m_Files.empty()) {
+    // the folder was created before as part of the path of one of its subfolders
+    Folder::Ptr existing  = iter->second;
+    existing->m_NameHash  = folder->m_NameHash;
+    existing->m_FileCount = folder->m_FileCount;
+    existing->m_Offset    = folder->m_Offset;
+    existing->m_Files     = std::move(folder->m_Files);
+    for (const File::Ptr& file : existing->m_Files) {
+      file->setFolder(existing.get());
     }
+    return existing;
   }
 
-  // no subfolder matches, create one
-  std::string::size_type pos = folder->m_Name.find_first_of("\\/");
-  if (pos == std::string::npos) {
-    // no more path components, add the new folder right here
-    folder->m_Parent = this;
-    m_SubFolders.push_back(Folder::Ptr(folder));
-    return m_SubFolders.back();
-  } else {
-    // add dummy folder for the next path component
-    Folder::Ptr dummy(new Folder);
-    dummy->m_Parent    = this;
-    dummy->m_Name      = folder->m_Name.substr(0, pos);
-    folder->m_Name     = folder->m_Name.substr(pos + 1);
-    Folder::Ptr result = dummy->addOrFindFolderInt(folder);
-    m_SubFolders.push_back(dummy);
-    return result;
+  folder->m_Name   = std::string(name);
+  folder->m_Parent = parent;
+  parent->insertSubFolder(folder);
+  return folder;
+}
+
+Folder::Ptr Folder::addOrFindFolderInt(Folder* folder)
+{
+  std::string_view name(folder->m_Name);
+  Folder* parent = addOrFindParent(name);
+
+  auto iter = parent->m_SubFolderIndex.find(name);
+  if (iter != parent->m_SubFolderIndex.end()) {
+    return iter->second;
   }
+
+  folder->m_Name   = std::string(name);
+  folder->m_Parent = parent;
+  Folder::Ptr result(folder);
+  parent->insertSubFolder(result);
+  return result;
 }
 
-Folder::Ptr Folder::addFolder(std::fstream& file, BSAUInt fileNamesLength,
-                              BSAUInt& endPos, ArchiveType type)
+Folder::Ptr Folder::addFolder(const unsigned char*& record,
+                              const unsigned char* directory,
+                              const unsigned char* directoryEnd,
+                              BSAUInt fileNamesLength, BSAHash& endPos,
+                              ArchiveType type, FileTable& fileTable)
 {
   Folder::Ptr temp;
-  if (type == ArchiveType::TYPE_SKYRIMSE)
-    temp = readFolderSE(file, fileNamesLength, endPos);
-  else
-    temp = readFolder(file, fileNamesLength, endPos);
-  addFolderInt(temp);
+  if (type == ArchiveType::TYPE_SKYRIMSE) {
+    BSAFolderRecordSE folder = readType<BSAFolderRecordSE>(record, directoryEnd);
+    temp = readFolder(folder.nameHash, folder.fileCount, folder.offset, directory,
+                      directoryEnd, fileNamesLength, endPos, fileTable);
+  } else {
+    BSAFolderRecord folder = readType<BSAFolderRecord>(record, directoryEnd);
+    temp = readFolder(folder.nameHash, folder.fileCount, folder.offset, directory,
+                      directoryEnd, fileNamesLength, endPos, fileTable);
+  }
 
-  return temp;
+  return addFolderInt(temp);
 }
 
-Folder::Ptr Folder::addFolderFromFile(std::string filePath, BSAUInt size,
-                                      BSAHash offset, BSAUInt uncompressedSize,
-                                      FO4TextureHeader header,
-                                      std::vector<FO4TextureChunk>& texChunks)
+File::Ptr Folder::addFileFromPath(FileTable& fileTable, const std::string& filePath,
+                                  BSAUInt size, BSAHash offset,
+                                  BSAUInt uncompressedSize, FO4TextureHeader header,
+                                  BSAUInt firstChunk, BSAUInt chunkCount)
 {
   std::filesystem::path file(filePath);
 
@@ -245,24 +238,25 @@ Folder::Ptr Folder::addFolderFromFile(std::string filePath, BSAUInt size,
   std::string fileName = file.filename().string();
 
   result->m_FileCount++;
-  result->m_Files.push_back(File::Ptr(new File(fileName, result.get(), size, offset,
-                                               uncompressedSize, header, texChunks)));
+  result->m_Files.push_back(fileTable.create(fileName, result.get(), size, offset,
+                                             uncompressedSize, header, firstChunk,
+                                             chunkCount));
 
-  return result;
+  return result->m_Files.back();
 }
 
-bool Folder::resolveFileNames(std::fstream& file, bool testHashes)
+bool Folder::resolveFileNames(const unsigned char*& pos, const unsigned char* end)
 {
-  bool hashesValid = true;
+  bool namesValid = true;
   for (std::vector<File::Ptr>::iterator iter = m_Files.begin(); iter != m_Files.end();
        ++iter) {
     try {
-      (*iter)->readFileName(file, testHashes);
+      (*iter)->readFileName(pos, end);
     } catch (const std::exception&) {
-      hashesValid = false;
+      namesValid = false;
     }
   }
-  return hashesValid;
+  return namesValid;
 }
 
 const Folder::Ptr Folder::getSubFolder(unsigned int index) const
@@ -285,12 +279,42 @@ const File::Ptr Folder::getFile(unsigned int index) const
   return m_Files.at(index);
 }
 
+const Folder* Folder::findSubFolder(std::string_view name) const
+{
+  auto iter = m_SubFolderIndex.find(name);
+  return (iter != m_SubFolderIndex.end()) ? iter->second.get() : nullptr;
+}
+
+File::Ptr Folder::findFile(std::string_view path) const
+{
+  const Folder* folder = this;
+  while (!path.empty() && isPathSeparator(path.front())) {
+    path.remove_prefix(1);
+  }
+  for (size_t pos = path.find_first_of("\\/"); pos != std::string_view::npos;
+       pos        = path.find_first_of("\\/")) {
+    folder = folder->findSubFolder(path.substr(0, pos));
+    if (folder == nullptr) {
+      return File::Ptr();
+    }
+    path.remove_prefix(pos + 1);
+  }
+
+  for (const File::Ptr& file : folder->m_Files) {
+    if (pathEquals(file->getNameView(), path)) {
+      return file;
+    }
+  }
+  return File::Ptr();
+}
+
 Folder::Ptr Folder::addFolder(const std::string& folderName)
 {
   Folder::Ptr newFolder(new Folder);
-  newFolder->m_Name   = folderName;
-  newFolder->m_Parent = this;
-  m_SubFolders.push_back(newFolder);
+  newFolder->m_Name     = folderName;
+  newFolder->m_Parent   = this;
+  newFolder->m_NameHash = calculateBSAHash(newFolder->getFullPath());
+  insertSubFolder(newFolder);
   return newFolder;
 }
 
@@ -305,6 +329,21 @@ void Folder::collectFolders(std::vector<Folder::Ptr>& folderList) const
   }
 }
 
+void Folder::collectFolderPaths(
+    const std::string& path,
+    std::vector<std::pair<Folder::Ptr, std::string>>& folderList) const
+{
+  for (std::vector<Folder::Ptr>::const_iterator iter = m_SubFolders.begin();
+       iter != m_SubFolders.end(); ++iter) {
+    const std::string& name = (*iter)->m_Name;
+    std::string subPath     = path.empty() ? name : path + "\\" + name;
+    if ((*iter)->m_Files.size() != 0) {
+      folderList.push_back(std::make_pair(*iter, subPath));
+    }
+    (*iter)->collectFolderPaths(subPath, folderList);
+  }
+}
+
 void Folder::collectFiles(std::vector<File::Ptr>& fileList) const
 {
   for (std::vector<File::Ptr>::const_iterator fileIter = m_Files.begin();
@@ -331,12 +370,16 @@ void Folder::collectFileNames(std::vector<std::string>& nameList) const
 
 void Folder::collectFolderNames(std::vector<std::string>& nameList) const
 {
+  std::vector<std::pair<Folder::Ptr, std::string>> folders;
+  std::string path = getFullPath();
   if (m_Files.size() != 0) {
-    nameList.push_back(getFullPath());
+    nameList.push_back(path);
   }
-  for (std::vector<Folder::Ptr>::const_iterator iter = m_SubFolders.begin();
-       iter != m_SubFolders.end(); ++iter) {
-    (*iter)->collectFolderNames(nameList);
+  collectFolderPaths(path, folders);
+  for (std::vector<std::pair<Folder::Ptr, std::string>>::iterator iter =
+           folders.begin();
+       iter != folders.end(); ++iter) {
+    nameList.push_back(std::move(iter->second));
   }
 }
 
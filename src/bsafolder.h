@@ -26,6 +26,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include "errorcodes.h"
 #include <memory>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 namespace BSA
@@ -75,11 +78,21 @@ public:
    * @throw out_of_range this will throw an exception if the index is invalid
    */
   const File::Ptr getFile(unsigned int index) const;
+  /**
+   * look up a file by its path relative to this folder
+   * @param path path of the file, case insensitive and with either kind of slashes
+   * @return the file or a null pointer if there is no file with that path
+   */
+  File::Ptr findFile(std::string_view path) const;
   /**
    * adds a new file to the folder
    * @param file the new file to add
    */
-  void addFile(const File::Ptr& file) { m_Files.push_back(file); }
+  void addFile(const File::Ptr& file)
+  {
+    file->setFolder(this);
+    m_Files.push_back(file);
+  }
   /**
    * add an empty folder as a subfolder to this one.
    * @param folderName name of the new folder
@@ -101,52 +114,121 @@ private:
   Folder& operator=(const Folder& reference);
 
   /**
-   * factory function to read a folder object from disc. This also reads part of the
-   * information about the files within
-   * @param file file stream to read from, already placed at the correct position
+   * factory function to decode a folder from the directory of the archive. This also
+   * decodes the records of the files within
+   * @param nameHash, fileCount, offset content of the folder record
+   * @param directory start of the archive directory in memory. This is the data from
+   *                  the beginning of the archive file
+   * @param directoryEnd end of the directory in memory
    * @param fileNamesLength length of the file names list. This is required to correctly
    * calculate offsets
-   * @param endPos position inside file where the last folder header ends. This is
-   *               updated by the constructor so that it is the correct value after all
-   * folders are read
+   * @param endPos offset where the last file record ends. This is updated so that it is
+   *               the correct value after all folders are read
+   * @param fileTable storage for the files
    * @return the new Folder object
    */
-  Folder::Ptr readFolder(std::fstream& file, BSAUInt fileNamesLength, BSAUInt& endPos);
-
-  Folder::Ptr readFolderSE(std::fstream& file, BSAUInt fileNamesLength,
-                           BSAUInt& endPos);
+  static Folder::Ptr readFolder(BSAHash nameHash, BSAULong fileCount, BSAHash offset,
+                                const unsigned char* directory,
+                                const unsigned char* directoryEnd,
+                                BSAUInt fileNamesLength, BSAHash& endPos,
+                                FileTable& fileTable);
+
+  // hash and comparison for the subfolder index, case insensitive like the games
+  struct NameHash
+  {
+    using is_transparent = void;
+    size_t operator()(std::string_view name) const;
+  };
+  struct NameEqual
+  {
+    using is_transparent = void;
+    bool operator()(std::string_view lhs, std::string_view rhs) const
+    {
+      return pathEquals(lhs, rhs);
+    }
+  };
 
   /**
-   * recursive function to determine the correct subfolder to place the new
-   * folder in
+   * place a folder read from the archive in the tree below this folder, creating the
+   * folders along its path as necessary
+   * @param folder the folder to add. Its name is the path relative to this folder
+   * @return the folder in the tree. This may be a folder created earlier on the path of
+   *         another folder, in which case it takes over the files of folder
    */
-  void addFolderInt(Folder::Ptr folder);
+  Folder::Ptr addFolderInt(Folder::Ptr folder);
 
   /**
-   * recursive function that returns an existing folder match or generates the structure
-   * for a new folder
-   * @param folder folder to find or create
+   * returns an existing folder match or generates the structure for a new folder
+   * @param folder folder to find or create. Its name is the path relative to this
+   *               folder. If it is added to the tree the tree takes ownership
    * @return the final determined / generated Folder
    */
   Folder::Ptr addOrFindFolderInt(Folder* folder);
 
+  /**
+   * @return the direct subfolder of that name or nullptr
+   */
+  const Folder* findSubFolder(std::string_view name) const;
+
+  /**
+   * @return the direct subfolder of that name, created if it doesn't exist yet
+   */
+  Folder::Ptr addOrFindSubFolder(std::string_view name);
+
+  /**
+   * find the parent of the last component of path, creating missing folders
+   * @param path path relative to this folder. Receives the last component
+   */
+  Folder* addOrFindParent(std::string_view& path);
+
+  void insertSubFolder(const Folder::Ptr& folder);
+
   /**
    * Add a new folder to the structure.
    * It will automatically be added to the correct sub-folder if applicable.
+   * @param record position of the folder record in the directory, advanced past it
+   * @see readFolder
    */
-  Folder::Ptr addFolder(std::fstream& file, BSAUInt fileNamesLength, BSAUInt& endPos,
-                        ArchiveType type);
+  Folder::Ptr addFolder(const unsigned char*& record, const unsigned char* directory,
+                        const unsigned char* directoryEnd, BSAUInt fileNamesLength,
+                        BSAHash& endPos, ArchiveType type, FileTable& fileTable);
 
-  Folder::Ptr addFolderFromFile(std::string filePath, BSAUInt size, BSAHash offset,
-                                BSAUInt uncompressedSize, FO4TextureHeader header,
-                                std::vector<FO4TextureChunk>& texChunks);
+  /**
+   * add a file from an archive that stores the full path of each file, creating the
+   * folders on its path as necessary
+   * @return the new file
+   */
+  File::Ptr addFileFromPath(FileTable& fileTable, const std::string& filePath,
+                            BSAUInt size, BSAHash offset, BSAUInt uncompressedSize,
+                            FO4TextureHeader header, BSAUInt firstChunk,
+                            BSAUInt chunkCount);
 
-  bool resolveFileNames(std::fstream& file, bool testHashes);
+  /**
+   * read the names of the files in this folder from the file name table
+   * @param pos position in the name table, advanced past the names
+   * @param end end of the name table
+   * @return false if a name couldn't be read
+   */
+  bool resolveFileNames(const unsigned char*& pos, const unsigned char* end);
 
-  void writeHeader(std::fstream& file) const;
-  void writeData(std::fstream& file, BSAULong fileNamesLength) const;
-  EErrorCode writeFileData(std::fstream& sourceFile, std::fstream& targetFile) const;
+  /**
+   * write the folder record. m_OffsetWrite needs to be set up by the archive
+   */
+  void writeHeader(std::fstream& file, ArchiveType type) const;
+  /**
+   * write the name of the folder followed by the records of its files
+   * @param fullPath full path of this folder, as collected by collectFolderPaths
+   */
+  void writeData(std::fstream& file, const std::string& fullPath, bool writeName) const;
   void collectFolders(std::vector<Folder::Ptr>& folderList) const;
+  /**
+   * collect the subfolders containing files together with their full paths. Each
+   * path is built from the path of the parent instead of walking up the tree
+   * @param path full path of this folder
+   */
+  void
+  collectFolderPaths(const std::string& path,
+                     std::vector<std::pair<Folder::Ptr, std::string>>& folders) const;
   void collectFiles(std::vector<File::Ptr>& fileList) const;
   void collectFileNames(std::vector<std::string>& nameList) const;
   void collectFolderNames(std::vector<std::string>& nameList) const;
@@ -158,9 +240,10 @@ private:
   BSAULong m_FileCount;
   BSAHash m_Offset;
   std::vector<Folder::Ptr> m_SubFolders;
+  std::unordered_map<std::string, Folder::Ptr, NameHash, NameEqual> m_SubFolderIndex;
   std::vector<File::Ptr> m_Files;
 
-  mutable BSAULong m_OffsetWrite;
+  mutable BSAHash m_OffsetWrite;
 };
 
 }  // namespace BSA
@@ -0,0 +1,166 @@
+/*
+Mod Organizer BSA handling
+
+Copyright (C) 2012 Sebastian Herbord. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "bsaindex.h"
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <system_error>
+
+namespace BSA
+{
+
+static const char INDEX_MAGIC[4] = {'B', 'S', 'I', 'X'};
+
+bool ArchiveIndex::key(const char* archiveName, Key& key)
+{
+  std::error_code error;
+  std::filesystem::path path(archiveName);
+  uintmax_t size = std::filesystem::file_size(path, error);
+  if (error) {
+    return false;
+  }
+  std::filesystem::file_time_type time = std::filesystem::last_write_time(path, error);
+  if (error) {
+    return false;
+  }
+  key.archiveSize = static_cast<BSAHash>(size);
+  key.archiveTime = static_cast<int64_t>(time.time_since_epoch().count());
+  return true;
+}
+
+bool ArchiveIndex::write(const char* indexName, Header header,
+                         const std::vector<FolderRecord>& folders,
+                         const std::vector<FileRecord>& files,
+                         std::span<const FO4TextureChunk> chunks,
+                         const std::string& names)
+{
+  memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+  header.version          = VERSION;
+  header.folderRecordSize = sizeof(FolderRecord);
+  header.fileRecordSize   = sizeof(FileRecord);
+  header.chunkRecordSize  = sizeof(FO4TextureChunk);
+  header.folderCount      = static_cast<BSAUInt>(folders.size());
+  header.fileCount        = static_cast<BSAUInt>(files.size());
+  header.chunkCount       = static_cast<BSAUInt>(chunks.size());
+  header.namesSize        = static_cast<BSAUInt>(names.size());
+  header.reserved         = 0;
+
+  std::string tempName = std::string(indexName) + ".tmp";
+  {
+    std::ofstream file(tempName, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+      return false;
+    }
+    file.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+    file.write(reinterpret_cast<const char*>(folders.data()),
+               folders.size() * sizeof(FolderRecord));
+    file.write(reinterpret_cast<const char*>(files.data()),
+               files.size() * sizeof(FileRecord));
+    file.write(reinterpret_cast<const char*>(chunks.data()),
+               chunks.size() * sizeof(FO4TextureChunk));
+    file.write(names.data(), names.size());
+    if (!file.good()) {
+      file.close();
+      std::remove(tempName.c_str());
+      return false;
+    }
+  }
+
+  std::error_code error;
+  std::filesystem::rename(tempName, indexName, error);
+  if (error) {
+    std::remove(tempName.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool ArchiveIndex::open(const char* indexName, const Key& key)
+{
+  close();
+  if (!m_Source.open(indexName, true) || (m_Source.size() < sizeof(Header))) {
+    close();
+    return false;
+  }
+
+  const Header* header =
+      reinterpret_cast<const Header*>(m_Source.data(0, sizeof(Header)));
+  if ((memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0) ||
+      (header->version != VERSION) ||
+      (header->folderRecordSize != sizeof(FolderRecord)) ||
+      (header->fileRecordSize != sizeof(FileRecord)) ||
+      (header->chunkRecordSize != sizeof(FO4TextureChunk)) ||
+      (header->key.archiveSize != key.archiveSize) ||
+      (header->key.archiveTime != key.archiveTime) || (header->folderCount == 0)) {
+    close();
+    return false;
+  }
+
+  BSAHash foldersOffset = sizeof(Header);
+  BSAHash filesOffset =
+      foldersOffset + BSAHash(header->folderCount) * sizeof(FolderRecord);
+  BSAHash chunksOffset = filesOffset + BSAHash(header->fileCount) * sizeof(FileRecord);
+  BSAHash namesOffset =
+      chunksOffset + BSAHash(header->chunkCount) * sizeof(FO4TextureChunk);
+  if (namesOffset + header->namesSize != m_Source.size()) {
+    close();
+    return false;
+  }
+
+  m_Header  = header;
+  m_Folders = std::span<const FolderRecord>(
+      reinterpret_cast<const FolderRecord*>(m_Source.data(foldersOffset, 0)),
+      header->folderCount);
+  m_Files = std::span<const FileRecord>(
+      reinterpret_cast<const FileRecord*>(m_Source.data(filesOffset, 0)),
+      header->fileCount);
+  m_Chunks = std::span<const FO4TextureChunk>(
+      reinterpret_cast<const FO4TextureChunk*>(m_Source.data(chunksOffset, 0)),
+      header->chunkCount);
+  m_Names = reinterpret_cast<const char*>(m_Source.data(namesOffset, 0));
+
+  // the index is trusted as much as the archive itself, every reference is checked
+  // once here so the archive can build its tree without further tests
+  for (BSAUInt i = 0; i < header->folderCount; ++i) {
+    const FolderRecord& folder = m_Folders[i];
+    bool isRoot = i == 0;
+    if ((isRoot != (folder.parent == NO_PARENT)) || (!isRoot && (folder.parent >= i)) ||
+        (folder.nameOffset > header->namesSize) ||
+        (folder.nameLength > header->namesSize - folder.nameOffset)) {
+      close();
+      return false;
+    }
+  }
+  for (const FileRecord& file : m_Files) {
+    if ((file.folder >= header->folderCount) || (file.nameOffset > header->namesSize) ||
+        (file.nameLength > header->namesSize - file.nameOffset) ||
+        (file.firstChunk > header->chunkCount) ||
+        (file.chunkCount > header->chunkCount - file.firstChunk)) {
+      close();
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace BSA
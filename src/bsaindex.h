@@ -0,0 +1,160 @@
+/*
+Mod Organizer BSA handling
+
+Copyright (C) 2012 Sebastian Herbord. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef BSAINDEX_H
+#define BSAINDEX_H
+
+#include "bsasource.h"
+#include "bsatypes.h"
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace BSA
+{
+
+/**
+ * @brief file that stores the directory of an archive as flat tables so it can be
+ * reopened without parsing the archive again. The index is keyed by the size and
+ * modification time of the archive and is mapped into memory when it is read.
+ * The records are stored in the layout of the machine that wrote the index, it is
+ * only meant to be used on that machine
+ */
+class ArchiveIndex
+{
+
+public:
+  /// identifies the state of the archive an index was built from
+  struct Key
+  {
+    BSAHash archiveSize;
+    int64_t archiveTime;
+  };
+
+  struct Header
+  {
+    char magic[4];
+    BSAUInt version;
+    Key key;
+    // sizes of the records, an index written by a different build is rejected
+    BSAUInt folderRecordSize;
+    BSAUInt fileRecordSize;
+    BSAUInt chunkRecordSize;
+    BSAUInt type;
+    BSAUInt archiveFlags;
+    // result of the original read, possibly ERROR_INVALIDHASHES
+    BSAUInt result;
+    BSAUInt hashesTested;
+    BSAUInt folderCount;
+    BSAUInt fileCount;
+    BSAUInt chunkCount;
+    BSAUInt namesSize;
+    BSAUInt reserved;
+  };
+
+  /// folders are stored with each parent ahead of its children, the root comes first
+  struct FolderRecord
+  {
+    BSAHash nameHash;
+    BSAHash offset;
+    BSAUInt parent;
+    BSAUInt fileCount;
+    BSAUInt nameOffset;
+    BSAUInt nameLength;
+  };
+
+  struct FileRecord
+  {
+    BSAHash nameHash;
+    BSAHash dataOffset;
+    // offset of the texture record if the chunks weren't read yet (OPEN_LAZY)
+    BSAHash textureRecordOffset;
+    BSAUInt folder;
+    BSAUInt nameOffset;
+    BSAUInt nameLength;
+    BSAUInt fileSize;
+    BSAUInt uncompressedFileSize;
+    BSAUInt firstChunk;
+    BSAUInt chunkCount;
+    BSAUInt toggleCompressed;
+    FO4TextureHeader textureHeader;
+  };
+
+  /// parent of the root folder
+  static constexpr BSAUInt NO_PARENT = 0xFFFFFFFF;
+
+public:
+  /**
+   * determine the key of an archive
+   * @param archiveName name of the archive file
+   * @param key receives the key
+   * @return true on success
+   */
+  static bool key(const char* archiveName, Key& key);
+
+  /**
+   * write an index file. The file is written under a temporary name and then moved in
+   * place, so a concurrent reader never sees half of it
+   * @param indexName name of the index file
+   * @param header counts and sizes are filled in from the tables
+   * @return true on success
+   */
+  static bool write(const char* indexName, Header header,
+                    const std::vector<FolderRecord>& folders,
+                    const std::vector<FileRecord>& files,
+                    std::span<const FO4TextureChunk> chunks, const std::string& names);
+
+  /**
+   * map an index file and check that it is complete and was built from the archive
+   * identified by key
+   * @return true if the index can be used
+   */
+  bool open(const char* indexName, const Key& key);
+  void close() { m_Source.close(); }
+
+  const Header& header() const { return *m_Header; }
+  std::span<const FolderRecord> folders() const { return m_Folders; }
+  std::span<const FileRecord> files() const { return m_Files; }
+  std::span<const FO4TextureChunk> chunks() const { return m_Chunks; }
+  /**
+   * @return a name from the name table. The range was checked by open
+   */
+  std::string_view name(BSAUInt offset, BSAUInt length) const
+  {
+    return std::string_view(m_Names + offset, length);
+  }
+
+private:
+  static const BSAUInt VERSION = 1;
+
+private:
+  ArchiveSource m_Source;
+  const Header* m_Header = nullptr;
+  std::span<const FolderRecord> m_Folders;
+  std::span<const FileRecord> m_Files;
+  std::span<const FO4TextureChunk> m_Chunks;
+  const char* m_Names = nullptr;
+};
+
+}  // namespace BSA
+
+#endif  // BSAINDEX_H
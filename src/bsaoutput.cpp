@@ -0,0 +1,199 @@
+/*
+Mod Organizer BSA handling
+
+Copyright (C) 2012 Sebastian Herbord. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "bsaoutput.h"
+
+#include <algorithm>
+#include <cstring>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif  // WIN32
+
+namespace BSA
+{
+
+OutputFile::OutputFile()
+#ifdef WIN32
+    : m_File(INVALID_HANDLE_VALUE),
+#else   // WIN32
+    : m_File(-1),
+#endif  // WIN32
+      m_Buffer(new char[BUFFER_SIZE]), m_Failed(false)
+{
+  setp(m_Buffer.get(), m_Buffer.get() + BUFFER_SIZE);
+}
+
+OutputFile::~OutputFile()
+{
+  close();
+}
+
+#ifdef WIN32
+
+bool OutputFile::open(const char* fileName, BSAHash expectedSize)
+{
+  close();
+
+  m_File = ::CreateFileA(fileName, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                         FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (m_File == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  if (expectedSize > 0) {
+    // only a hint, writing works the same if the space can't be reserved
+    FILE_ALLOCATION_INFO allocation;
+    allocation.AllocationSize.QuadPart = static_cast<LONGLONG>(expectedSize);
+    ::SetFileInformationByHandle(m_File, FileAllocationInfo, &allocation,
+                                 sizeof(allocation));
+  }
+  m_Failed = false;
+  return true;
+}
+
+bool OutputFile::close()
+{
+  if (m_File == INVALID_HANDLE_VALUE) {
+    return true;
+  }
+  bool result = flushBuffer() && !m_Failed;
+  ::CloseHandle(m_File);
+  m_File = INVALID_HANDLE_VALUE;
+  return result;
+}
+
+bool OutputFile::isOpen() const
+{
+  return m_File != INVALID_HANDLE_VALUE;
+}
+
+bool OutputFile::writeToFile(const char* data, size_t size)
+{
+  while (size > 0) {
+    DWORD chunkSize =
+        static_cast<DWORD>((std::min)(size, static_cast<size_t>(0x40000000)));
+    DWORD written = 0;
+    if (!::WriteFile(m_File, data, chunkSize, &written, nullptr) || (written == 0)) {
+      return false;
+    }
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+#else  // WIN32
+
+bool OutputFile::open(const char* fileName, BSAHash expectedSize)
+{
+  close();
+
+  m_File = ::open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (m_File == -1) {
+    return false;
+  }
+#ifdef __linux__
+  if (expectedSize > 0) {
+    // only a hint, writing works the same if the space can't be reserved
+    ::fallocate(m_File, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(expectedSize));
+  }
+#endif  // __linux__
+  m_Failed = false;
+  return true;
+}
+
+bool OutputFile::close()
+{
+  if (m_File == -1) {
+    return true;
+  }
+  bool result = flushBuffer() && !m_Failed;
+  ::close(m_File);
+  m_File = -1;
+  return result;
+}
+
+bool OutputFile::isOpen() const
+{
+  return m_File != -1;
+}
+
+bool OutputFile::writeToFile(const char* data, size_t size)
+{
+  while (size > 0) {
+    ssize_t written = ::write(m_File, data, size);
+    if (written <= 0) {
+      return false;
+    }
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+#endif  // WIN32
+
+bool OutputFile::flushBuffer()
+{
+  size_t size = static_cast<size_t>(pptr() - pbase());
+  setp(m_Buffer.get(), m_Buffer.get() + BUFFER_SIZE);
+  if ((size > 0) && !m_Failed && !writeToFile(m_Buffer.get(), size)) {
+    m_Failed = true;
+  }
+  return !m_Failed;
+}
+
+OutputFile::int_type OutputFile::overflow(int_type c)
+{
+  if (!isOpen() || !flushBuffer()) {
+    return traits_type::eof();
+  }
+  if (!traits_type::eq_int_type(c, traits_type::eof())) {
+    *pptr() = traits_type::to_char_type(c);
+    pbump(1);
+  }
+  return traits_type::not_eof(c);
+}
+
+std::streamsize OutputFile::xsputn(const char* data, std::streamsize size)
+{
+  if (!isOpen() || m_Failed) {
+    return 0;
+  }
+  if (size < epptr() - pptr()) {
+    memcpy(pptr(), data, static_cast<size_t>(size));
+    pbump(static_cast<int>(size));
+    return size;
+  }
+  // large writes bypass the buffer
+  if (!flushBuffer() || !writeToFile(data, static_cast<size_t>(size))) {
+    m_Failed = true;
+    return 0;
+  }
+  return size;
+}
+
+int OutputFile::sync()
+{
+  return (isOpen() && flushBuffer()) ? 0 : -1;
+}
+
+}  // namespace BSA
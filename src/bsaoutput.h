@@ -0,0 +1,95 @@
+/*
+Mod Organizer BSA handling
+
+Copyright (C) 2012 Sebastian Herbord. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef BSAOUTPUT_H
+#define BSAOUTPUT_H
+
+#include "bsatypes.h"
+#include <cstddef>
+#include <memory>
+#include <streambuf>
+
+namespace BSA
+{
+
+/**
+ * @brief a file extracted data is written to. The file is written through its own
+ * buffer and handle instead of a std::ofstream so the space it needs can be reserved
+ * when it's created. Derived from std::streambuf so it can be passed to anything
+ * that writes to a std::ostream
+ */
+class OutputFile : public std::streambuf
+{
+
+public:
+  OutputFile();
+  ~OutputFile();
+
+  /**
+   * create a file, an existing file is truncated
+   * @param fileName name of the file to create
+   * @param expectedSize size the file will have once written, 0 if unknown. This much
+   *        space is reserved up front so the file system doesn't have to grow the
+   *        file with each write. The reservation doesn't change the size of the file
+   * @return true on success
+   */
+  bool open(const char* fileName, BSAHash expectedSize);
+  /**
+   * write out buffered data and close the file
+   * @return true if everything written to the file made it to disk
+   */
+  bool close();
+  /**
+   * @return true if a file is currently open
+   */
+  bool isOpen() const;
+
+protected:
+  int_type overflow(int_type c) override;
+  std::streamsize xsputn(const char* data, std::streamsize size) override;
+  int sync() override;
+
+private:
+  static const size_t BUFFER_SIZE = 64 * 1024;
+
+private:
+  // copy constructor not implemented
+  OutputFile(const OutputFile& reference);
+
+  // assignment operator not implemented
+  OutputFile& operator=(const OutputFile& reference);
+
+  bool flushBuffer();
+  bool writeToFile(const char* data, size_t size);
+
+private:
+#ifdef WIN32
+  HANDLE m_File;
+#else   // WIN32
+  int m_File;
+#endif  // WIN32
+
+  std::unique_ptr<char[]> m_Buffer;
+  bool m_Failed;
+};
+
+}  // namespace BSA
+
+#endif  // BSAOUTPUT_H
@@ -0,0 +1,279 @@
+/*
+Mod Organizer BSA handling
+
+Copyright (C) 2012 Sebastian Herbord. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "bsasource.h"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <ostream>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif  // WIN32
+
+namespace BSA
+{
+
+ArchiveSource::ArchiveSource()
+#ifdef WIN32
+    : m_File(INVALID_HANDLE_VALUE), m_Mapping(nullptr),
+#else   // WIN32
+    : m_File(-1),
+#endif  // WIN32
+      m_Data(nullptr), m_Size(0ULL)
+{}
+
+ArchiveSource::~ArchiveSource()
+{
+  close();
+}
+
+#ifdef WIN32
+
+bool ArchiveSource::open(const char* fileName, bool mapped)
+{
+  close();
+
+  // share like fstream does, other tools may have the archive open for writing.
+  // Reads on a synchronous handle are serialized by the system, an overlapped one
+  // lets the reader threads have several requests in flight
+  m_File = ::CreateFileA(fileName, GENERIC_READ,
+                         FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                         nullptr, OPEN_EXISTING,
+                         FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, nullptr);
+  if (m_File == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+
+  LARGE_INTEGER size;
+  if (!::GetFileSizeEx(m_File, &size)) {
+    close();
+    return false;
+  }
+  m_Size = static_cast<BSAHash>(size.QuadPart);
+  if (!mapped) {
+    return true;
+  }
+  if (m_Size == 0ULL) {
+    // empty files can't be mapped
+    close();
+    return false;
+  }
+
+  m_Mapping = ::CreateFileMappingA(m_File, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (m_Mapping == nullptr) {
+    close();
+    return false;
+  }
+
+  m_Data = static_cast<const unsigned char*>(
+      ::MapViewOfFile(m_Mapping, FILE_MAP_READ, 0, 0, 0));
+  if (m_Data == nullptr) {
+    close();
+    return false;
+  }
+  return true;
+}
+
+void ArchiveSource::close()
+{
+  if (m_Data != nullptr) {
+    ::UnmapViewOfFile(m_Data);
+    m_Data = nullptr;
+  }
+  if (m_Mapping != nullptr) {
+    ::CloseHandle(m_Mapping);
+    m_Mapping = nullptr;
+  }
+  if (m_File != INVALID_HANDLE_VALUE) {
+    ::CloseHandle(m_File);
+    m_File = INVALID_HANDLE_VALUE;
+  }
+  m_Size = 0ULL;
+}
+
+bool ArchiveSource::isOpen() const
+{
+  return m_File != INVALID_HANDLE_VALUE;
+}
+
+bool ArchiveSource::read(BSAHash offset, void* buffer, BSAHash length) const
+{
+  if (m_Data != nullptr) {
+    const unsigned char* source = data(offset, length);
+    if (source == nullptr) {
+      return false;
+    }
+    memcpy(buffer, source, static_cast<size_t>(length));
+    return true;
+  }
+
+  // the handle is overlapped, every read waits on its own event so concurrent calls
+  // don't complete each other
+  HANDLE event = ::CreateEventA(nullptr, TRUE, FALSE, nullptr);
+  if (event == nullptr) {
+    return false;
+  }
+  std::unique_ptr<void, decltype(&::CloseHandle)> eventGuard(event, &::CloseHandle);
+
+  char* target = static_cast<char*>(buffer);
+  while (length > 0) {
+    DWORD chunkSize = static_cast<DWORD>((std::min)(length, BSAHash(0x40000000)));
+    OVERLAPPED overlapped = {};
+    overlapped.Offset     = static_cast<DWORD>(offset & 0xFFFFFFFF);
+    overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+    overlapped.hEvent     = event;
+    DWORD bytesRead       = 0;
+    if (!::ReadFile(m_File, target, chunkSize, nullptr, &overlapped) &&
+        (::GetLastError() != ERROR_IO_PENDING)) {
+      return false;
+    }
+    if (!::GetOverlappedResult(m_File, &overlapped, &bytesRead, TRUE) ||
+        (bytesRead == 0)) {
+      return false;
+    }
+    target += bytesRead;
+    offset += bytesRead;
+    length -= bytesRead;
+  }
+  return true;
+}
+
+#else  // WIN32
+
+bool ArchiveSource::open(const char* fileName, bool mapped)
+{
+  close();
+
+  m_File = ::open(fileName, O_RDONLY);
+  if (m_File == -1) {
+    return false;
+  }
+
+  struct stat info;
+  if (::fstat(m_File, &info) != 0) {
+    close();
+    return false;
+  }
+  m_Size = static_cast<BSAHash>(info.st_size);
+  if (!mapped) {
+    return true;
+  }
+  if (m_Size == 0ULL) {
+    // empty files can't be mapped
+    close();
+    return false;
+  }
+
+  void* data = ::mmap(nullptr, static_cast<size_t>(m_Size), PROT_READ, MAP_PRIVATE,
+                      m_File, 0);
+  if (data == MAP_FAILED) {
+    close();
+    return false;
+  }
+  m_Data = static_cast<const unsigned char*>(data);
+  return true;
+}
+
+void ArchiveSource::close()
+{
+  if (m_Data != nullptr) {
+    ::munmap(const_cast<unsigned char*>(m_Data), static_cast<size_t>(m_Size));
+    m_Data = nullptr;
+  }
+  if (m_File != -1) {
+    ::close(m_File);
+    m_File = -1;
+  }
+  m_Size = 0ULL;
+}
+
+bool ArchiveSource::isOpen() const
+{
+  return m_File != -1;
+}
+
+bool ArchiveSource::read(BSAHash offset, void* buffer, BSAHash length) const
+{
+  if (m_Data != nullptr) {
+    const unsigned char* source = data(offset, length);
+    if (source == nullptr) {
+      return false;
+    }
+    memcpy(buffer, source, static_cast<size_t>(length));
+    return true;
+  }
+
+  char* target = static_cast<char*>(buffer);
+  while (length > 0) {
+    ssize_t bytesRead = ::pread(m_File, target, static_cast<size_t>(length),
+                                static_cast<off_t>(offset));
+    if (bytesRead <= 0) {
+      return false;
+    }
+    target += bytesRead;
+    offset += bytesRead;
+    length -= bytesRead;
+  }
+  return true;
+}
+
+#endif  // WIN32
+
+const unsigned char* ArchiveSource::data(BSAHash offset, BSAHash length) const
+{
+  if ((m_Data == nullptr) || (offset > m_Size) || (length > m_Size - offset)) {
+    return nullptr;
+  }
+  return m_Data + offset;
+}
+
+bool ArchiveSource::copyTo(BSAHash offset, BSAHash length, std::ostream& target) const
+{
+  if (m_Data != nullptr) {
+    const unsigned char* source = data(offset, length);
+    if (source == nullptr) {
+      return false;
+    }
+    target.write(reinterpret_cast<const char*>(source),
+                 static_cast<std::streamsize>(length));
+    return target.good();
+  }
+
+  size_t bufferSize =
+      static_cast<size_t>((std::min)(length, BSAHash(COPY_BUFFER_SIZE)));
+  std::unique_ptr<char[]> buffer(new char[bufferSize]);
+  while (length > 0) {
+    size_t chunkSize = static_cast<size_t>((std::min)(length, BSAHash(bufferSize)));
+    if (!read(offset, buffer.get(), chunkSize)) {
+      return false;
+    }
+    target.write(buffer.get(), static_cast<std::streamsize>(chunkSize));
+    offset += chunkSize;
+    length -= chunkSize;
+  }
+  return target.good();
+}
+
+}  // namespace BSA
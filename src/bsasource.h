@@ -0,0 +1,119 @@
+/*
+Mod Organizer BSA handling
+
+Copyright (C) 2012 Sebastian Herbord. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef BSASOURCE_H
+#define BSASOURCE_H
+
+#include "bsatypes.h"
+#include <cstddef>
+#include <iosfwd>
+
+namespace BSA
+{
+
+/**
+ * @brief read-only access to an archive file that is safe to use from several threads
+ * at once. The file is either mapped into memory or read with positional reads that
+ * don't share a file pointer.
+ * A mapping stays valid until the source is closed, so pointers handed out by data()
+ * can be passed to the decompressors and writers directly instead of copying the
+ * archive contents into temporary buffers
+ */
+class ArchiveSource
+{
+
+public:
+  ArchiveSource();
+  ~ArchiveSource();
+
+  /**
+   * open the file
+   * @param fileName name of the file to open
+   * @param mapped if true the file is mapped into memory
+   * @return true on success. On failure the source remains closed
+   */
+  bool open(const char* fileName, bool mapped);
+  /**
+   * close the file. Pointers previously returned by data() become invalid
+   */
+  void close();
+  /**
+   * @return true if a file is currently open
+   */
+  bool isOpen() const;
+  /**
+   * @return true if the file is mapped into memory
+   */
+  bool isMapped() const { return m_Data != nullptr; }
+  /**
+   * @return size of the file in bytes, whether it's mapped or not
+   */
+  BSAHash size() const { return m_Size; }
+  /**
+   * @param offset offset of the requested range from the start of the file
+   * @param length length of the requested range
+   * @return pointer to the mapped data or nullptr if the file isn't mapped or the
+   *         range is not entirely inside the file
+   */
+  const unsigned char* data(BSAHash offset, BSAHash length) const;
+  /**
+   * copy a range of the file into a buffer. This may be called from several threads
+   * concurrently
+   * @param offset offset of the range from the start of the file
+   * @param buffer buffer to read to, needs to be at least length bytes large
+   * @param length number of bytes to read
+   * @return true on success, false if the range couldn't be read completely
+   */
+  bool read(BSAHash offset, void* buffer, BSAHash length) const;
+  /**
+   * write a range of the file to a stream. A mapped range is written in one go,
+   * otherwise the range is passed through a buffer of COPY_BUFFER_SIZE bytes
+   * @param offset offset of the range from the start of the file
+   * @param length number of bytes to copy
+   * @param target stream to write to
+   * @return true on success, false if the range couldn't be read or written completely
+   */
+  bool copyTo(BSAHash offset, BSAHash length, std::ostream& target) const;
+
+private:
+  static const size_t COPY_BUFFER_SIZE = 4 * 1024 * 1024;
+
+private:
+  // copy constructor not implemented
+  ArchiveSource(const ArchiveSource& reference);
+
+  // assignment operator not implemented
+  ArchiveSource& operator=(const ArchiveSource& reference);
+
+private:
+#ifdef WIN32
+  HANDLE m_File;
+  HANDLE m_Mapping;
+#else   // WIN32
+  int m_File;
+#endif  // WIN32
+
+  const unsigned char* m_Data;
+  BSAHash m_Size;
+};
+
+}  // namespace BSA
+
+#endif  // BSASOURCE_H
@@ -9,6 +9,7 @@
 #define BSATK_H
 
 #include "bsaarchive.h"
+#include "bsaarchiveset.h"
 #include "bsafile.h"
 #include "bsafolder.h"
 
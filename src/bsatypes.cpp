@@ -35,14 +35,25 @@ using std::fstream;
 std::string readBString(fstream& file)
 {
   unsigned char length = readType<unsigned char>(file);
-  char buffer[256];
-  if (length > 0) {
-    if (!file.read(buffer, length)) {
-      throw data_invalid_exception("can't read from bsa");
-    }
+  std::string result(length, '\0');
+  if ((length > 0) && !file.read(result.data(), length)) {
+    throw data_invalid_exception("can't read from bsa");
   }
-  buffer[length] = '\0';
-  return std::string(buffer);
+  // the length may include a terminating zero
+  result.resize(strnlen(result.c_str(), length));
+  return result;
+}
+
+std::string readBString(const unsigned char*& pos, const unsigned char* end)
+{
+  unsigned char length = readType<unsigned char>(pos, end);
+  if (static_cast<size_t>(end - pos) < length) {
+    throw data_invalid_exception("can't read from bsa");
+  }
+  // the length may include a terminating zero
+  const char* string = reinterpret_cast<const char*>(pos);
+  pos += length;
+  return std::string(string, strnlen(string, length));
 }
 
 void writeBString(fstream& file, const std::string& string)
@@ -63,6 +74,19 @@ std::string readZString(fstream& file)
   return std::string(buffer);
 }
 
+std::string readZString(const unsigned char*& pos, const unsigned char* end)
+{
+  const unsigned char* terminator =
+      (pos < end) ? static_cast<const unsigned char*>(memchr(pos, '\0', end - pos))
+                  : nullptr;
+  if (terminator == nullptr) {
+    throw data_invalid_exception("can't read from bsa");
+  }
+  std::string result(reinterpret_cast<const char*>(pos), terminator - pos);
+  pos = terminator + 1;
+  return result;
+}
+
 void writeZString(fstream& file, const std::string& string)
 {
   file.write(string.c_str(), string.length() + 1);
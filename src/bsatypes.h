@@ -24,6 +24,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include "dxgiformat.h"
 #include "DDS.h"
 #include "bsaexception.h"
+#include <cstring>
 #include <fstream>
 #include <string>
 
@@ -94,6 +95,70 @@ struct FO4TextureChunk
   BSAUInt unknown;
 };
 
+// layout of the records in the archive directories. These are decoded straight from
+// memory so they must not contain padding
+#pragma pack(push, 1)
+
+struct BSAFolderRecord
+{
+  BSAHash nameHash;
+  BSAUInt fileCount;
+  BSAUInt offset;
+};
+
+struct BSAFolderRecordSE
+{
+  BSAHash nameHash;
+  BSAUInt fileCount;
+  BSAUInt padding;
+  BSAHash offset;
+};
+
+struct BSAFileRecord
+{
+  BSAHash nameHash;
+  BSAUInt size;
+  BSAUInt offset;
+};
+
+struct BA2FileRecord
+{
+  BSAUInt nameHash;
+  char extension[4];
+  BSAUInt dirHash;
+  BSAUInt flags;
+  BSAHash offset;
+  BSAUInt packedSize;
+  BSAUInt unpackedSize;
+  BSAUInt align;
+};
+
+struct BA2TextureRecord
+{
+  BSAUInt nameHash;
+  char extension[4];
+  BSAUInt dirHash;
+  BSAUChar unknown1;
+  BSAUChar chunkNumber;
+  BSAUShort chunkHeaderSize;
+  BSAUShort height;
+  BSAUShort width;
+  BSAUChar mipCount;
+  BSAUChar format;
+  BSAUChar isCubemap;
+  BSAUChar unknown2;
+};
+
+#pragma pack(pop)
+
+static_assert(sizeof(BSAFolderRecord) == 16, "unexpected record size");
+static_assert(sizeof(BSAFolderRecordSE) == 24, "unexpected record size");
+static_assert(sizeof(BSAFileRecord) == 16, "unexpected record size");
+static_assert(sizeof(BA2FileRecord) == 36, "unexpected record size");
+static_assert(sizeof(BA2TextureRecord) == 24, "unexpected record size");
+static_assert(sizeof(FO4TextureChunk) == 24, "unexpected record size");
+static_assert(sizeof(MorrowindFileOffset) == 8, "unexpected record size");
+
 template <typename T>
 static T readType(std::fstream& file)
 {
@@ -108,6 +173,24 @@ static T readType(std::fstream& file)
   return value;
 }
 
+/**
+ * read a value from a part of the archive that was loaded into memory
+ * @param pos current position, advanced past the value
+ * @param end end of the data in memory
+ * @throw data_invalid_exception if the value doesn't fit before end
+ */
+template <typename T>
+static T readType(const unsigned char*& pos, const unsigned char* end)
+{
+  T value;
+  if ((pos > end) || (static_cast<size_t>(end - pos) < sizeof(T))) {
+    throw data_invalid_exception("can't read from bsa");
+  }
+  memcpy(&value, pos, sizeof(T));
+  pos += sizeof(T);
+  return value;
+}
+
 template <typename T>
 static void writeType(std::fstream& file, const T& value)
 {
@@ -122,9 +205,11 @@ static void writeType(std::fstream& file, const T& value)
 }
 
 std::string readBString(std::fstream& file);
+std::string readBString(const unsigned char*& pos, const unsigned char* end);
 void writeBString(std::fstream& file, const std::string& string);
 
 std::string readZString(std::fstream& file);
+std::string readZString(const unsigned char*& pos, const unsigned char* end);
 void writeZString(std::fstream& file, const std::string& string);
 
 #endif  // BSATYPES_H
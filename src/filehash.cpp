@@ -20,80 +20,247 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include "filehash.h"
 #include <algorithm>
-#include <climits>
-#include <cstdlib>
 #include <cstring>
 
-#ifndef MAX_PATH
-#define MAX_PATH PATH_MAX
-#endif  // MAX_PATH
+/**
+ * @brief maps each character the way the games normalize names: ascii upper case
+ * letters to lower case and slashes to backslashes
+ */
+struct NameCharTable
+{
+  unsigned char values[256];
+
+  constexpr NameCharTable() : values()
+  {
+    for (int i = 0; i < 256; ++i) {
+      values[i] = static_cast<unsigned char>(i);
+    }
+    for (int i = 'A'; i <= 'Z'; ++i) {
+      values[i] = static_cast<unsigned char>(i - 'A' + 'a');
+    }
+    values['/'] = '\\';
+  }
+
+  unsigned char operator[](char c) const
+  {
+    return values[static_cast<unsigned char>(c)];
+  }
+};
 
-static unsigned long genHashInt(const unsigned char* pos, const unsigned char* end)
+static constexpr NameCharTable NAME_CHARS;
+
+static BSAUInt genHashInt(const char* pos, const char* end)
 {
-  unsigned long hash = 0;
+  // only the lower 32 bits of the hash are used. Taking four characters per step
+  // shortens the chain of dependent multiplications
+  constexpr BSAUInt factor1 = 0x1003f;
+  constexpr BSAUInt factor2 = factor1 * factor1;
+  constexpr BSAUInt factor3 = factor2 * factor1;
+  constexpr BSAUInt factor4 = factor3 * factor1;
+
+  BSAUInt hash = 0;
+  for (; end - pos >= 4; pos += 4) {
+    hash = hash * factor4 + NAME_CHARS[pos[0]] * factor3 +
+           NAME_CHARS[pos[1]] * factor2 + NAME_CHARS[pos[2]] * factor1 +
+           NAME_CHARS[pos[3]];
+  }
   for (; pos < end; ++pos) {
-    hash *= 0x1003f;
-    hash += *pos;
+    hash = hash * factor1 + NAME_CHARS[*pos];
   }
   return hash;
 }
 
+/**
+ * @return true if the extension (without the dot) matches the lower case value
+ */
+static bool extensionIs(std::string_view extension, std::string_view value)
+{
+  if (extension.size() != value.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < value.size(); ++i) {
+    if (NAME_CHARS[extension[i]] != static_cast<unsigned char>(value[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
 /**
  * @brief calculateBSAHash
  * @param fileName
  * @return
  * @note the hash calculated for folders seem to be wrong
  */
-BSAHash calculateBSAHash(const std::string& fileName)
+BSAHash calculateBSAHash(std::string_view fileName)
 {
-  char fileNameLower[FILENAME_MAX + 1];
-  int i = 0;
-  for (; i < FILENAME_MAX && fileName[i] != '\0'; ++i) {
-    fileNameLower[i] = tolower(fileName[i]);
-    if (fileNameLower[i] == '/') {
-      fileNameLower[i] = '\\';
-    }
+  // the name is normalized character by character while it's hashed instead of
+  // making a lower case copy first
+  size_t length = fileName.rfind('.');
+  if (length == std::string_view::npos) {
+    length = fileName.size();
   }
-  fileNameLower[i] = '\0';
-
-  unsigned char* fileNameLowerU = reinterpret_cast<unsigned char*>(fileNameLower);
-
-  size_t length = strlen(fileNameLower);
-
-  char* ext = strrchr(fileNameLower, '.');
-  if (ext == nullptr) {
-    ext = fileNameLower + length;
-  }
-
-  size_t extLen = strlen(ext);
-  length -= extLen;
-
-  unsigned char* extU = reinterpret_cast<unsigned char*>(ext);
+  std::string_view ext = fileName.substr(length);
+  const char* name     = fileName.data();
 
   BSAHash hash1 = 0ULL;
 
   if (length > 0) {
-    hash1 = static_cast<BSAHash>(fileNameLowerU[length - 1] |
-                                 ((length > 2 ? fileNameLowerU[length - 2] : 0) << 8) |
-                                 (length << 16) | (fileNameLowerU[0] << 24));
+    unsigned char last       = NAME_CHARS[name[length - 1]];
+    unsigned char secondLast = (length > 2) ? NAME_CHARS[name[length - 2]] : 0;
+    hash1 = static_cast<BSAHash>(last | (secondLast << 8) | (length << 16) |
+                                 (NAME_CHARS[name[0]] << 24));
   }
 
-  if (extLen > 0) {
-    if (strcmp(ext + 1, "kf") == 0) {
+  if (ext.size() > 0) {
+    if (extensionIs(ext.substr(1), "kf")) {
       hash1 |= 0x80;
-    } else if (strcmp(ext + 1, "nif") == 0) {
+    } else if (extensionIs(ext.substr(1), "nif")) {
       hash1 |= 0x8000;
-    } else if (strcmp(ext + 1, "dds") == 0) {
+    } else if (extensionIs(ext.substr(1), "dds")) {
       hash1 |= 0x8080;
-    } else if (strcmp(ext + 1, "wav") == 0) {
+    } else if (extensionIs(ext.substr(1), "wav")) {
       hash1 |= 0x80000000;
     }
 
-    BSAHash hash2 = static_cast<BSAHash>(genHashInt(fileNameLowerU + 1, extU - 2)) +
-                    static_cast<BSAHash>(genHashInt(extU, extU + strlen(ext)));
+    BSAHash hash2 = 0ULL;
+    if (length > 3) {
+      hash2 = genHashInt(name + 1, name + length - 2);
+    }
+    hash2 += genHashInt(ext.data(), ext.data() + ext.size());
 
     hash1 |= (hash2 & 0xFFFFFFFF) << 32;
   }
 
   return hash1;
 }
+
+void calculateBSAHashes(std::span<const std::string_view> fileNames,
+                        std::span<BSAHash> hashes)
+{
+  size_t count = (std::min)(fileNames.size(), hashes.size());
+  for (size_t i = 0; i < count; ++i) {
+    hashes[i] = calculateBSAHash(fileNames[i]);
+  }
+}
+
+BSAUInt calculateBA2Hash(std::string_view name)
+{
+  static const struct CRCTable
+  {
+    BSAUInt values[256];
+
+    CRCTable()
+    {
+      for (BSAUInt i = 0; i < 256; ++i) {
+        BSAUInt value = i;
+        for (int bit = 0; bit < 8; ++bit) {
+          value = (value & 1) ? (value >> 1) ^ 0xEDB88320 : value >> 1;
+        }
+        values[i] = value;
+      }
+    }
+  } table;
+
+  // unlike the usual crc32 the games neither invert the start value nor the result
+  BSAUInt hash = 0;
+  for (char c : name) {
+    hash = (hash >> 8) ^ table.values[(hash ^ NAME_CHARS[c]) & 0xFF];
+  }
+  return hash;
+}
+
+bool pathEquals(std::string_view lhs, std::string_view rhs)
+{
+  if (lhs.size() != rhs.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < lhs.size(); ++i) {
+    if (NAME_CHARS[lhs[i]] != NAME_CHARS[rhs[i]]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static const uint64_t XXH_PRIME1 = 11400714785074694791ULL;
+static const uint64_t XXH_PRIME2 = 14029467366897019727ULL;
+static const uint64_t XXH_PRIME3 = 1609587929392839161ULL;
+static const uint64_t XXH_PRIME4 = 9650029242287828579ULL;
+static const uint64_t XXH_PRIME5 = 2870177450012600261ULL;
+
+static uint64_t rotateLeft(uint64_t value, int bits)
+{
+  return (value << bits) | (value >> (64 - bits));
+}
+
+template <typename T>
+static T readUnaligned(const unsigned char* pos)
+{
+  T value;
+  memcpy(&value, pos, sizeof(T));
+  return value;
+}
+
+static uint64_t xxhRound(uint64_t accumulator, uint64_t input)
+{
+  accumulator += input * XXH_PRIME2;
+  return rotateLeft(accumulator, 31) * XXH_PRIME1;
+}
+
+static uint64_t xxhMerge(uint64_t hash, uint64_t accumulator)
+{
+  hash ^= xxhRound(0, accumulator);
+  return hash * XXH_PRIME1 + XXH_PRIME4;
+}
+
+uint64_t calculateContentHash(const void* data, size_t size)
+{
+  const unsigned char* pos = static_cast<const unsigned char*>(data);
+  const unsigned char* end = pos + size;
+
+  uint64_t hash;
+  if (size >= 32) {
+    // four independent lanes over 32 byte stripes
+    uint64_t lane1 = XXH_PRIME1 + XXH_PRIME2;
+    uint64_t lane2 = XXH_PRIME2;
+    uint64_t lane3 = 0;
+    uint64_t lane4 = 0 - XXH_PRIME1;
+    for (; end - pos >= 32; pos += 32) {
+      lane1 = xxhRound(lane1, readUnaligned<uint64_t>(pos));
+      lane2 = xxhRound(lane2, readUnaligned<uint64_t>(pos + 8));
+      lane3 = xxhRound(lane3, readUnaligned<uint64_t>(pos + 16));
+      lane4 = xxhRound(lane4, readUnaligned<uint64_t>(pos + 24));
+    }
+    hash = rotateLeft(lane1, 1) + rotateLeft(lane2, 7) + rotateLeft(lane3, 12) +
+           rotateLeft(lane4, 18);
+    hash = xxhMerge(hash, lane1);
+    hash = xxhMerge(hash, lane2);
+    hash = xxhMerge(hash, lane3);
+    hash = xxhMerge(hash, lane4);
+  } else {
+    hash = XXH_PRIME5;
+  }
+  hash += size;
+
+  for (; end - pos >= 8; pos += 8) {
+    hash ^= xxhRound(0, readUnaligned<uint64_t>(pos));
+    hash = rotateLeft(hash, 27) * XXH_PRIME1 + XXH_PRIME4;
+  }
+  if (end - pos >= 4) {
+    hash ^= readUnaligned<uint32_t>(pos) * XXH_PRIME1;
+    hash = rotateLeft(hash, 23) * XXH_PRIME2 + XXH_PRIME3;
+    pos += 4;
+  }
+  for (; pos < end; ++pos) {
+    hash ^= *pos * XXH_PRIME5;
+    hash = rotateLeft(hash, 11) * XXH_PRIME1;
+  }
+
+  hash ^= hash >> 33;
+  hash *= XXH_PRIME2;
+  hash ^= hash >> 29;
+  hash *= XXH_PRIME3;
+  hash ^= hash >> 32;
+  return hash;
+}
@@ -22,8 +22,49 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #define FILEHASH_H
 
 #include "bsatypes.h"
+#include <span>
 #include <string>
+#include <string_view>
 
-BSAHash calculateBSAHash(const std::string& fileName);
+/**
+ * calculate the hash used by bsa archives for a file name or folder path. Case and the
+ * kind of slashes don't matter
+ */
+BSAHash calculateBSAHash(std::string_view fileName);
+
+/**
+ * calculate the bsa hashes of many names at once
+ * @param fileNames the names to hash
+ * @param hashes receives the hash of each name. Only as many names as there is room
+ *               for are hashed
+ */
+void calculateBSAHashes(std::span<const std::string_view> fileNames,
+                        std::span<BSAHash> hashes);
+
+/**
+ * calculate the hash used by ba2 archives for the base name, extension-less, or the
+ * directory of a file. This is a crc32 of the lower case name with backslashes
+ */
+BSAUInt calculateBA2Hash(std::string_view name);
+
+/**
+ * @return true for both kinds of slashes
+ */
+inline bool isPathSeparator(char c)
+{
+  return (c == '\\') || (c == '/');
+}
+
+/**
+ * compare names or paths inside an archive the way the games do, ignoring case and
+ * treating slashes and backslashes alike
+ */
+bool pathEquals(std::string_view lhs, std::string_view rhs);
+
+/**
+ * calculate a 64 bit hash of file contents, used to find files with the same data.
+ * This is xxHash64 with a seed of 0
+ */
+uint64_t calculateContentHash(const void* data, size_t size);
 
 #endif  // FILEHASH_H
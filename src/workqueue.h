@@ -0,0 +1,249 @@
+/*
+Mod Organizer BSA handling
+
+Copyright (C) 2012 Sebastian Herbord. All rights reserved.
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 3 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <utility>
+#ifndef Q_MOC_RUN
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#endif  // Q_MOC_RUN
+
+namespace BSA
+{
+
+/**
+ * @brief bounded queue connecting the stages of the extraction pipeline. Any number of
+ * threads may push and pop concurrently
+ */
+template <typename T>
+class WorkQueue
+{
+
+public:
+  /**
+   * @param capacity number of items the queue holds before push blocks
+   */
+  explicit WorkQueue(size_t capacity)
+      : m_Capacity(capacity), m_Peak(0), m_Closed(false), m_Canceled(false)
+  {}
+
+  /**
+   * add an item, blocks while the queue is full
+   * @return false if the queue was canceled, the item is dropped in that case
+   */
+  bool push(T item)
+  {
+    boost::unique_lock<boost::mutex> lock(m_Mutex);
+    while (!m_Canceled && (m_Items.size() >= m_Capacity)) {
+      m_NotFull.wait(lock);
+    }
+    if (m_Canceled) {
+      return false;
+    }
+    m_Items.push_back(std::move(item));
+    if (m_Items.size() > m_Peak) {
+      m_Peak = m_Items.size();
+    }
+    m_NotEmpty.notify_one();
+    return true;
+  }
+
+  /**
+   * remove the oldest item, blocks while the queue is empty
+   * @return false once the queue is closed and all items are consumed or once it is
+   *         canceled
+   */
+  bool pop(T& item)
+  {
+    boost::unique_lock<boost::mutex> lock(m_Mutex);
+    while (!m_Canceled && !m_Closed && m_Items.empty()) {
+      m_NotEmpty.wait(lock);
+    }
+    if (m_Canceled || m_Items.empty()) {
+      return false;
+    }
+    item = std::move(m_Items.front());
+    m_Items.pop_front();
+    m_NotFull.notify_one();
+    return true;
+  }
+
+  /**
+   * signal that no more items will be pushed. Consumers still receive the items that
+   * are queued
+   */
+  void close()
+  {
+    boost::lock_guard<boost::mutex> lock(m_Mutex);
+    m_Closed = true;
+    m_NotEmpty.notify_all();
+  }
+
+  /**
+   * drop all queued items and wake up all waiting producers and consumers
+   */
+  void cancel()
+  {
+    boost::lock_guard<boost::mutex> lock(m_Mutex);
+    m_Canceled = true;
+    m_Items.clear();
+    m_NotEmpty.notify_all();
+    m_NotFull.notify_all();
+  }
+
+  /**
+   * @return number of items currently queued
+   */
+  size_t size() const
+  {
+    boost::lock_guard<boost::mutex> lock(m_Mutex);
+    return m_Items.size();
+  }
+
+  /**
+   * @return highest number of items that were queued at the same time
+   */
+  size_t peak() const
+  {
+    boost::lock_guard<boost::mutex> lock(m_Mutex);
+    return m_Peak;
+  }
+
+  /**
+   * @return number of items the queue holds before push blocks
+   */
+  size_t capacity() const { return m_Capacity; }
+
+private:
+  // copy constructor not implemented
+  WorkQueue(const WorkQueue& reference);
+
+  // assignment operator not implemented
+  WorkQueue& operator=(const WorkQueue& reference);
+
+private:
+  mutable boost::mutex m_Mutex;
+  boost::condition_variable m_NotEmpty;
+  boost::condition_variable m_NotFull;
+  std::deque<T> m_Items;
+  size_t m_Capacity;
+  size_t m_Peak;
+  bool m_Closed;
+  bool m_Canceled;
+};
+
+/**
+ * @brief limits the number of bytes held by the stages of the extraction pipeline.
+ * Space is reserved before data enters the pipeline and given back once it has left
+ */
+class ByteBudget
+{
+
+public:
+  /**
+   * @param budget number of bytes that may be reserved at the same time
+   */
+  explicit ByteBudget(uint64_t budget)
+      : m_Budget(budget), m_Used(0), m_Peak(0), m_Canceled(false)
+  {}
+
+  /**
+   * reserve space, blocks until enough has been released. A request larger than the
+   * whole budget is granted once nothing else is reserved so it can't block forever
+   * @return false if the budget was canceled
+   */
+  bool acquire(uint64_t bytes)
+  {
+    boost::unique_lock<boost::mutex> lock(m_Mutex);
+    while (!m_Canceled && (m_Used > 0) && (m_Used + bytes > m_Budget)) {
+      m_Released.wait(lock);
+    }
+    if (m_Canceled) {
+      return false;
+    }
+    m_Used += bytes;
+    if (m_Used > m_Peak) {
+      m_Peak = m_Used;
+    }
+    return true;
+  }
+
+  /**
+   * give back space reserved with acquire
+   */
+  void release(uint64_t bytes)
+  {
+    boost::lock_guard<boost::mutex> lock(m_Mutex);
+    m_Used -= bytes;
+    m_Released.notify_all();
+  }
+
+  /**
+   * wake up everyone waiting for space, acquire fails from now on
+   */
+  void cancel()
+  {
+    boost::lock_guard<boost::mutex> lock(m_Mutex);
+    m_Canceled = true;
+    m_Released.notify_all();
+  }
+
+  /**
+   * @return number of bytes currently reserved
+   */
+  uint64_t used() const
+  {
+    boost::lock_guard<boost::mutex> lock(m_Mutex);
+    return m_Used;
+  }
+
+  /**
+   * @return highest number of bytes that were reserved at the same time
+   */
+  uint64_t peak() const
+  {
+    boost::lock_guard<boost::mutex> lock(m_Mutex);
+    return m_Peak;
+  }
+
+private:
+  // copy constructor not implemented
+  ByteBudget(const ByteBudget& reference);
+
+  // assignment operator not implemented
+  ByteBudget& operator=(const ByteBudget& reference);
+
+private:
+  mutable boost::mutex m_Mutex;
+  boost::condition_variable m_Released;
+  uint64_t m_Budget;
+  uint64_t m_Used;
+  uint64_t m_Peak;
+  bool m_Canceled;
+};
+
+}  // namespace BSA
+
+#endif  // WORKQUEUE_H